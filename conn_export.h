@@ -0,0 +1,79 @@
+/*
+ *      Layout of the connection table written by ipvsadm -Lc --export,
+ *      made to be mmap()ed by analysis tools.  A header gives the number
+ *      of entries and the file offset of each table, all numbers are in
+ *      the byte order of the machine that wrote the file and addresses
+ *      are in network byte order.
+ *
+ *      Released under the terms of the GNU GPL
+ *
+ */
+
+#ifndef CONN_EXPORT_FLIM
+#define CONN_EXPORT_FLIM
+
+#include <stdint.h>
+
+
+#define CONN_EXPORT_MAGIC	"IPVSCONN"
+#define CONN_EXPORT_VERSION	1
+
+/* reads back as 0x01020304 in the byte order of the writer */
+#define CONN_EXPORT_BYTE_ORDER	0x01020304
+
+struct conn_export_header {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  uint64_t time;		/* when the table was read, seconds
+				   since the epoch */
+  uint64_t num_records;
+  uint64_t records;		/* offset of the struct conn_export_record
+				   table, in table order */
+  uint64_t num_pairs;
+  uint64_t pairs;		/* struct conn_export_pair */
+  uint64_t num_addrs6;
+  uint64_t addrs6;		/* IPv6 client addresses, 16 bytes each */
+  uint64_t num_states;
+  uint64_t states;		/* state names, NUL padded to 16 bytes */
+  uint64_t num_pe;
+  uint64_t pe;			/* struct conn_export_pe, by record */
+};
+
+
+/* flags of a record */
+#define CONN_EXPORT_CADDR6	0x01	/* caddr indexes the addrs6 table */
+#define CONN_EXPORT_PE		0x02	/* the record has persistence data */
+
+/* one connection */
+struct conn_export_record {
+  uint32_t caddr;		/* client IPv4 address, or CONN_EXPORT_CADDR6 */
+  uint32_t expires;		/* seconds left */
+  uint32_t pair;		/* index into the pairs table */
+  uint16_t cport;
+  uint8_t state;		/* index into the states table */
+  uint8_t flags;
+};
+
+/* a virtual server and one of its real servers */
+struct conn_export_pair {
+  char protocol[8];		/* as named in /proc/net/ip_vs_conn */
+  uint8_t vaf;			/* AF_INET or AF_INET6 */
+  uint8_t daf;
+  uint16_t vport;
+  uint16_t dport;
+  uint16_t pad;
+  uint8_t vaddr[16];
+  uint8_t daddr[16];
+};
+
+/* the persistence engine data of a record */
+struct conn_export_pe {
+  uint32_t record;		/* index into the records table */
+  uint16_t data_len;
+  uint16_t pad;
+  char name[16];		/* NUL padded */
+  char data[256];
+};
+
+#endif
@@ -95,14 +95,22 @@
 #include <stdlib.h>
 #include <netdb.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ctype.h>
+#include <time.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>           /* For waitpid */
 #include <arpa/inet.h>
 
@@ -115,6 +123,8 @@
 #define IPVS_OPTION_PROCESSING	"popt"
 
 #include "config_stream.h"
+#include "output_buffer.h"
+#include "conn_export.h"
 #include "libipvs/libipvs.h"
 
 #define IPVSADM_VERSION_NO	"v" VERSION
@@ -182,14 +192,29 @@ static const char* cmdnames[] = {
 #define OPT_EXACT		0x100000
 #define OPT_ONEPACKET		0x200000
 #define OPT_PERSISTENCE_ENGINE  0x400000
-#define NUMBER_OF_OPT		23
+#define OPT_JSON		0x800000
+#define OPT_FILTER		0x1000000
+#define OPT_TOP			0x2000000
+#define OPT_BY			0x4000000
+#define OPT_WATCH		0x8000000
+#define OPT_BY_RS		0x10000000
+#define OPT_EXPORT_METRICS	0x20000000
+#define OPT_CONN_FILTER		0x40000000
+#define OPT_SUMMARY		0x80000000
+#define OPT_EXPORT		0x100000000ULL
+#define OPT_PERSIST_REPORT	0x200000000ULL
+#define OPT_EXPIRY_REPORT	0x400000000ULL
+#define OPT_EXPIRY_TIMEOUTS	0x800000000ULL
+#define NUMBER_OF_OPT		36
+
+/* -L modes that each replace the listing, at most one may be given */
+#define OPT_LIST_MODES		(OPT_TOP|OPT_WATCH|OPT_BY_RS|OPT_EXPORT_METRICS)
 
 static const char* optnames[] = {
 	"numeric",
 	"connection",
 	"service-address",
 	"scheduler",
-	"pe",
 	"persistent",
 	"netmask",
 	"real-server",
@@ -208,6 +233,20 @@ static const char* optnames[] = {
 	"syncid",
 	"exact",
 	"ops",
+	"pe",
+	"json",
+	"filter",
+	"top",
+	"by",
+	"watch",
+	"by-real-server",
+	"export-metrics",
+	"conn-filter",
+	"summary",
+	"export",
+	"persistence-report",
+	"expiry-report",
+	"expiry-timeouts",
 };
 
 /*
@@ -220,21 +259,21 @@ static const char* optnames[] = {
  */
 static const char commands_v_options[NUMBER_OF_CMD][NUMBER_OF_OPT] =
 {
-	/*   -n   -c   svc  -s   -p   -M   -r   fwd  -w   -x   -y   -mc  tot  dmn  -st  -rt  thr  -pc  srt  sid  -ex  ops */
-/*ADD*/     {'x', 'x', '+', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' '},
-/*EDIT*/    {'x', 'x', '+', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' '},
-/*DEL*/     {'x', 'x', '+', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*FLUSH*/   {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*LIST*/    {' ', '1', '1', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', '1', '1', ' ', ' ', ' ', ' ', ' ', ' ', ' ', 'x'},
-/*ADDSRV*/  {'x', 'x', '+', 'x', 'x', 'x', '+', ' ', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*DELSRV*/  {'x', 'x', '+', 'x', 'x', 'x', '+', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*EDITSRV*/ {'x', 'x', '+', 'x', 'x', 'x', '+', ' ', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*TIMEOUT*/ {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*STARTD*/  {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' ', 'x', 'x'},
-/*STOPD*/   {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' ', 'x', 'x'},
-/*RESTORE*/ {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*SAVE*/    {' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*ZERO*/    {'x', 'x', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+	/*   -n   -c   svc  -s   -p   -M   -r   fwd  -w   -x   -y   -mc  tot  dmn  -st  -rt  thr  -pc  srt  sid  -ex  ops  pe   json flt  top  by   wch  brs  exp  cflt sum xpt prp exr  ext */
+/*ADD*/     {'x', 'x', '+', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*EDIT*/    {'x', 'x', '+', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*DEL*/     {'x', 'x', '+', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*FLUSH*/   {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*LIST*/    {' ', '1', '1', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', '1', '1', ' ', ' ', ' ', ' ', ' ', ' ', ' ', 'x', 'x', ' ', ' ', '1', ' ', '1', '1', '1', ' ', ' ', ' ', ' ', ' ', ' '},
+/*ADDSRV*/  {'x', 'x', '+', 'x', 'x', 'x', '+', ' ', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*DELSRV*/  {'x', 'x', '+', 'x', 'x', 'x', '+', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*EDITSRV*/ {'x', 'x', '+', 'x', 'x', 'x', '+', ' ', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*TIMEOUT*/ {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*STARTD*/  {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*STOPD*/   {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*RESTORE*/ {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*SAVE*/    {' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*ZERO*/    {'x', 'x', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
 };
 
 /* printing format flags */
@@ -247,11 +286,69 @@ static const char commands_v_options[NUMBER_OF_CMD][NUMBER_OF_OPT] =
 #define FMT_PERSISTENTCONN	0x0020
 #define FMT_NOSORT		0x0040
 #define FMT_EXACT		0x0080
+#define FMT_JSON		0x0100
+
+/* longest address:port written in a listing */
+#define ADDRPORT_MAXLEN		59
+/* room for "-f <fwmark> -6" or "TCP  <address:port>" */
+#define SVC_NAME_MAXLEN		(ADDRPORT_MAXLEN + 16)
 
 #define SERVICE_NONE		0x0000
 #define SERVICE_ADDR		0x0001
 #define SERVICE_PORT		0x0002
 
+/* the parts of a --filter expression that are set */
+#define FILTER_VIP		0x0001
+#define FILTER_PROTO		0x0002
+#define FILTER_SCHED		0x0004
+#define FILTER_RS		0x0008
+
+/* the parts of a --conn-filter expression that are set */
+#define CONN_FILTER_CLIENT	0x0001
+#define CONN_FILTER_VIP		0x0002
+#define CONN_FILTER_RS		0x0004
+#define CONN_FILTER_PROTO	0x0008
+#define CONN_FILTER_STATE	0x0010
+#define CONN_FILTER_EXPIRES	0x0020
+
+/* what --by ranks --top with, indexes into top_metrics */
+#define TOP_CPS			0
+#define TOP_INPPS		1
+#define TOP_OUTPPS		2
+#define TOP_INBPS		3
+#define TOP_OUTBPS		4
+#define TOP_ACTIVECONNS		5
+#define TOP_INACTCONNS		6
+
+struct list_filter {
+	unsigned int		set;
+	int			vip_af;
+	union nf_inet_addr	vip;
+	int			vip_plen;
+	unsigned short		protocol;	/* 0 for fwmark services */
+	char			sched_name[IP_VS_SCHEDNAME_MAXLEN];
+	int			rs_af;
+	union nf_inet_addr	rs;
+	int			rs_plen;
+};
+
+struct conn_filter {
+	unsigned int		set;
+	int			client_af;
+	union nf_inet_addr	client;
+	int			client_plen;
+	int			vip_af;
+	union nf_inet_addr	vip;
+	int			vip_plen;
+	int			rs_af;
+	union nf_inet_addr	rs;
+	int			rs_plen;
+	char			protocol[8];	/* as in the proc file */
+	char			state[16];
+	unsigned int		expires_min;
+	unsigned int		expires_max;
+};
+
 /* default scheduler */
 #define DEF_SCHED		"wlc"
 
@@ -285,6 +382,19 @@ enum {
 	TAG_SORT,
 	TAG_NO_SORT,
 	TAG_PERSISTENCE_ENGINE,
+	TAG_JSON,
+	TAG_FILTER,
+	TAG_TOP,
+	TAG_BY,
+	TAG_WATCH,
+	TAG_BY_RS,
+	TAG_EXPORT_METRICS,
+	TAG_CONN_FILTER,
+	TAG_SUMMARY,
+	TAG_EXPORT,
+	TAG_PERSIST_REPORT,
+	TAG_EXPIRY_REPORT,
+	TAG_EXPIRY_TIMEOUTS,
 };
 
 /* various parsing helpers & parsing functions */
@@ -292,21 +402,32 @@ static int str_is_digit(const char *str);
 static int string_to_number(const char *s, int min, int max);
 static int host_to_addr(const char *name, struct in_addr *addr);
 static char * addr_to_host(int af, const void *addr);
-static char * addr_to_anyname(int af, const void *addr);
+static void resolve_addr(int af, const void *addr);
+static void resolve_service(ipvs_service_entry_t *se,
+			    struct ip_vs_get_dests *d);
+static void resolve_snapshot(ipvs_snapshot_t *s);
+static void resolve_run(void);
+static void resolve_restart(void);
 static int service_to_port(const char *name, unsigned short proto);
 static char * port_to_service(unsigned short port, unsigned short proto);
-static char * port_to_anyname(unsigned short port, unsigned short proto);
-static char * addrport_to_anyname(int af, const void *addr, unsigned short port,
-				  unsigned short proto, unsigned int format);
+static char *format_addrport(char *p, int af, const void *addr,
+			     unsigned short port, unsigned short proto,
+			     unsigned int format);
 static int parse_service(char *buf, ipvs_service_t *svc);
 static int parse_netmask(char *buf, u_int32_t *addr);
 static int parse_timeout(char *buf, int min, int max);
 static unsigned int parse_fwmark(char *buf);
+static void parse_filter(char *buf, struct list_filter *f);
+static void parse_conn_filter(char *buf, struct conn_filter *f);
+static void parse_expiry_timeouts(char *buf, ipvs_timeout_t *t);
+static int prefix_match(int af, const union nf_inet_addr *addr,
+			int faf, const union nf_inet_addr *prefix, int plen);
 
 /* check the options based on the commands_v_options table */
-static void generic_opt_check(int command, int options);
+static void generic_opt_check(int command, unsigned long long options);
 static void set_command(int *cmd, const int newcmd);
-static void set_option(unsigned int *options, unsigned int option);
+static void set_option(unsigned long long *options,
+		       unsigned long long option);
 
 static void tryhelp_exit(const char *program, const int exit_status);
 static void usage_exit(const char *program, const int exit_status);
@@ -315,11 +436,38 @@ static void version(FILE *stream);
 static void fail(int err, char *msg, ...);
 
 /* various listing functions */
+static output_buffer_t output;
+static struct list_filter list_filter;
+static struct conn_filter conn_filter;
+static unsigned int top_count;
+static int top_by = TOP_CPS;
+static unsigned int watch_interval;
+static const char *metrics_target;
+static const char *export_path;
+static ipvs_timeout_t expiry_timeouts;
+static const char *top_metrics[] = {
+	"cps",
+	"inpps",
+	"outpps",
+	"inbps",
+	"outbps",
+	"activeconns",
+	"inactconns",
+	NULL
+};
 static void list_conn(unsigned int format);
+static void list_conn_summary(unsigned int format);
+static void export_conn(void);
+static void list_persistence_report(unsigned int format);
+static void list_expiry_report(unsigned int format);
 static void list_service(ipvs_service_t *svc, unsigned int format);
 static void list_all(unsigned int format);
-static void list_timeout(void);
-static void list_daemon(void);
+static void list_timeout(unsigned int format);
+static void list_daemon(unsigned int format);
+static void list_top(unsigned int format);
+static void list_watch(unsigned int format);
+static void list_by_real_server(unsigned int format);
+static void export_metrics(void);
 
 static int modprobe_ipvs(void);
 static void check_ipvs_version(void);
@@ -359,7 +507,7 @@ int main(int argc, char **argv)
 
 static int
 parse_options(int argc, char **argv, struct ipvs_command_entry *ce,
-	      unsigned int *options, unsigned int *format)
+	      unsigned long long *options, unsigned int *format)
 {
 	int c, parse;
 	poptContext context;
@@ -426,6 +574,28 @@ parse_options(int argc, char **argv, struct ipvs_command_entry *ce,
 		{ "ops", 'o', POPT_ARG_NONE, NULL, 'o', NULL, NULL },
 		{ "pe", '\0', POPT_ARG_STRING, &optarg, TAG_PERSISTENCE_ENGINE,
 		  NULL, NULL },
+		{ "json", '\0', POPT_ARG_NONE, NULL, TAG_JSON, NULL, NULL },
+		{ "filter", '\0', POPT_ARG_STRING, &optarg, TAG_FILTER,
+		  NULL, NULL },
+		{ "top", '\0', POPT_ARG_STRING, &optarg, TAG_TOP, NULL, NULL },
+		{ "by", '\0', POPT_ARG_STRING, &optarg, TAG_BY, NULL, NULL },
+		{ "watch", '\0', POPT_ARG_STRING, &optarg, TAG_WATCH,
+		  NULL, NULL },
+		{ "by-real-server", '\0', POPT_ARG_NONE, NULL, TAG_BY_RS,
+		  NULL, NULL },
+		{ "export-metrics", '\0', POPT_ARG_STRING, &optarg,
+		  TAG_EXPORT_METRICS, NULL, NULL },
+		{ "conn-filter", '\0', POPT_ARG_STRING, &optarg,
+		  TAG_CONN_FILTER, NULL, NULL },
+		{ "summary", '\0', POPT_ARG_NONE, NULL, TAG_SUMMARY, NULL, NULL },
+		{ "export", '\0', POPT_ARG_STRING, &optarg, TAG_EXPORT,
+		  NULL, NULL },
+		{ "persistence-report", '\0', POPT_ARG_NONE, NULL,
+		  TAG_PERSIST_REPORT, NULL, NULL },
+		{ "expiry-report", '\0', POPT_ARG_NONE, NULL,
+		  TAG_EXPIRY_REPORT, NULL, NULL },
+		{ "expiry-timeouts", '\0', POPT_ARG_STRING, &optarg,
+		  TAG_EXPIRY_TIMEOUTS, NULL, NULL },
 		{ NULL, 0, 0, NULL, 0, NULL, NULL }
 	};
 
@@ -656,6 +826,63 @@ parse_options(int argc, char **argv, struct ipvs_command_entry *ce,
 			set_option(options, OPT_PERSISTENCE_ENGINE);
 			strncpy(ce->svc.pe_name, optarg, IP_VS_PENAME_MAXLEN);
 			break;
+		case TAG_JSON:
+			set_option(options, OPT_JSON);
+			*format |= FMT_JSON;
+			break;
+		case TAG_FILTER:
+			set_option(options, OPT_FILTER);
+			parse_filter(optarg, &list_filter);
+			break;
+		case TAG_TOP:
+			set_option(options, OPT_TOP);
+			if ((top_count = string_to_number(optarg, 1,
+							  1000000)) == -1)
+				fail(2, "illegal top count specified");
+			break;
+		case TAG_BY:
+			set_option(options, OPT_BY);
+			for (top_by = 0; top_metrics[top_by]; top_by++)
+				if (!strcmp(optarg, top_metrics[top_by]))
+					break;
+			if (!top_metrics[top_by])
+				fail(2, "illegal top metric `%s' specified",
+				     optarg);
+			break;
+		case TAG_WATCH:
+			set_option(options, OPT_WATCH);
+			if ((watch_interval = string_to_number(optarg, 1,
+							       86400)) == -1)
+				fail(2, "illegal watch interval specified");
+			break;
+		case TAG_BY_RS:
+			set_option(options, OPT_BY_RS);
+			break;
+		case TAG_EXPORT_METRICS:
+			set_option(options, OPT_EXPORT_METRICS);
+			metrics_target = optarg;
+			break;
+		case TAG_CONN_FILTER:
+			set_option(options, OPT_CONN_FILTER);
+			parse_conn_filter(optarg, &conn_filter);
+			break;
+		case TAG_SUMMARY:
+			set_option(options, OPT_SUMMARY);
+			break;
+		case TAG_EXPORT:
+			set_option(options, OPT_EXPORT);
+			export_path = optarg;
+			break;
+		case TAG_PERSIST_REPORT:
+			set_option(options, OPT_PERSIST_REPORT);
+			break;
+		case TAG_EXPIRY_REPORT:
+			set_option(options, OPT_EXPIRY_REPORT);
+			break;
+		case TAG_EXPIRY_TIMEOUTS:
+			set_option(options, OPT_EXPIRY_TIMEOUTS);
+			parse_expiry_timeouts(optarg, &expiry_timeouts);
+			break;
 		default:
 			fail(2, "invalid option `%s'",
 			     poptBadOption(context, POPT_BADOPTION_NOALIAS));
@@ -697,6 +924,121 @@ parse_options(int argc, char **argv, struct ipvs_command_entry *ce,
 
 
 
+/*
+ * Service and real server changes read by --restore are queued here
+ * and sent to the kernel in a few large batches instead of one round
+ * trip per line.  The batch is flushed before any other command so
+ * that the order of the rules is kept.  The line of each queued change
+ * is kept beside it to tell which ones failed.
+ */
+static ipvs_batch_t *restore_batch = NULL;
+static unsigned int restore_batch_len = 0;
+static char **restore_batch_lines = NULL;
+static unsigned int restore_batch_size = 0;
+
+static int restore_batch_cmd(int cmd)
+{
+	switch (cmd) {
+	case CMD_ADD:
+		return IPVS_CMD_NEW_SERVICE;
+	case CMD_EDIT:
+		return IPVS_CMD_SET_SERVICE;
+	case CMD_DEL:
+		return IPVS_CMD_DEL_SERVICE;
+	case CMD_ADDDEST:
+		return IPVS_CMD_NEW_DEST;
+	case CMD_EDITDEST:
+		return IPVS_CMD_SET_DEST;
+	case CMD_DELDEST:
+		return IPVS_CMD_DEL_DEST;
+	}
+	return 0;
+}
+
+static int restore_batch_flush(void)
+{
+	const int *errors;
+	unsigned int i;
+	int result;
+
+	if (!restore_batch)
+		return 0;
+
+	result = ipvs_batch_commit(restore_batch);
+	if (result < 0)
+		fprintf(stderr, "%s\n", ipvs_strerror(errno));
+	else if (result > 0) {
+		errors = ipvs_batch_results(restore_batch);
+		for (i = 0; i < restore_batch_len; i++)
+			if (errors[i])
+				fprintf(stderr, "%s: %s\n",
+					restore_batch_lines[i],
+					ipvs_batch_strerror(restore_batch, i));
+	}
+
+	for (i = 0; i < restore_batch_len; i++)
+		free(restore_batch_lines[i]);
+	ipvs_batch_free(restore_batch);
+	restore_batch = NULL;
+	restore_batch_len = 0;
+	return result ? -1 : 0;
+}
+
+/* lines queued before a fail() on a later line must still be applied */
+static void restore_batch_atexit(void)
+{
+	restore_batch_flush();
+}
+
+/* the arguments of a line read by --restore, as they were given */
+static char *restore_line(int argc, char **argv)
+{
+	size_t len = 1;
+	char *line;
+	int i;
+
+	for (i = 1; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (!(line = malloc(len)))
+		return NULL;
+	*line = '\0';
+	for (i = 1; i < argc; i++) {
+		if (i > 1)
+			strcat(line, " ");
+		strcat(line, argv[i]);
+	}
+	return line;
+}
+
+static int restore_batch_queue(int cmd, struct ipvs_command_entry *ce,
+			       int argc, char **argv)
+{
+	char **lines, *line;
+
+	if (restore_batch_len == restore_batch_size) {
+		restore_batch_size = restore_batch_size ?
+			restore_batch_size * 2 : 64;
+		if (!(lines = realloc(restore_batch_lines,
+				      restore_batch_size * sizeof(*lines))))
+			fail(2, "realloc: %s", strerror(errno));
+		restore_batch_lines = lines;
+	}
+	if (!(line = restore_line(argc, argv)))
+		fail(2, "malloc: %s", strerror(errno));
+
+	if (!restore_batch && !(restore_batch = ipvs_batch_begin()))
+		goto fail;
+	if (ipvs_batch_queue(restore_batch, cmd, &ce->svc, &ce->dest))
+		goto fail;
+	restore_batch_lines[restore_batch_len++] = line;
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: %s\n", line, ipvs_strerror(errno));
+	free(line);
+	return -1;
+}
+
 static int restore_table(int argc, char **argv, int reading_stdin)
 {
 	int result = 0;
@@ -706,6 +1048,8 @@ static int restore_table(int argc, char **argv, int reading_stdin)
 	if (reading_stdin != 0)
 		tryhelp_exit(argv[0], -1);
 
+	atexit(restore_batch_atexit);
+
 	while ((a = config_stream_read(stdin, argv[0])) != NULL) {
 		int i;
 		if ((i = (int)dynamic_array_get_count(a)) > 1) {
@@ -714,13 +1058,16 @@ static int restore_table(int argc, char **argv, int reading_stdin)
 		}
 		dynamic_array_destroy(a, DESTROY_STR);
 	}
+
+	if (restore_batch_flush())
+		result = -1;
 	return result;
 }
 
 static int process_options(int argc, char **argv, int reading_stdin)
 {
 	struct ipvs_command_entry ce;
-	unsigned int options = OPT_NONE;
+	unsigned long long options = OPT_NONE;
 	unsigned int format = FMT_NONE;
 	int result = 0;
 
@@ -770,22 +1117,89 @@ static int process_options(int argc, char **argv, int reading_stdin)
 			ce.dest.port = ce.svc.port;
 	}
 
+	if (reading_stdin) {
+		int cmd = restore_batch_cmd(ce.cmd);
+
+		if (cmd)
+			return restore_batch_queue(cmd, &ce, argc, argv);
+		restore_batch_flush();
+	}
+
 	switch (ce.cmd) {
 	case CMD_LIST:
 		if ((options & (OPT_CONNECTION|OPT_TIMEOUT|OPT_DAEMON) &&
 		     options & (OPT_STATS|OPT_RATE|OPT_THRESHOLDS)) ||
 		    (options & (OPT_TIMEOUT|OPT_DAEMON) &&
-		     options & OPT_PERSISTENTCONN))
+		     options & OPT_PERSISTENTCONN) ||
+		    (options & OPT_CONNECTION && options & OPT_JSON) ||
+		    (options & OPT_SUMMARY && options & OPT_PERSISTENTCONN) ||
+		    (options & OPT_EXPORT &&
+		     options & (OPT_SUMMARY|OPT_PERSISTENTCONN)) ||
+		    (options & OPT_PERSIST_REPORT &&
+		     options & (OPT_SUMMARY|OPT_EXPORT|OPT_PERSISTENTCONN)) ||
+		    (options & OPT_EXPIRY_REPORT &&
+		     options & (OPT_SUMMARY|OPT_EXPORT|OPT_PERSIST_REPORT|
+				OPT_PERSISTENTCONN)) ||
+		    (options & OPT_FILTER &&
+		     options & (OPT_CONNECTION|OPT_SERVICE|OPT_TIMEOUT|
+				OPT_DAEMON)) ||
+		    (options & OPT_LIST_MODES &
+		     ((options & OPT_LIST_MODES) - 1)) ||
+		    (options & OPT_LIST_MODES &&
+		     options & (OPT_CONNECTION|OPT_SERVICE|OPT_TIMEOUT|
+				OPT_DAEMON)) ||
+		    (options & (OPT_TOP|OPT_WATCH) &&
+		     options & (OPT_STATS|OPT_RATE|OPT_THRESHOLDS|
+				OPT_PERSISTENTCONN|OPT_NOSORT)) ||
+		    (options & OPT_BY_RS &&
+		     options & (OPT_THRESHOLDS|OPT_PERSISTENTCONN)) ||
+		    (options & OPT_EXPORT_METRICS &&
+		     options & (OPT_STATS|OPT_RATE|OPT_THRESHOLDS|
+				OPT_PERSISTENTCONN|OPT_NOSORT|OPT_JSON)))
 			fail(2, "options conflicts in the list command");
-
-		if (options & OPT_CONNECTION)
+		if (options & OPT_BY && !(options & OPT_TOP))
+			fail(2, "--by is only valid with --top");
+		if (options & OPT_CONN_FILTER && !(options & OPT_CONNECTION))
+			fail(2, "--conn-filter is only valid with -c");
+		if (options & OPT_SUMMARY && !(options & OPT_CONNECTION))
+			fail(2, "--summary is only valid with -c");
+		if (options & OPT_EXPORT && !(options & OPT_CONNECTION))
+			fail(2, "--export is only valid with -c");
+		if (options & OPT_PERSIST_REPORT &&
+		    !(options & OPT_CONNECTION))
+			fail(2, "--persistence-report is only valid with -c");
+		if (options & OPT_EXPIRY_REPORT &&
+		    !(options & OPT_CONNECTION))
+			fail(2, "--expiry-report is only valid with -c");
+		if (options & OPT_EXPIRY_TIMEOUTS &&
+		    !(options & OPT_EXPIRY_REPORT))
+			fail(2, "--expiry-timeouts is only valid with "
+			     "--expiry-report");
+
+		if (options & OPT_SUMMARY)
+			list_conn_summary(format);
+		else if (options & OPT_EXPORT)
+			export_conn();
+		else if (options & OPT_PERSIST_REPORT)
+			list_persistence_report(format);
+		else if (options & OPT_EXPIRY_REPORT)
+			list_expiry_report(format);
+		else if (options & OPT_CONNECTION)
 			list_conn(format);
 		else if (options & OPT_SERVICE)
 			list_service(&ce.svc, format);
 		else if (options & OPT_TIMEOUT)
-			list_timeout();
+			list_timeout(format);
 		else if (options & OPT_DAEMON)
-			list_daemon();
+			list_daemon(format);
+		else if (options & OPT_TOP)
+			list_top(format);
+		else if (options & OPT_WATCH)
+			list_watch(format);
+		else if (options & OPT_BY_RS)
+			list_by_real_server(format);
+		else if (options & OPT_EXPORT_METRICS)
+			export_metrics();
 		else
 			list_all(format);
 		return 0;
@@ -924,6 +1338,179 @@ static int parse_netmask(char *buf, u_int32_t *addr)
 }
 
 
+/*
+ * Get a numeric address with an optional /prefix length, the whole
+ * address if there is none.
+ * Return 0 if failed,
+ *	  1 if addr read
+ */
+static int
+parse_prefix(char *buf, int *af, union nf_inet_addr *addr, int *plen)
+{
+	char *lenp;
+	int max;
+
+	if ((lenp = strchr(buf, '/')) != NULL)
+		*lenp++ = '\0';
+
+	memset(addr, 0, sizeof(*addr));
+	if (inet_pton(AF_INET, buf, &addr->ip) > 0) {
+		*af = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, &addr->in6) > 0) {
+		*af = AF_INET6;
+		max = 128;
+	} else
+		return 0;
+
+	if (lenp == NULL)
+		*plen = max;
+	else if ((*plen = string_to_number(lenp, 0, max)) == -1)
+		return 0;
+
+	return 1;
+}
+
+
+/*
+ * Parse a --filter expression: comma separated vip=prefix,
+ * proto=tcp|udp|fwmark, sched=scheduler and rs=prefix, all of which
+ * must match.
+ */
+static void parse_filter(char *buf, struct list_filter *f)
+{
+	char *item, *value;
+
+	for (item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+		if ((value = strchr(item, '=')) == NULL)
+			fail(2, "invalid filter `%s' specified", item);
+		*value++ = '\0';
+
+		if (!strcmp(item, "vip")) {
+			if (!parse_prefix(value, &f->vip_af, &f->vip,
+					  &f->vip_plen))
+				fail(2, "illegal filter address `%s' "
+				     "specified", value);
+			f->set |= FILTER_VIP;
+		} else if (!strcmp(item, "proto")) {
+			if (!strcmp(value, "tcp"))
+				f->protocol = IPPROTO_TCP;
+			else if (!strcmp(value, "udp"))
+				f->protocol = IPPROTO_UDP;
+			else if (!strcmp(value, "fwmark"))
+				f->protocol = 0;
+			else
+				fail(2, "illegal filter protocol `%s' "
+				     "specified", value);
+			f->set |= FILTER_PROTO;
+		} else if (!strcmp(item, "sched")) {
+			if (strlen(value) >= IP_VS_SCHEDNAME_MAXLEN)
+				fail(2, "illegal scheduler `%s' specified",
+				     value);
+			strncpy(f->sched_name, value,
+				IP_VS_SCHEDNAME_MAXLEN - 1);
+			f->set |= FILTER_SCHED;
+		} else if (!strcmp(item, "rs")) {
+			if (!parse_prefix(value, &f->rs_af, &f->rs,
+					  &f->rs_plen))
+				fail(2, "illegal filter address `%s' "
+				     "specified", value);
+			f->set |= FILTER_RS;
+		} else
+			fail(2, "invalid filter `%s' specified", item);
+	}
+}
+
+
+/*
+ * Parse a --conn-filter expression: comma separated client=prefix,
+ * vip=prefix, rs=prefix, proto=name, state=name and expires=[min]-[max]
+ * in seconds, all of which must match.
+ */
+static void parse_conn_filter(char *buf, struct conn_filter *f)
+{
+	char *item, *value, *max;
+	int lo, hi;
+
+	for (item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+		if ((value = strchr(item, '=')) == NULL)
+			fail(2, "invalid connection filter `%s' specified",
+			     item);
+		*value++ = '\0';
+
+		if (!strcmp(item, "client")) {
+			if (!parse_prefix(value, &f->client_af, &f->client,
+					  &f->client_plen))
+				fail(2, "illegal filter address `%s' "
+				     "specified", value);
+			f->set |= CONN_FILTER_CLIENT;
+		} else if (!strcmp(item, "vip")) {
+			if (!parse_prefix(value, &f->vip_af, &f->vip,
+					  &f->vip_plen))
+				fail(2, "illegal filter address `%s' "
+				     "specified", value);
+			f->set |= CONN_FILTER_VIP;
+		} else if (!strcmp(item, "rs")) {
+			if (!parse_prefix(value, &f->rs_af, &f->rs,
+					  &f->rs_plen))
+				fail(2, "illegal filter address `%s' "
+				     "specified", value);
+			f->set |= CONN_FILTER_RS;
+		} else if (!strcmp(item, "proto")) {
+			if (!*value || strlen(value) >= sizeof(f->protocol))
+				fail(2, "illegal filter protocol `%s' "
+				     "specified", value);
+			strcpy(f->protocol, value);
+			f->set |= CONN_FILTER_PROTO;
+		} else if (!strcmp(item, "state")) {
+			if (!*value || strlen(value) >= sizeof(f->state))
+				fail(2, "illegal filter state `%s' "
+				     "specified", value);
+			strcpy(f->state, value);
+			f->set |= CONN_FILTER_STATE;
+		} else if (!strcmp(item, "expires")) {
+			/* a single number is both ends */
+			if ((max = strchr(value, '-')) != NULL)
+				*max++ = '\0';
+			else
+				max = value;
+			lo = *value ? string_to_number(value, 0, INT_MAX) : 0;
+			hi = *max ? string_to_number(max, 0, INT_MAX) : INT_MAX;
+			if (lo == -1 || hi == -1 || lo > hi)
+				fail(2, "illegal filter expiry range "
+				     "specified");
+			f->expires_min = lo;
+			f->expires_max = hi;
+			f->set |= CONN_FILTER_EXPIRES;
+		} else
+			fail(2, "invalid connection filter `%s' specified",
+			     item);
+	}
+}
+
+
+/*
+ * Parse the tcp,tcpfin,udp timeouts of --expiry-timeouts, 0 keeps the
+ * current one as with --set.
+ */
+static void parse_expiry_timeouts(char *buf, ipvs_timeout_t *t)
+{
+	char *v[3], *item;
+	int n = 0;
+
+	for (item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+		if (n == 3)
+			fail(2, "--expiry-timeouts requires 3 timeout values");
+		v[n++] = item;
+	}
+	if (n != 3)
+		fail(2, "--expiry-timeouts requires 3 timeout values");
+	t->tcp_timeout = parse_timeout(v[0], 0, MAX_TIMEOUT);
+	t->tcp_fin_timeout = parse_timeout(v[1], 0, MAX_TIMEOUT);
+	t->udp_timeout = parse_timeout(v[2], 0, MAX_TIMEOUT);
+}
+
+
 /*
  * Get IP address and port from the argument.
  * Result is a logical or of
@@ -991,7 +1578,7 @@ parse_service(char *buf, ipvs_service_t *svc)
 
 
 static void
-generic_opt_check(int command, int options)
+generic_opt_check(int command, unsigned long long options)
 {
 	int i, j;
 	int last = 0, count = 0;
@@ -1000,7 +1587,7 @@ generic_opt_check(int command, int options)
 	i = command - CMD_NONE -1;
 
 	for (j = 0; j < NUMBER_OF_OPT; j++) {
-		if (!(options & (1<<j))) {
+		if (!(options & (1ULL<<j))) {
 			if (commands_v_options[i][j] == '+')
 				fail(2, "You need to supply the '%s' "
 				     "option for the '%s' command",
@@ -1025,7 +1612,7 @@ generic_opt_check(int command, int options)
 }
 
 static inline const char *
-opt2name(int option)
+opt2name(unsigned long long option)
 {
 	const char **ptr;
 	for (ptr = optnames; option > 1; option >>= 1, ptr++);
@@ -1042,7 +1629,7 @@ set_command(int *cmd, const int newcmd)
 }
 
 static void
-set_option(unsigned int *options, unsigned int option)
+set_option(unsigned long long *options, unsigned long long option)
 {
 	if (*options & option)
 		fail(2, "multiple '%s' options specified", opt2name(option));
@@ -1139,7 +1726,29 @@ static void usage_exit(const char *program, const int exit_status)
 		"  --nosort                            disable sorting output of service/server entries\n"
 		"  --sort                              does nothing, for backwards compatibility\n"
 		"  --ops          -o                   one-packet scheduling\n"
-		"  --numeric      -n                   numeric output of addresses and ports\n",
+		"  --numeric      -n                   numeric output of addresses and ports\n"
+		"  --json                              output as JSON\n"
+		"  --filter vip=,proto=,sched=,rs=     list only the matching services and servers\n"
+		"  --top N                             list the N busiest services and servers\n"
+		"  --by metric                         rank --top by cps (default), inpps, outpps,\n"
+		"                                      inbps, outbps, activeconns or inactconns\n"
+		"  --watch seconds                     list again every interval with the rates\n"
+		"                                      measured over it\n"
+		"  --by-real-server                    list each real server once with the sum of\n"
+		"                                      its counters over all services\n"
+		"  --export-metrics target             write OpenMetrics to a file, or serve them\n"
+		"                                      on unix:path or tcp:[host:]port\n"
+		"  --conn-filter client=,vip=,rs=,proto=,state=,expires=min-max\n"
+		"                                      list only the matching connections\n"
+		"  --summary                           with -c, count the connections by state\n"
+		"                                      for each virtual and real server\n"
+		"  --export file                       with -c, write the connections to file\n"
+		"                                      as binary records, see conn_export.h\n"
+		"  --persistence-report                with -c, count the persistence templates\n"
+		"                                      by real server for each service\n"
+		"  --expiry-report                     with -c, histograms of the seconds left by\n"
+		"                                      state, and the table with other timeouts\n"
+		"  --expiry-timeouts tcp,tcpfin,udp    timeouts for --expiry-report to project\n",
 		DEF_SCHED);
 
 	exit(exit_status);
@@ -1224,96 +1833,505 @@ static void check_ipvs_version(void)
 }
 
 
-static void print_conn(char *buf, unsigned int format)
+/*
+ * Listing connections: /proc/net/ip_vs_conn is read whole and cut into
+ * chunks of lines for worker threads.  Each line is cut into its fields
+ * where it lies, and only then are the fields decoded, hex through a
+ * table, for the formatters to write.  The line ends are found with
+ * memchr(), which libc vectorizes.
+ */
+#define CONN_READ_SIZE		(1 << 20)
+#define CONN_CHUNK_SIZE		(4 << 20)
+#define CONN_MAX_THREADS	64
+
+/* the fields of a line, in the order the kernel writes them */
+#define CONN_PROTO		0
+#define CONN_CADDR		1
+#define CONN_CPORT		2
+#define CONN_VADDR		3
+#define CONN_VPORT		4
+#define CONN_DADDR		5
+#define CONN_DPORT		6
+#define CONN_STATE		7
+#define CONN_EXPIRES		8
+#define CONN_PE_NAME		9
+#define CONN_PE_DATA		10
+#define CONN_FIELDS		11
+
+/* no field is written longer than this */
+#define CONN_FIELD_MAXLEN	255
+
+struct conn_line {
+	char			*f[CONN_FIELDS];
+	int			len[CONN_FIELDS];
+	int			n;
+};
+
+/* value + 1 of each hex digit, 0 for anything else */
+static const unsigned char hex_digit[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15,
+	['F'] = 16, ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14,
+	['e'] = 15, ['f'] = 16,
+};
+
+static int conn_split(char *p, char *end, struct conn_line *l)
 {
-	char            protocol[8];
-	unsigned short  proto;
-	union nf_inet_addr  caddr;
-	unsigned short  cport;
-	union nf_inet_addr  vaddr;
-	unsigned short  vport;
-	union nf_inet_addr  daddr;
-	unsigned short  dport;
-	char            state[16];
-	unsigned int    expires;
-	unsigned short  af = AF_INET;
-	char		pe_name[IP_VS_PENAME_MAXLEN];
-	char		pe_data[IP_VS_PEDATA_MAXLEN];
+	int n = 0;
+
+	while (n < CONN_FIELDS) {
+		while (p < end && *p == ' ')
+			p++;
+		if (p == end)
+			break;
+		l->f[n] = p;
+		while (p < end && *p != ' ')
+			p++;
+		l->len[n] = p - l->f[n];
+		n++;
+	}
+	return l->n = n;
+}
 
-	int n;
-	char temp1[INET6_ADDRSTRLEN], temp2[INET6_ADDRSTRLEN], temp3[INET6_ADDRSTRLEN];
-	char *cname, *vname, *dname;
-	unsigned int	minutes, seconds;
-	char		expire_str[12];
+static int conn_hex(const char *s, int len, unsigned int *v)
+{
+	unsigned int x = 0, d;
 
-	if ((n = sscanf(buf, "%s %s %hX %s %hX %s %hX %s %d %s %s",
-			protocol, temp1, &cport, temp2, &vport,
-			temp3, &dport, state, &expires,
-			pe_name, pe_data)) == -1)
-		exit(1);
+	if (len < 1 || len > 8)
+		return -1;
+	while (len--) {
+		if (!(d = hex_digit[(unsigned char)*s++]))
+			return -1;
+		x = x << 4 | (d - 1);
+	}
+	*v = x;
+	return 0;
+}
+
+static int conn_uint(const char *s, int len, unsigned int *v)
+{
+	unsigned int x = 0;
+
+	if (len < 1 || len > 9)
+		return -1;
+	while (len--) {
+		if (*s < '0' || *s > '9')
+			return -1;
+		x = x * 10 + (*s++ - '0');
+	}
+	*v = x;
+	return 0;
+}
+
+/*
+ * IPv4 addresses come as 8 hex digits and IPv6 ones as 8 groups of 4,
+ * anything else is left to inet_pton()
+ */
+static int
+conn_addr(const char *s, int len, int *af, union nf_inet_addr *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	unsigned int x;
+	int i;
+
+	if (len == 8 && !conn_hex(s, 8, &x)) {
+		*af = AF_INET;
+		addr->ip = htonl(x);
+		return 0;
+	}
+	if (len == 39) {
+		for (i = 0; i < 8; i++) {
+			if ((i && s[5 * i - 1] != ':') ||
+			    conn_hex(s + 5 * i, 4, &x))
+				break;
+			addr->in6.s6_addr[2 * i] = x >> 8;
+			addr->in6.s6_addr[2 * i + 1] = x & 0xff;
+		}
+		if (i == 8) {
+			*af = AF_INET6;
+			return 0;
+		}
+	}
+
+	if (len >= sizeof(buf))
+		return -1;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	if (inet_pton(AF_INET6, buf, &addr->in6) > 0)
+		*af = AF_INET6;
+	else if (inet_pton(AF_INET, buf, &addr->ip) > 0)
+		*af = AF_INET;
+	else
+		return -1;
+	return 0;
+}
+
+/*
+ * Whether a line passes --conn-filter, decided on the raw fields so
+ * that only the addresses it looks at are decoded
+ */
+static int conn_filter_match(struct conn_line *l)
+{
+	struct conn_filter *f = &conn_filter;
+	union nf_inet_addr addr;
+	unsigned int expires;
+	int af;
+
+	if (l->n < 9)
+		return 0;
+	if (f->set & CONN_FILTER_PROTO &&
+	    (l->len[CONN_PROTO] != strlen(f->protocol) ||
+	     strncasecmp(l->f[CONN_PROTO], f->protocol, l->len[CONN_PROTO])))
+		return 0;
+	if (f->set & CONN_FILTER_STATE &&
+	    (l->len[CONN_STATE] != strlen(f->state) ||
+	     strncasecmp(l->f[CONN_STATE], f->state, l->len[CONN_STATE])))
+		return 0;
+	if (f->set & CONN_FILTER_EXPIRES &&
+	    (conn_uint(l->f[CONN_EXPIRES], l->len[CONN_EXPIRES], &expires) ||
+	     expires < f->expires_min || expires > f->expires_max))
+		return 0;
+	if (f->set & CONN_FILTER_CLIENT &&
+	    (conn_addr(l->f[CONN_CADDR], l->len[CONN_CADDR], &af, &addr) ||
+	     !prefix_match(af, &addr, f->client_af, &f->client,
+			   f->client_plen)))
+		return 0;
+	if (f->set & CONN_FILTER_VIP &&
+	    (conn_addr(l->f[CONN_VADDR], l->len[CONN_VADDR], &af, &addr) ||
+	     !prefix_match(af, &addr, f->vip_af, &f->vip, f->vip_plen)))
+		return 0;
+	if (f->set & CONN_FILTER_RS &&
+	    (conn_addr(l->f[CONN_DADDR], l->len[CONN_DADDR], &af, &addr) ||
+	     !prefix_match(af, &addr, f->rs_af, &f->rs, f->rs_plen)))
+		return 0;
+	return 1;
+}
+
+static char *format_conn_field(char *p, struct conn_line *l, int i, int width)
+{
+	char *start = p;
+
+	p = format_strn(p, l->f[i], MIN(l->len[i], CONN_FIELD_MAXLEN));
+	return format_pad(p, start, width);
+}
+
+static void
+print_conn(output_buffer_t *ob, struct conn_line *l, unsigned int format)
+{
+	union nf_inet_addr caddr, vaddr, daddr;
+	unsigned int cport, vport, dport, expires;
+	unsigned short proto;
+	int caf, vaf, daf;
+	char *p, *start;
+
+	if (l->n < 9 ||
+	    conn_addr(l->f[CONN_CADDR], l->len[CONN_CADDR], &caf, &caddr) ||
+	    conn_addr(l->f[CONN_VADDR], l->len[CONN_VADDR], &vaf, &vaddr) ||
+	    conn_addr(l->f[CONN_DADDR], l->len[CONN_DADDR], &daf, &daddr) ||
+	    conn_hex(l->f[CONN_CPORT], l->len[CONN_CPORT], &cport) ||
+	    conn_hex(l->f[CONN_VPORT], l->len[CONN_VPORT], &vport) ||
+	    conn_hex(l->f[CONN_DPORT], l->len[CONN_DPORT], &dport) ||
+	    conn_uint(l->f[CONN_EXPIRES], l->len[CONN_EXPIRES], &expires))
+		return;
 
-	if (strcmp(protocol, "TCP") == 0)
+	if (l->len[CONN_PROTO] == 3 && !memcmp(l->f[CONN_PROTO], "TCP", 3))
 		proto = IPPROTO_TCP;
-	else if (strcmp(protocol, "UDP") == 0)
+	else if (l->len[CONN_PROTO] == 3 &&
+		 !memcmp(l->f[CONN_PROTO], "UDP", 3))
 		proto = IPPROTO_UDP;
 	else
 		proto = 0;
 
-	if (inet_pton(AF_INET6, temp1, &caddr.in6) > 0) {
-		inet_pton(AF_INET6, temp2, &vaddr.in6);
-		inet_pton(AF_INET6, temp3, &daddr.in6);
-		af = AF_INET6;
-	} else if (inet_pton(AF_INET, temp1, &caddr.ip) > 0) {
-		inet_pton(AF_INET, temp2, &vaddr.ip);
-		inet_pton(AF_INET, temp3, &daddr.ip);
-	} else {
-		caddr.ip = (__u32) htonl(strtoul(temp1, NULL, 16));
-		vaddr.ip = (__u32) htonl(strtoul(temp2, NULL, 16));
-		daddr.ip = (__u32) htonl(strtoul(temp3, NULL, 16));
+	p = output_buffer_reserve(ob, OUTPUT_BUFFER_LINE);
+	p = format_conn_field(p, l, CONN_PROTO, 3);
+	*p++ = ' ';
+	start = p;
+	if (expires / 60 < 10)
+		*p++ = '0';
+	p = format_uint(p, expires / 60);
+	*p++ = ':';
+	*p++ = '0' + expires % 60 / 10;
+	*p++ = '0' + expires % 10;
+	p = format_pad(p, start, 6);
+	*p++ = ' ';
+	p = format_conn_field(p, l, CONN_STATE, 11);
+	*p++ = ' ';
+	start = p;
+	p = format_addrport(p, caf, &caddr, cport, proto, format);
+	p = format_pad(p, start, 18);
+	*p++ = ' ';
+	start = p;
+	p = format_addrport(p, vaf, &vaddr, vport, proto, format);
+	p = format_pad(p, start, 18);
+	*p++ = ' ';
+	start = p;
+	p = format_addrport(p, daf, &daddr, dport, proto, format);
+	if (format & FMT_PERSISTENTCONN && l->n == CONN_FIELDS) {
+		p = format_pad(p, start, 16);
+		*p++ = ' ';
+		p = format_conn_field(p, l, CONN_PE_NAME, 18);
+		*p++ = ' ';
+		p = format_conn_field(p, l, CONN_PE_DATA, 0);
 	}
+	*p++ = '\n';
+	output_buffer_commit(ob, p);
+}
 
-	if (!(cname = addrport_to_anyname(af, &caddr, cport, proto, format)))
-		exit(1);
-	if (!(vname = addrport_to_anyname(af, &vaddr, vport, proto, format)))
-		exit(1);
-	if (!(dname = addrport_to_anyname(af, &daddr, dport, proto, format)))
-		exit(1);
 
-	seconds = expires % 60;
-	minutes = expires / 60;
-	sprintf(expire_str, "%02d:%02d", minutes, seconds);
+/*
+ * The lines of a chunk of the table are handed to func together with
+ * the number of the worker thread, for results kept per thread, and
+ * when printing, with a buffer of what the chunk prints
+ */
+typedef void (*conn_cb_t)(struct conn_line *l, output_buffer_t *ob,
+			  int worker, void *arg);
+
+/*
+ * Called once a worker is done with a chunk, the chunks being numbered
+ * in table order.  The scan lock is held, so results kept across chunks
+ * need no locking of their own.
+ */
+typedef void (*conn_chunk_cb_t)(int chunk, int worker, void *arg);
+
+struct conn_chunk {
+	char			*p;
+	char			*end;
+	char			*out;		/* what the lines printed */
+	size_t			outlen;
+	int			done;
+};
+
+struct conn_scan {
+	conn_cb_t		func;
+	conn_chunk_cb_t		chunk_func;
+	void			*arg;
+	int			print;
+	struct conn_chunk	*chunks;
+	int			num_chunks;
+	int			next;		/* first chunk not taken */
+	int			written;	/* chunks printed so far */
+	int			window;		/* how far next may run ahead
+						   of written, 0 for no limit */
+	pthread_mutex_t		lock;
+	pthread_cond_t		done;
+};
 
-	if (format & FMT_PERSISTENTCONN && n == 11)
-		printf("%-3s %-6s %-11s %-18s %-18s %-16s %-18s %s\n",
-		       protocol, expire_str, state, cname, vname, dname,
-		       pe_name, pe_data);
-	else
-		printf("%-3s %-6s %-11s %-18s %-18s %s\n",
-		       protocol, expire_str, state, cname, vname, dname);
+struct conn_worker {
+	struct conn_scan	*s;
+	int			id;
+	pthread_t		tid;
+};
 
-	free(cname);
-	free(vname);
-	free(dname);
+static void
+conn_scan_chunk(struct conn_scan *s, struct conn_chunk *c, int worker)
+{
+	output_buffer_t ob, *obp = NULL;
+	struct conn_line l;
+	char *p, *nl;
+	FILE *f = NULL;
+
+	if (s->print) {
+		if (!(f = open_memstream(&c->out, &c->outlen)) ||
+		    output_buffer_init(&ob, f, 0))
+			fail(2, "open_memstream: %s", strerror(errno));
+		obp = &ob;
+	}
+
+	for (p = c->p; p < c->end; p = nl + 1) {
+		/* the last line may have no newline */
+		if (!(nl = memchr(p, '\n', c->end - p)))
+			nl = c->end;
+		if (conn_split(p, nl, &l) &&
+		    (!conn_filter.set || conn_filter_match(&l)))
+			s->func(&l, obp, worker, s->arg);
+	}
+
+	if (s->print) {
+		output_buffer_destroy(&ob);
+		fclose(f);
+	}
+}
+
+/* with the scan lock held */
+static void
+conn_chunk_done(struct conn_scan *s, struct conn_chunk *c, int worker)
+{
+	if (s->chunk_func)
+		s->chunk_func(c - s->chunks, worker, s->arg);
+	c->done = 1;
 }
 
+static void *conn_worker(void *arg)
+{
+	struct conn_worker *w = (struct conn_worker *)arg;
+	struct conn_scan *s = w->s;
+	struct conn_chunk *c;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->next < s->num_chunks) {
+		if (s->window && s->next >= s->written + s->window) {
+			pthread_cond_wait(&s->done, &s->lock);
+			continue;
+		}
+		c = &s->chunks[s->next++];
+		pthread_mutex_unlock(&s->lock);
+		conn_scan_chunk(s, c, w->id);
+		pthread_mutex_lock(&s->lock);
+		conn_chunk_done(s, c, w->id);
+		pthread_cond_broadcast(&s->done);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
 
-void list_conn(unsigned int format)
+/* the whole connection table, NUL terminated */
+static char *conn_read(size_t *len)
 {
-	static char buffer[256];
-	FILE *handle;
+	size_t size = CONN_READ_SIZE;
+	char *buf, *p;
+	ssize_t r;
+	int fd;
 
-	handle = fopen(CONN_PROC_FILE, "r");
-	if (!handle) {
+	if ((fd = open(CONN_PROC_FILE, O_RDONLY)) < 0) {
 		fprintf(stderr, "cannot open file %s\n", CONN_PROC_FILE);
 		exit(1);
 	}
+	if (!(buf = malloc(size)))
+		fail(2, "malloc: %s", strerror(errno));
+
+	*len = 0;
+	for (;;) {
+		if (size - *len < CONN_READ_SIZE / 2) {
+			size *= 2;
+			if (!(p = realloc(buf, size)))
+				fail(2, "realloc: %s", strerror(errno));
+			buf = p;
+		}
+		r = read(fd, buf + *len, size - *len - 1);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			fail(2, "%s: %s", CONN_PROC_FILE, strerror(errno));
+		if (r == 0)
+			break;
+		*len += r;
+	}
+	buf[*len] = '\0';
+	close(fd);
+	return buf;
+}
+
+/*
+ * Hand every line of the connection table passing --conn-filter to func.
+ * The table is read whole and cut into chunks at line ends, which are
+ * parsed by up to one thread per CPU.  When printing, the output of each
+ * chunk is written out in the order of the table, and the workers are
+ * kept at most two chunks each ahead of what has been written, so that
+ * a slow reader does not have the whole output held in memory.
+ * Returns the number of workers, the values func was given are below it
+ */
+static int
+scan_conn(conn_cb_t func, conn_chunk_cb_t chunk_func, void *arg, int print)
+{
+	struct conn_worker workers[CONN_MAX_THREADS];
+	struct conn_scan s;
+	struct conn_chunk *c;
+	char *buf, *p, *end, *e;
+	size_t len;
+	long cpus;
+	int i, n;
+
+	buf = conn_read(&len);
 
-	/* read the first line */
-	if (fgets(buffer, sizeof(buffer), handle) == NULL) {
+	/* the first line only names the fields */
+	if (!(p = memchr(buf, '\n', len))) {
 		fprintf(stderr, "unexpected input from %s\n",
 			CONN_PROC_FILE);
 		exit(1);
 	}
+	p++;
+	end = buf + len;
+
+	memset(&s, 0, sizeof(s));
+	s.func = func;
+	s.chunk_func = chunk_func;
+	s.arg = arg;
+	s.print = print;
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.done, NULL);
+	if (!(s.chunks = malloc((len / CONN_CHUNK_SIZE + 1) * sizeof(*c))))
+		fail(2, "malloc: %s", strerror(errno));
+	for (; p < end; p = e) {
+		e = end - p > CONN_CHUNK_SIZE ? p + CONN_CHUNK_SIZE : end;
+		if (e < end && (e = memchr(e, '\n', end - e)))
+			e++;
+		else
+			e = end;
+		c = &s.chunks[s.num_chunks++];
+		memset(c, 0, sizeof(*c));
+		c->p = p;
+		c->end = e;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = MIN(MIN(cpus, CONN_MAX_THREADS), s.num_chunks);
+	if (n < 1)
+		n = 1;
+	if (print)
+		s.window = 2 * n;
+
+	for (i = 1; i < n; i++) {
+		workers[i].s = &s;
+		workers[i].id = i;
+		if (pthread_create(&workers[i].tid, NULL, conn_worker,
+				   &workers[i]))
+			break;
+	}
+	n = i;
+
+	/* this thread is worker 0, and writes out what is done in order */
+	for (i = 0; i < s.num_chunks; i++) {
+		c = &s.chunks[i];
+		pthread_mutex_lock(&s.lock);
+		if (s.next == i) {
+			s.next++;
+			pthread_mutex_unlock(&s.lock);
+			conn_scan_chunk(&s, c, 0);
+			pthread_mutex_lock(&s.lock);
+			conn_chunk_done(&s, c, 0);
+		}
+		while (!c->done)
+			pthread_cond_wait(&s.done, &s.lock);
+		pthread_mutex_unlock(&s.lock);
+		if (print) {
+			fwrite(c->out, 1, c->outlen, stdout);
+			free(c->out);
+			pthread_mutex_lock(&s.lock);
+			s.written = i + 1;
+			pthread_cond_broadcast(&s.done);
+			pthread_mutex_unlock(&s.lock);
+		}
+	}
+
+	for (i = 1; i < n; i++)
+		pthread_join(workers[i].tid, NULL);
+	pthread_mutex_destroy(&s.lock);
+	pthread_cond_destroy(&s.done);
+	free(s.chunks);
+	free(buf);
+	return n;
+}
+
+static void
+print_conn_cb(struct conn_line *l, output_buffer_t *ob, int worker, void *arg)
+{
+	print_conn(ob, l, *(unsigned int *)arg);
+}
+
+
+void list_conn(unsigned int format)
+{
 	printf("IPVS connection entries\n");
 	if (format & FMT_PERSISTENTCONN)
 		printf("pro expire %-11s %-18s %-18s %-18s %-16s %s\n",
@@ -1323,24 +2341,1398 @@ void list_conn(unsigned int format)
 		printf("pro expire %-11s %-18s %-18s %s\n",
 		       "state", "source", "virtual", "destination");
 
-	/*
-	 * Print the VS information according to the format
-	 */
-	while (!feof(handle)) {
-		if (fgets(buffer, sizeof(buffer), handle))
-			print_conn(buffer, format);
-	}
+	scan_conn(print_conn_cb, NULL, &format, 1);
+}
+
+
+/*
+ * FNV-1a of len bytes, on top of the hash h of what came before; a hash
+ * starts out as HASH_INIT
+ */
+#define HASH_INIT		2166136261u
+
+static unsigned int hash_bytes(unsigned int h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
 
-	fclose(handle);
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h;
 }
 
+/*
+ * An index on an array of entries kept by its user, by open addressing
+ * with linear probing.  A slot holds the index + 1 of an entry, 0 if it
+ * is free, and the table is kept at most half full.  The entries are
+ * hashed and compared with a key through the functions given.
+ */
+typedef unsigned int (*index_hash_t)(const void *entries, unsigned int i);
+typedef int (*index_match_t)(const void *entries, unsigned int i,
+			     const void *key);
 
-static inline char *fwd_name(unsigned flags)
+struct index_table {
+	unsigned int		*slot;
+	unsigned int		mask;
+};
+
+/* room for n entries, the first len of entries are indexed again */
+static void
+index_reserve(struct index_table *t, const void *entries, unsigned int len,
+	      unsigned int n, index_hash_t hash)
 {
-	char *fwd = NULL;
+	unsigned int i, j, mask;
 
-	switch (flags & IP_VS_CONN_F_FWD_MASK) {
-	case IP_VS_CONN_F_MASQ:
+	if (2 * n <= t->mask)
+		return;
+	for (mask = t->mask ? t->mask : 1023; mask < 2 * n;
+	     mask = mask * 2 + 1)
+		;
+	free(t->slot);
+	if (!(t->slot = calloc(mask + 1, sizeof(*t->slot))))
+		fail(2, "calloc: %s", strerror(errno));
+	t->mask = mask;
+	for (i = 0; i < len; i++) {
+		j = hash(entries, i) & mask;
+		while (t->slot[j])
+			j = (j + 1) & mask;
+		t->slot[j] = i + 1;
+	}
+}
+
+/* the slot of the entry matching key, whose hash is h, else a free one */
+static unsigned int
+index_find(struct index_table *t, const void *entries, const void *key,
+	   unsigned int h, index_match_t match)
+{
+	unsigned int j;
+
+	for (j = h & t->mask; t->slot[j]; j = (j + 1) & t->mask)
+		if (match(entries, t->slot[j] - 1, key))
+			break;
+	return j;
+}
+
+static void index_free(struct index_table *t)
+{
+	free(t->slot);
+	memset(t, 0, sizeof(*t));
+}
+
+
+/*
+ * -c --summary: the connections counted by state for each pair of
+ * virtual and real server, in one pass over the table.  The pairs are
+ * kept in a hash table on the raw fields of the line, which are only
+ * decoded when a pair is first seen.
+ */
+#define SUMMARY_STATES		32
+#define SUMMARY_KEY_MAXLEN	112
+
+/* the columns in this order when there are connections in the state */
+static const char *summary_known_states[] = {
+	"ESTABLISHED", "SYN_RECV", "SYN_SENT", "SYNACK", "FIN_WAIT",
+	"TIME_WAIT", "CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "UDP",
+	"ICMP", "NONE", NULL
+};
+
+struct summary_entry {
+	char			key[SUMMARY_KEY_MAXLEN];
+	int			keylen;
+	char			protocol[8];
+	unsigned short		proto;
+	int			vaf;
+	int			daf;
+	union nf_inet_addr	vaddr;
+	union nf_inet_addr	daddr;
+	unsigned int		vport;
+	unsigned int		dport;
+	unsigned int		count[SUMMARY_STATES];
+};
+
+struct conn_summary {
+	struct summary_entry	*e;
+	unsigned int		len;
+	unsigned int		size;
+	struct index_table	index;
+	char			states[SUMMARY_STATES][16];
+	int			num_states;
+	unsigned long long	total[SUMMARY_STATES];
+};
+
+struct summary_key {
+	const char		*key;
+	int			keylen;
+};
+
+static unsigned int summary_hash(const void *entries, unsigned int i)
+{
+	const struct summary_entry *e = entries;
+
+	return hash_bytes(HASH_INIT, e[i].key, e[i].keylen);
+}
+
+static int summary_match(const void *entries, unsigned int i, const void *key)
+{
+	const struct summary_entry *e = entries;
+	const struct summary_key *k = key;
+
+	return e[i].keylen == k->keylen &&
+	       !memcmp(e[i].key, k->key, k->keylen);
+}
+
+/* the column of a state, the last one takes what does not fit */
+static int summary_state(struct conn_summary *s, const char *name, int len)
+{
+	int i;
+
+	for (i = 0; i < s->num_states; i++)
+		if (!strncmp(s->states[i], name, len) && !s->states[i][len])
+			return i;
+	if (s->num_states == SUMMARY_STATES - 1 || len >= 16) {
+		strcpy(s->states[SUMMARY_STATES - 1], "OTHER");
+		return SUMMARY_STATES - 1;
+	}
+	memcpy(s->states[i], name, len);
+	s->states[i][len] = '\0';
+	s->num_states++;
+	return i;
+}
+
+/* the slot of key, a free one if it is not in the table */
+static unsigned int
+summary_slot(struct conn_summary *s, const char *key, int keylen)
+{
+	struct summary_key k = { key, keylen };
+
+	index_reserve(&s->index, s->e, s->len, s->len + 1, summary_hash);
+	return index_find(&s->index, s->e, &k,
+			  hash_bytes(HASH_INIT, key, keylen), summary_match);
+}
+
+/* room for one more entry, it is added by setting its slot */
+static struct summary_entry *summary_new(struct conn_summary *s)
+{
+	struct summary_entry *e;
+
+	if (s->len == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		if (!(e = realloc(s->e, s->size * sizeof(*e))))
+			fail(2, "realloc: %s", strerror(errno));
+		s->e = e;
+	}
+	e = &s->e[s->len];
+	memset(e, 0, sizeof(*e));
+	return e;
+}
+
+static struct summary_entry *
+summary_insert(struct conn_summary *s, struct conn_line *l, const char *key,
+	       int keylen, unsigned int j)
+{
+	struct summary_entry *e = summary_new(s);
+
+	if (l->len[CONN_PROTO] >= sizeof(e->protocol) ||
+	    conn_addr(l->f[CONN_VADDR], l->len[CONN_VADDR], &e->vaf,
+		      &e->vaddr) ||
+	    conn_addr(l->f[CONN_DADDR], l->len[CONN_DADDR], &e->daf,
+		      &e->daddr) ||
+	    conn_hex(l->f[CONN_VPORT], l->len[CONN_VPORT], &e->vport) ||
+	    conn_hex(l->f[CONN_DPORT], l->len[CONN_DPORT], &e->dport))
+		return NULL;
+	memcpy(e->protocol, l->f[CONN_PROTO], l->len[CONN_PROTO]);
+	if (!strcmp(e->protocol, "TCP"))
+		e->proto = IPPROTO_TCP;
+	else if (!strcmp(e->protocol, "UDP"))
+		e->proto = IPPROTO_UDP;
+	memcpy(e->key, key, keylen);
+	e->keylen = keylen;
+	s->index.slot[j] = ++s->len;
+	return e;
+}
+
+/*
+ * The entry of the first nfields of protocol, virtual and real server
+ * address and port of a line, the pair with all five, added if new
+ */
+static struct summary_entry *
+summary_find(struct conn_summary *s, struct conn_line *l, unsigned int nfields)
+{
+	static const int fields[] = {
+		CONN_PROTO, CONN_VADDR, CONN_VPORT, CONN_DADDR, CONN_DPORT
+	};
+	char key[SUMMARY_KEY_MAXLEN], *p = key;
+	unsigned int i, j;
+
+	if (l->n < 9)
+		return NULL;
+
+	/* the identity of the pair as the kernel wrote it */
+	for (i = 0; i < nfields; i++) {
+		if (p - key + l->len[fields[i]] + 1 > sizeof(key))
+			return NULL;
+		memcpy(p, l->f[fields[i]], l->len[fields[i]]);
+		p += l->len[fields[i]];
+		*p++ = ' ';
+	}
+
+	j = summary_slot(s, key, p - key);
+	if (s->index.slot[j])
+		return &s->e[s->index.slot[j] - 1];
+	return summary_insert(s, l, key, p - key, j);
+}
+
+static void
+summary_add(struct conn_line *l, output_buffer_t *ob, int worker, void *arg)
+{
+	struct conn_summary *s = (struct conn_summary *)arg + worker;
+	struct summary_entry *e;
+
+	if (!(e = summary_find(s, l, 5)))
+		return;
+	e->count[summary_state(s, l->f[CONN_STATE], l->len[CONN_STATE])]++;
+}
+
+/*
+ * Add the counts of another worker, whose table is freed.  Where each of
+ * its entries went is kept in map when one is given.
+ */
+static void
+summary_merge(struct conn_summary *to, struct conn_summary *from,
+	      unsigned int *map_entry)
+{
+	struct summary_entry *e, *f;
+	int map[SUMMARY_STATES];
+	unsigned int i, j, k;
+
+	for (k = 0; k < SUMMARY_STATES; k++)
+		map[k] = from->states[k][0] ?
+			summary_state(to, from->states[k],
+				      strlen(from->states[k])) : 0;
+
+	for (i = 0; i < from->len; i++) {
+		f = &from->e[i];
+		j = summary_slot(to, f->key, f->keylen);
+		if (to->index.slot[j])
+			e = &to->e[to->index.slot[j] - 1];
+		else {
+			e = summary_new(to);
+			*e = *f;
+			memset(e->count, 0, sizeof(e->count));
+			to->index.slot[j] = ++to->len;
+		}
+		for (k = 0; k < SUMMARY_STATES; k++)
+			e->count[map[k]] += f->count[k];
+		if (map_entry)
+			map_entry[i] = e - to->e;
+	}
+	free(from->e);
+	index_free(&from->index);
+}
+
+static int summary_cmp(const void *a, const void *b)
+{
+	const struct summary_entry *e1 = a, *e2 = b;
+	int r;
+
+	if ((r = strcmp(e1->protocol, e2->protocol)) ||
+	    (r = e1->vaf - e2->vaf) ||
+	    (r = memcmp(&e1->vaddr, &e2->vaddr, sizeof(e1->vaddr))) ||
+	    (r = (int)e1->vport - (int)e2->vport) ||
+	    (r = e1->daf - e2->daf) ||
+	    (r = memcmp(&e1->daddr, &e2->daddr, sizeof(e1->daddr))))
+		return r;
+	return (int)e1->dport - (int)e2->dport;
+}
+
+static void
+print_summary_row(char *p, const char *start, const unsigned int *count,
+		  const int *width)
+{
+	unsigned long long total = 0;
+	int i;
+
+	p = format_pad(p, start, 33);
+	for (i = 0; i < SUMMARY_STATES; i++) {
+		if (!width[i])
+			continue;
+		*p++ = ' ';
+		p = format_uint_right(p, count[i], width[i]);
+		total += count[i];
+	}
+	*p++ = ' ';
+	p = format_uint_right(p, total, 10);
+	*p++ = '\n';
+	output_buffer_commit(&output, p);
+}
+
+static void list_conn_summary(unsigned int format)
+{
+	struct conn_summary *tables, s;
+	unsigned int count[SUMMARY_STATES];
+	int width[SUMMARY_STATES];
+	struct summary_entry *e, *v;
+	unsigned int i, j, k;
+	char *p, *start;
+	int n, workers;
+
+	/* one table for each worker, merged into the first */
+	if (!(tables = calloc(CONN_MAX_THREADS, sizeof(*tables))))
+		fail(2, "calloc: %s", strerror(errno));
+	for (n = 0; n < CONN_MAX_THREADS; n++)
+		for (i = 0; summary_known_states[i]; i++)
+			summary_state(&tables[n], summary_known_states[i],
+				      strlen(summary_known_states[i]));
+	workers = scan_conn(summary_add, NULL, tables, 0);
+	for (n = 1; n < workers; n++)
+		summary_merge(&tables[0], &tables[n], NULL);
+	s = tables[0];
+	free(tables);
+
+	/* sorted even with --nosort, the real servers are grouped by it */
+	qsort(s.e, s.len, sizeof(*s.e), summary_cmp);
+	for (i = 0; i < s.len; i++)
+		for (j = 0; j < SUMMARY_STATES; j++)
+			s.total[j] += s.e[i].count[j];
+
+	/* only the states that are in the table get a column */
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+	p = start = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_str(p, "Prot LocalAddress:Port");
+	p = format_pad(p, start, 33);
+	for (i = 0; i < SUMMARY_STATES; i++) {
+		width[i] = 0;
+		if (!s.total[i])
+			continue;
+		width[i] = MAX(strlen(s.states[i]), 8);
+		for (n = width[i] - strlen(s.states[i]); n >= 0; n--)
+			*p++ = ' ';
+		p = format_str(p, s.states[i]);
+	}
+	p = format_str(p, "      Total\n  -> RemoteAddress:Port\n");
+	output_buffer_commit(&output, p);
+
+	/* each virtual server with the sum of its real servers first */
+	for (i = 0; i < s.len; i = j) {
+		v = &s.e[i];
+		memset(count, 0, sizeof(count));
+		for (j = i; j < s.len; j++) {
+			e = &s.e[j];
+			if (strcmp(e->protocol, v->protocol) ||
+			    e->vaf != v->vaf || e->vport != v->vport ||
+			    memcmp(&e->vaddr, &v->vaddr, sizeof(e->vaddr)))
+				break;
+			for (k = 0; k < SUMMARY_STATES; k++)
+				count[k] += e->count[k];
+		}
+
+		p = start = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		p = format_pad(format_str(p, v->protocol), start, 5);
+		p = format_addrport(p, v->vaf, &v->vaddr, v->vport, v->proto,
+				    format);
+		print_summary_row(p, start, count, width);
+
+		for (k = i; k < j; k++) {
+			e = &s.e[k];
+			p = start = output_buffer_reserve(&output,
+							  OUTPUT_BUFFER_LINE);
+			p = format_str(p, "  -> ");
+			p = format_addrport(p, e->daf, &e->daddr, e->dport,
+					    e->proto, format);
+			print_summary_row(p, start, e->count, width);
+		}
+	}
+
+	output_buffer_destroy(&output);
+	free(s.e);
+	index_free(&s.index);
+}
+
+
+/*
+ * -c --export: the connection table written as fixed size records for
+ * analysis tools, laid out as in conn_export.h.  Each worker keeps its
+ * own records and tables of pairs, IPv6 clients and persistence data,
+ * which are renumbered into one when the file is written.  What each
+ * chunk of the table added is noted, so that the records are written in
+ * the order of the table whichever worker parsed them.
+ */
+struct export_worker {
+	struct conn_summary		pairs;
+	struct conn_export_record	*rec;
+	size_t				num_rec;
+	size_t				size_rec;
+	struct in6_addr			*addrs6;
+	size_t				num_addrs6;
+	size_t				size_addrs6;
+	struct conn_export_pe		*pe;
+	size_t				num_pe;
+	size_t				size_pe;
+	size_t				done_rec;	/* by the chunks done */
+	size_t				done_addrs6;
+	size_t				done_pe;
+};
+
+/* [start, end) of what a chunk added to the tables of its worker */
+struct export_chunk {
+	int				worker;
+	size_t				rec;
+	size_t				end_rec;
+	size_t				addrs6;
+	size_t				end_addrs6;
+	size_t				pe;
+	size_t				end_pe;
+};
+
+struct export_scan {
+	struct export_worker		*w;
+	struct export_chunk		*chunks;
+	size_t				num_chunks;
+	size_t				size_chunks;
+};
+
+/* room for one more element at the end of an array */
+static void *array_grow(void *a, size_t len, size_t *size, size_t elem)
+{
+	if (len < *size)
+		return a;
+	*size = *size ? *size * 2 : 4096;
+	if (!(a = realloc(a, *size * elem)))
+		fail(2, "realloc: %s", strerror(errno));
+	return a;
+}
+
+static void
+export_add(struct conn_line *l, output_buffer_t *ob, int worker, void *arg)
+{
+	struct export_worker *w = ((struct export_scan *)arg)->w + worker;
+	struct conn_export_record *r;
+	struct conn_export_pe *pe;
+	struct summary_entry *e;
+	union nf_inet_addr caddr;
+	unsigned int cport, expires;
+	int caf;
+
+	if (!(e = summary_find(&w->pairs, l, 5)) ||
+	    conn_addr(l->f[CONN_CADDR], l->len[CONN_CADDR], &caf, &caddr) ||
+	    conn_hex(l->f[CONN_CPORT], l->len[CONN_CPORT], &cport) ||
+	    conn_uint(l->f[CONN_EXPIRES], l->len[CONN_EXPIRES], &expires))
+		return;
+
+	w->rec = array_grow(w->rec, w->num_rec, &w->size_rec, sizeof(*r));
+	r = &w->rec[w->num_rec];
+	r->pair = e - w->pairs.e;
+	r->expires = expires;
+	r->cport = cport;
+	r->state = summary_state(&w->pairs, l->f[CONN_STATE],
+				 l->len[CONN_STATE]);
+	r->flags = 0;
+	if (caf == AF_INET6) {
+		w->addrs6 = array_grow(w->addrs6, w->num_addrs6,
+					&w->size_addrs6, sizeof(*w->addrs6));
+		w->addrs6[w->num_addrs6] = caddr.in6;
+		r->caddr = w->num_addrs6++;
+		r->flags |= CONN_EXPORT_CADDR6;
+	} else
+		r->caddr = caddr.ip;
+
+	if (l->n == CONN_FIELDS) {
+		w->pe = array_grow(w->pe, w->num_pe, &w->size_pe, sizeof(*pe));
+		pe = &w->pe[w->num_pe++];
+		memset(pe, 0, sizeof(*pe));
+		pe->record = w->num_rec;
+		memcpy(pe->name, l->f[CONN_PE_NAME],
+		       MIN(l->len[CONN_PE_NAME], sizeof(pe->name) - 1));
+		pe->data_len = MIN(l->len[CONN_PE_DATA], sizeof(pe->data));
+		memcpy(pe->data, l->f[CONN_PE_DATA], pe->data_len);
+		r->flags |= CONN_EXPORT_PE;
+	}
+	w->num_rec++;
+}
+
+/* a chunk added what its worker has beyond the chunks it did before */
+static void export_chunk_done(int chunk, int worker, void *arg)
+{
+	struct export_scan *x = (struct export_scan *)arg;
+	struct export_worker *w = &x->w[worker];
+	struct export_chunk *c;
+
+	while (chunk >= x->size_chunks)
+		x->chunks = array_grow(x->chunks, x->size_chunks,
+				       &x->size_chunks, sizeof(*c));
+	if (chunk >= x->num_chunks)
+		x->num_chunks = chunk + 1;
+
+	c = &x->chunks[chunk];
+	c->worker = worker;
+	c->rec = w->done_rec;
+	c->end_rec = w->done_rec = w->num_rec;
+	c->addrs6 = w->done_addrs6;
+	c->end_addrs6 = w->done_addrs6 = w->num_addrs6;
+	c->pe = w->done_pe;
+	c->end_pe = w->done_pe = w->num_pe;
+}
+
+/*
+ * Renumber the pairs and states of a worker into those of the first one,
+ * whose tables are the ones written
+ */
+static void
+export_merge(struct export_worker *to, struct export_worker *w)
+{
+	unsigned int *pair, i, j;
+	int state[SUMMARY_STATES];
+	struct summary_entry *e;
+
+	for (i = 0; i < SUMMARY_STATES; i++)
+		state[i] = w->pairs.states[i][0] ?
+			summary_state(&to->pairs, w->pairs.states[i],
+				      strlen(w->pairs.states[i])) : 0;
+
+	if (!(pair = malloc((w->pairs.len + 1) * sizeof(*pair))))
+		fail(2, "malloc: %s", strerror(errno));
+	for (i = 0; i < w->pairs.len; i++) {
+		e = &w->pairs.e[i];
+		j = summary_slot(&to->pairs, e->key, e->keylen);
+		if (!to->pairs.index.slot[j]) {
+			*summary_new(&to->pairs) = *e;
+			to->pairs.index.slot[j] = ++to->pairs.len;
+		}
+		pair[i] = to->pairs.index.slot[j] - 1;
+	}
+
+	for (i = 0; i < w->num_rec; i++) {
+		w->rec[i].pair = pair[w->rec[i].pair];
+		w->rec[i].state = state[w->rec[i].state];
+	}
+	free(pair);
+}
+
+/* number the IPv6 clients and records of a chunk as they are written */
+static void
+export_rebase(struct export_worker *w, struct export_chunk *c,
+	      size_t rec_base, size_t addrs6_base)
+{
+	size_t i;
+
+	for (i = c->rec; i < c->end_rec; i++)
+		if (w->rec[i].flags & CONN_EXPORT_CADDR6)
+			w->rec[i].caddr += addrs6_base - c->addrs6;
+	for (i = c->pe; i < c->end_pe; i++)
+		w->pe[i].record += rec_base - c->rec;
+}
+
+/*
+ * Files that are rewritten in place are written aside, to path.pid,
+ * and renamed over path once complete, so that a reader never sees half
+ * a file.  Failures are returned with errno set, as NULL or -1.
+ */
+static FILE *replace_open(const char *path, char *tmp, size_t len)
+{
+	snprintf(tmp, len, "%s.%d", path, getpid());
+	return fopen(tmp, "w");
+}
+
+static int replace_close(FILE *f, const char *tmp, const char *path)
+{
+	int err = ferror(f) ? EIO : 0;
+
+	if (fclose(f) && !err)
+		err = errno;
+	if (!err && rename(tmp, path))
+		err = errno;
+	if (err) {
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static void export_write(FILE *f, const void *p, size_t size, size_t n)
+{
+	if (n && fwrite(p, size, n, f) != n)
+		fail(2, "%s: %s", export_path, strerror(errno));
+}
+
+static void export_conn(void)
+{
+	struct conn_export_header h;
+	struct conn_export_pair pair;
+	struct export_worker *w;
+	struct export_chunk *c;
+	struct export_scan x;
+	struct summary_entry *e;
+	char tmp[PATH_MAX];
+	size_t off, rec, addrs6, k;
+	int i, n, workers;
+	unsigned int j;
+	FILE *f;
+
+	if (!(w = calloc(CONN_MAX_THREADS, sizeof(*w))))
+		fail(2, "calloc: %s", strerror(errno));
+	for (n = 0; n < CONN_MAX_THREADS; n++)
+		for (i = 0; summary_known_states[i]; i++)
+			summary_state(&w[n].pairs, summary_known_states[i],
+				      strlen(summary_known_states[i]));
+	memset(&x, 0, sizeof(x));
+	x.w = w;
+	workers = scan_conn(export_add, export_chunk_done, &x, 0);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CONN_EXPORT_MAGIC, sizeof(h.magic));
+	h.byte_order = CONN_EXPORT_BYTE_ORDER;
+	h.version = CONN_EXPORT_VERSION;
+	h.time = time(NULL);
+	for (n = 1; n < workers; n++)
+		export_merge(&w[0], &w[n]);
+	for (k = rec = addrs6 = 0; k < x.num_chunks; k++) {
+		c = &x.chunks[k];
+		export_rebase(&w[c->worker], c, rec, addrs6);
+		rec += c->end_rec - c->rec;
+		addrs6 += c->end_addrs6 - c->addrs6;
+		h.num_pe += c->end_pe - c->pe;
+	}
+	h.num_records = rec;
+	h.num_addrs6 = addrs6;
+	h.num_pairs = w[0].pairs.len;
+	h.num_states = SUMMARY_STATES;
+
+	/* every entry is a multiple of 8 bytes, so are the offsets */
+	off = sizeof(h);
+	h.records = off;
+	off += h.num_records * sizeof(struct conn_export_record);
+	h.pairs = off;
+	off += h.num_pairs * sizeof(pair);
+	h.addrs6 = off;
+	off += h.num_addrs6 * sizeof(struct in6_addr);
+	h.states = off;
+	off += h.num_states * sizeof(w[0].pairs.states[0]);
+	h.pe = off;
+
+	if (!(f = replace_open(export_path, tmp, sizeof(tmp))))
+		fail(2, "%s: %s", tmp, strerror(errno));
+	export_write(f, &h, sizeof(h), 1);
+	for (k = 0; k < x.num_chunks; k++) {
+		c = &x.chunks[k];
+		export_write(f, w[c->worker].rec + c->rec, sizeof(*w->rec),
+			     c->end_rec - c->rec);
+	}
+	for (j = 0; j < w[0].pairs.len; j++) {
+		e = &w[0].pairs.e[j];
+		memset(&pair, 0, sizeof(pair));
+		memcpy(pair.protocol, e->protocol, sizeof(pair.protocol));
+		pair.vaf = e->vaf;
+		pair.daf = e->daf;
+		pair.vport = e->vport;
+		pair.dport = e->dport;
+		memcpy(pair.vaddr, &e->vaddr, sizeof(pair.vaddr));
+		memcpy(pair.daddr, &e->daddr, sizeof(pair.daddr));
+		export_write(f, &pair, sizeof(pair), 1);
+	}
+	for (k = 0; k < x.num_chunks; k++) {
+		c = &x.chunks[k];
+		export_write(f, w[c->worker].addrs6 + c->addrs6,
+			     sizeof(*w->addrs6), c->end_addrs6 - c->addrs6);
+	}
+	export_write(f, w[0].pairs.states, sizeof(w[0].pairs.states[0]),
+		     SUMMARY_STATES);
+	for (k = 0; k < x.num_chunks; k++) {
+		c = &x.chunks[k];
+		export_write(f, w[c->worker].pe + c->pe, sizeof(*w->pe),
+			     c->end_pe - c->pe);
+	}
+
+	if (replace_close(f, tmp, export_path))
+		fail(2, "%s: %s", export_path, strerror(errno));
+
+	for (n = 0; n < CONN_MAX_THREADS; n++) {
+		free(w[n].pairs.e);
+		index_free(&w[n].pairs.index);
+		free(w[n].rec);
+		free(w[n].addrs6);
+		free(w[n].pe);
+	}
+	free(x.chunks);
+	free(w);
+}
+
+
+/*
+ * -c --persistence-report: the persistence templates, the entries with
+ * client port 0, counted by real server for each service with the skew
+ * between its real servers, the keys of the persistence engine and the
+ * number of affinity buckets other netmasks would make of the clients.
+ * Template addresses are already masked by the netmask of the service,
+ * those of the connections give the estimate for finer ones.
+ */
+#define PERSIST_PREFIXES	5
+#define PERSIST_TOP_KEYS	3
+
+static const int persist_prefix4[PERSIST_PREFIXES] = { 32, 28, 24, 20, 16 };
+static const int persist_prefix6[PERSIST_PREFIXES] = { 128, 64, 56, 48, 32 };
+
+struct persist_client {
+	unsigned int		service;
+	int			af;
+	union nf_inet_addr	addr;
+};
+
+struct persist_pe {
+	unsigned int		service;
+	char			name[16];
+	char			*data;
+};
+
+/* templates are counted in count[0] of the pairs and services */
+struct persist_worker {
+	struct conn_summary	pairs;
+	struct conn_summary	services;
+	struct persist_client	*clients;
+	size_t			num_clients;
+	size_t			size_clients;
+	struct persist_pe	*pe;
+	size_t			num_pe;
+	size_t			size_pe;
+};
+
+struct persist_stats {
+	unsigned int		buckets[PERSIST_PREFIXES];
+	const char		*pe_name;
+	unsigned int		pe_templates;
+	unsigned int		pe_keys;
+	const char		*top[PERSIST_TOP_KEYS];
+	unsigned int		top_count[PERSIST_TOP_KEYS];
+};
+
+static void
+persist_add(struct conn_line *l, output_buffer_t *ob, int worker, void *arg)
+{
+	struct persist_worker *w = (struct persist_worker *)arg + worker;
+	struct summary_entry *svc, *e = NULL;
+	struct persist_client c;
+	struct persist_pe *pe;
+	unsigned int cport;
+
+	/* nothing is added for a line that does not parse */
+	if (conn_hex(l->f[CONN_CPORT], l->len[CONN_CPORT], &cport) ||
+	    conn_addr(l->f[CONN_CADDR], l->len[CONN_CADDR], &c.af, &c.addr) ||
+	    !(svc = summary_find(&w->services, l, 3)) ||
+	    (!cport && !(e = summary_find(&w->pairs, l, 5))))
+		return;
+
+	c.service = svc - w->services.e;
+	w->clients = array_grow(w->clients, w->num_clients, &w->size_clients,
+				sizeof(c));
+	w->clients[w->num_clients++] = c;
+	if (cport)
+		return;
+
+	e->count[0]++;
+	svc->count[0]++;
+	if (l->n == CONN_FIELDS) {
+		w->pe = array_grow(w->pe, w->num_pe, &w->size_pe, sizeof(*pe));
+		pe = &w->pe[w->num_pe];
+		memset(pe->name, 0, sizeof(pe->name));
+		memcpy(pe->name, l->f[CONN_PE_NAME],
+		       MIN(l->len[CONN_PE_NAME], sizeof(pe->name) - 1));
+		if (!(pe->data = strndup(l->f[CONN_PE_DATA],
+					 MIN(l->len[CONN_PE_DATA],
+					     CONN_FIELD_MAXLEN))))
+			fail(2, "strndup: %s", strerror(errno));
+		pe->service = c.service;
+		w->num_pe++;
+	}
+}
+
+/* the length of the first n fields of a key, with their blanks */
+static int summary_key_fields(const char *key, int keylen, int n)
+{
+	int i;
+
+	for (i = 0; i < keylen; i++)
+		if (key[i] == ' ' && !--n)
+			return i + 1;
+	return keylen;
+}
+
+/*
+ * The service whose templates the clients of a service count for: its
+ * own if it has templates, else the one with port zero of the same
+ * virtual address, whose connections are on their own port
+ */
+static int persist_owner(struct conn_summary *services, unsigned int i)
+{
+	struct summary_entry *e = &services->e[i];
+	char key[SUMMARY_KEY_MAXLEN];
+	unsigned int j;
+	int len;
+
+	if (e->count[0])
+		return i;
+	len = summary_key_fields(e->key, e->keylen, 2);
+	if (len + 5 > sizeof(key))
+		return -1;
+	memcpy(key, e->key, len);
+	memcpy(key + len, "0000 ", 5);
+	j = summary_slot(services, key, len + 5);
+	if (services->index.slot[j] &&
+	    services->e[services->index.slot[j] - 1].count[0])
+		return services->index.slot[j] - 1;
+	return -1;
+}
+
+static int persist_client_cmp(const void *a, const void *b)
+{
+	const struct persist_client *c1 = a, *c2 = b;
+
+	if (c1->service != c2->service)
+		return c1->service < c2->service ? -1 : 1;
+	if (c1->af != c2->af)
+		return c1->af - c2->af;
+	return memcmp(&c1->addr, &c2->addr, sizeof(c1->addr));
+}
+
+static int persist_pe_cmp(const void *a, const void *b)
+{
+	const struct persist_pe *p1 = a, *p2 = b;
+
+	if (p1->service != p2->service)
+		return p1->service < p2->service ? -1 : 1;
+	return strcmp(p1->data, p2->data);
+}
+
+/* the number of leading bits two addresses have in common */
+static int addr_common_bits(const void *a, const void *b, int len)
+{
+	const unsigned char *x = a, *y = b;
+	unsigned char c;
+	int i, bits = 0;
+
+	for (i = 0; i < len; i++, bits += 8)
+		if ((c = x[i] ^ y[i])) {
+			for (; !(c & 0x80); c <<= 1)
+				bits++;
+			return bits;
+		}
+	return bits;
+}
+
+/*
+ * The buckets of each prefix length from the sorted clients: two
+ * neighbours are in different buckets when they differ within it
+ */
+static void
+persist_buckets(struct persist_client *c, size_t n, struct persist_stats *st,
+		struct conn_summary *services)
+{
+	const int *prefix;
+	size_t i;
+	int k, bits;
+
+	for (i = 0; i < n; i++) {
+		prefix = services->e[c[i].service].vaf == AF_INET6 ?
+			persist_prefix6 : persist_prefix4;
+		if (!i || c[i].service != c[i - 1].service ||
+		    c[i].af != c[i - 1].af)
+			bits = -1;
+		else
+			bits = addr_common_bits(&c[i].addr, &c[i - 1].addr,
+						c[i].af == AF_INET6 ? 16 : 4);
+		for (k = 0; k < PERSIST_PREFIXES; k++)
+			if (bits < prefix[k])
+				st[c[i].service].buckets[k]++;
+	}
+}
+
+/* the number of templates of each key, and the most used ones */
+static void
+persist_keys(struct persist_pe *pe, size_t n, struct persist_stats *st)
+{
+	struct persist_stats *s;
+	unsigned int count;
+	size_t i, j;
+	int k;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && pe[j].service == pe[i].service &&
+		     !strcmp(pe[j].data, pe[i].data); j++)
+			;
+		count = j - i;
+		s = &st[pe[i].service];
+		s->pe_name = pe[i].name;
+		s->pe_templates += count;
+		s->pe_keys++;
+		for (k = PERSIST_TOP_KEYS; k > 0 && count > s->top_count[k - 1];
+		     k--)
+			if (k < PERSIST_TOP_KEYS) {
+				s->top[k] = s->top[k - 1];
+				s->top_count[k] = s->top_count[k - 1];
+			}
+		if (k < PERSIST_TOP_KEYS) {
+			s->top[k] = pe[i].data;
+			s->top_count[k] = count;
+		}
+	}
+}
+
+static void print_persist_stats(struct persist_stats *st, int af)
+{
+	const int *prefix = af == AF_INET6 ? persist_prefix6 : persist_prefix4;
+	char *p;
+	int k;
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_str(p, "     buckets by netmask:");
+	for (k = 0; k < PERSIST_PREFIXES; k++) {
+		p = format_str(p, k ? ", /" : " /");
+		p = format_uint(p, prefix[k]);
+		*p++ = ' ';
+		p = format_uint(p, st->buckets[k]);
+	}
+	*p++ = '\n';
+
+	if (st->pe_keys) {
+		p = format_str(p, "     pe ");
+		p = format_str(p, st->pe_name);
+		p = format_str(p, ": ");
+		p = format_uint(p, st->pe_keys);
+		p = format_str(p, " keys for ");
+		p = format_uint(p, st->pe_templates);
+		p = format_str(p, " templates, most used:");
+		for (k = 0; k < PERSIST_TOP_KEYS && st->top[k]; k++) {
+			p = format_str(p, k ? ", " : " ");
+			p = format_strn(p, st->top[k], 64);
+			p = format_str(p, " (");
+			p = format_uint(p, st->top_count[k]);
+			*p++ = ')';
+		}
+		*p++ = '\n';
+	}
+	output_buffer_commit(&output, p);
+}
+
+static void list_persistence_report(unsigned int format)
+{
+	struct persist_worker *w;
+	struct persist_stats *st;
+	struct summary_entry *e, *v;
+	unsigned int *map, max, total;
+	size_t i, j, k, num;
+	char *p, *start;
+	int n, workers, owner;
+
+	if (!(w = calloc(CONN_MAX_THREADS, sizeof(*w))))
+		fail(2, "calloc: %s", strerror(errno));
+	workers = scan_conn(persist_add, NULL, w, 0);
+
+	/* everything into the tables of the first worker */
+	for (n = 1; n < workers; n++) {
+		if (!(map = malloc((w[n].services.len + 1) * sizeof(*map))))
+			fail(2, "malloc: %s", strerror(errno));
+		summary_merge(&w[0].services, &w[n].services, map);
+		summary_merge(&w[0].pairs, &w[n].pairs, NULL);
+		for (i = 0; i < w[n].num_clients; i++) {
+			w[n].clients[i].service = map[w[n].clients[i].service];
+			w[0].clients = array_grow(w[0].clients,
+						  w[0].num_clients,
+						  &w[0].size_clients,
+						  sizeof(*w[0].clients));
+			w[0].clients[w[0].num_clients++] = w[n].clients[i];
+		}
+		for (i = 0; i < w[n].num_pe; i++) {
+			w[n].pe[i].service = map[w[n].pe[i].service];
+			w[0].pe = array_grow(w[0].pe, w[0].num_pe,
+					     &w[0].size_pe, sizeof(*w[0].pe));
+			w[0].pe[w[0].num_pe++] = w[n].pe[i];
+		}
+		free(w[n].clients);
+		free(w[n].pe);
+		free(map);
+	}
+
+	/* only the clients of services with templates are kept */
+	for (i = num = 0; i < w[0].num_clients; i++) {
+		owner = persist_owner(&w[0].services,
+				      w[0].clients[i].service);
+		if (owner < 0)
+			continue;
+		w[0].clients[num] = w[0].clients[i];
+		w[0].clients[num++].service = owner;
+	}
+	qsort(w[0].clients, num, sizeof(*w[0].clients), persist_client_cmp);
+	qsort(w[0].pe, w[0].num_pe, sizeof(*w[0].pe), persist_pe_cmp);
+	if (!(st = calloc(w[0].services.len + 1, sizeof(*st))))
+		fail(2, "calloc: %s", strerror(errno));
+	persist_buckets(w[0].clients, num, st, &w[0].services);
+	persist_keys(w[0].pe, w[0].num_pe, st);
+
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+	p = start = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_str(p, "Prot LocalAddress:Port");
+	p = format_pad(p, start, 33);
+	p = format_str(p, " Templates RealServers     Skew\n");
+	start = p;
+	p = format_str(p, "  -> RemoteAddress:Port");
+	p = format_pad(p, start, 33);
+	p = format_str(p, " Templates       Share\n");
+	output_buffer_commit(&output, p);
+
+	/* the pairs sort by service, each is followed by its real servers */
+	qsort(w[0].pairs.e, w[0].pairs.len, sizeof(*w[0].pairs.e),
+	      summary_cmp);
+	for (i = 0; i < w[0].pairs.len; i = j) {
+		v = &w[0].pairs.e[i];
+		total = max = 0;
+		for (j = i; j < w[0].pairs.len; j++) {
+			e = &w[0].pairs.e[j];
+			if (strcmp(e->protocol, v->protocol) ||
+			    e->vaf != v->vaf || e->vport != v->vport ||
+			    memcmp(&e->vaddr, &v->vaddr, sizeof(e->vaddr)))
+				break;
+			total += e->count[0];
+			max = MAX(max, e->count[0]);
+		}
+		if (!total)
+			continue;
+
+		/* the highest real server against the mean of them */
+		p = start = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		p = format_pad(format_str(p, v->protocol), start, 5);
+		p = format_addrport(p, v->vaf, &v->vaddr, v->vport, v->proto,
+				    format);
+		p = format_pad(p, start, 33);
+		p = format_uint_right(p, total, 10);
+		p = format_uint_right(p, j - i, 12);
+		p += sprintf(p, " %8.2f\n", (double)max * (j - i) / total);
+		output_buffer_commit(&output, p);
+
+		for (k = i; k < j; k++) {
+			e = &w[0].pairs.e[k];
+			p = start = output_buffer_reserve(&output,
+							  OUTPUT_BUFFER_LINE);
+			p = format_str(p, "  -> ");
+			p = format_addrport(p, e->daf, &e->daddr, e->dport,
+					    e->proto, format);
+			p = format_pad(p, start, 33);
+			p = format_uint_right(p, e->count[0], 10);
+			p += sprintf(p, " %10.1f%%\n",
+				     100.0 * e->count[0] / total);
+			output_buffer_commit(&output, p);
+		}
+
+		k = summary_slot(&w[0].services, v->key,
+				 summary_key_fields(v->key, v->keylen, 3));
+		k = w[0].services.index.slot[k];
+		if (k)
+			print_persist_stats(&st[k - 1], v->vaf);
+	}
+	output_buffer_destroy(&output);
+
+	for (i = 0; i < w[0].num_pe; i++)
+		free(w[0].pe[i].data);
+	free(w[0].pe);
+	free(w[0].clients);
+	free(w[0].pairs.e);
+	index_free(&w[0].pairs.index);
+	free(w[0].services.e);
+	index_free(&w[0].services.index);
+	free(st);
+	free(w);
+}
+
+
+/*
+ * -c --expiry-report: the seconds left to the connections by protocol
+ * and state, and what the table would hold with other timeouts.  The
+ * timer of an entry is set to the timeout of its state on each packet,
+ * so the timeout less the seconds left is how long it has been idle:
+ * with a timeout t it would only still be there if that is at most t.
+ */
+#define EXPIRY_GROUPS		64
+#define EXPIRY_ENTRY_SIZE	320	/* of an entry when slabinfo is unreadable */
+
+/* the upper bounds of the histogram columns, the last takes the rest */
+static const unsigned int expiry_edges[] = {
+	10, 30, 60, 120, 300, 600, 900, 1800, 3600
+};
+#define EXPIRY_EDGES	(sizeof(expiry_edges) / sizeof(expiry_edges[0]))
+
+struct expiry_group {
+	char			protocol[8];
+	char			state[16];
+	unsigned long long	count;
+	unsigned long long	*sec;		/* entries by seconds left */
+	unsigned int		num_sec;
+};
+
+struct expiry_table {
+	struct expiry_group	g[EXPIRY_GROUPS];
+	int			num;
+};
+
+static struct expiry_group *
+expiry_group(struct expiry_table *t, const char *protocol, int plen,
+	     const char *state, int slen)
+{
+	struct expiry_group *g;
+	int i;
+
+	for (i = 0; i < t->num; i++) {
+		g = &t->g[i];
+		if (!strncmp(g->protocol, protocol, plen) &&
+		    !g->protocol[plen] &&
+		    !strncmp(g->state, state, slen) && !g->state[slen])
+			return g;
+	}
+	if (t->num == EXPIRY_GROUPS || plen >= sizeof(g->protocol) ||
+	    slen >= sizeof(g->state))
+		return NULL;
+	g = &t->g[t->num++];
+	memcpy(g->protocol, protocol, plen);
+	memcpy(g->state, state, slen);
+	return g;
+}
+
+/* room for the entries with up to sec seconds left */
+static void expiry_grow(struct expiry_group *g, unsigned int sec)
+{
+	unsigned long long *p;
+	unsigned int n;
+
+	if (sec < g->num_sec)
+		return;
+	n = MAX(sec + 1, g->num_sec * 2);
+	if (!(p = realloc(g->sec, n * sizeof(*p))))
+		fail(2, "realloc: %s", strerror(errno));
+	memset(p + g->num_sec, 0, (n - g->num_sec) * sizeof(*p));
+	g->sec = p;
+	g->num_sec = n;
+}
+
+static void
+expiry_add(struct conn_line *l, output_buffer_t *ob, int worker, void *arg)
+{
+	struct expiry_table *t = (struct expiry_table *)arg + worker;
+	struct expiry_group *g;
+	unsigned int expires;
+
+	if (l->n < 9 ||
+	    conn_uint(l->f[CONN_EXPIRES], l->len[CONN_EXPIRES], &expires) ||
+	    !(g = expiry_group(t, l->f[CONN_PROTO], l->len[CONN_PROTO],
+			       l->f[CONN_STATE], l->len[CONN_STATE])))
+		return;
+	expiry_grow(g, expires);
+	g->sec[expires]++;
+	g->count++;
+}
+
+static int expiry_cmp(const void *a, const void *b)
+{
+	const struct expiry_group *g1 = a, *g2 = b;
+	int r;
+
+	if ((r = strcmp(g1->protocol, g2->protocol)))
+		return r;
+	return strcmp(g1->state, g2->state);
+}
+
+/*
+ * The entries of a group with timeout t instead of now.  Above the
+ * current timeout no entry shows how long it would have stayed, those
+ * idle the longest, the last tenth of it, are taken to go on at the
+ * same rate.
+ */
+static unsigned long long
+expiry_project(struct expiry_group *g, unsigned int now, unsigned int t)
+{
+	unsigned long long n = 0, tail = 0;
+	unsigned int i, width;
+
+	if (t <= now) {
+		for (i = now - t; i < g->num_sec; i++)
+			n += g->sec[i];
+		return n;
+	}
+	width = MAX(now / 10, 1);
+	for (i = 0; i < width && i < g->num_sec; i++)
+		tail += g->sec[i];
+	return g->count + tail * (t - now) / width;
+}
+
+/* the size of a kernel connection entry */
+static unsigned int expiry_entry_size(void)
+{
+	unsigned int size = EXPIRY_ENTRY_SIZE;
+	char buf[256];
+	FILE *f;
+
+	if (!(f = fopen("/proc/slabinfo", "r")))
+		return size;
+	while (fgets(buf, sizeof(buf), f))
+		if (!strncmp(buf, "ip_vs_conn ", 11) &&
+		    sscanf(buf + 11, "%*u %*u %u", &size) == 1)
+			break;
+	fclose(f);
+	return size;
+}
+
+/* one scenario of timeouts, the states they apply to are projected */
+static void
+print_expiry_scenario(const char *name, struct expiry_group **timed,
+		      const int *now, const int *t, unsigned long long total,
+		      unsigned int entry_size)
+{
+	unsigned long long n;
+	double mb;
+	char *p, *start;
+	int i;
+
+	p = start = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_pad(format_str(p, name), start, 8);
+	for (i = 0; i < 3; i++) {
+		n = 0;
+		if (timed[i] && now[i]) {
+			n = expiry_project(timed[i], now[i], t[i]);
+			total += n - timed[i]->count;
+		}
+		p = format_uint_right(p, t[i], 8);
+		p = format_uint_right(p, n, 10);
+	}
+	p = format_uint_right(p, total, 10);
+
+	/* the entries and the heads of the hash table */
+	mb = ((double)total * entry_size +
+	      (double)ipvs_info.size * sizeof(void *)) / (1024 * 1024);
+	p += sprintf(p, " %9.1f %9.1fMB\n",
+		     ipvs_info.size ? (double)total / ipvs_info.size : 0, mb);
+	output_buffer_commit(&output, p);
+}
+
+static void list_expiry_report(unsigned int format)
+{
+	static const char *timed_state[3][2] = {
+		{ "TCP", "ESTABLISHED" }, { "TCP", "FIN_WAIT" }, { "UDP", "UDP" }
+	};
+	struct expiry_group *g, *f, *timed[3];
+	struct expiry_table *tables, *t;
+	unsigned long long total = 0, col;
+	unsigned int entry_size, s;
+	int i, k;
+	int n, workers, now[3], alt[3];
+	ipvs_timeout_t *u;
+	char *p, *start, buf[16];
+
+	if (!(u = ipvs_get_timeout()))
+		exit(1);
+	now[0] = u->tcp_timeout;
+	now[1] = u->tcp_fin_timeout;
+	now[2] = u->udp_timeout;
+	free(u);
+
+	/* one table for each worker, merged into the first */
+	if (!(tables = calloc(CONN_MAX_THREADS, sizeof(*tables))))
+		fail(2, "calloc: %s", strerror(errno));
+	workers = scan_conn(expiry_add, NULL, tables, 0);
+	t = &tables[0];
+	for (n = 1; n < workers; n++) {
+		for (i = 0; i < tables[n].num; i++) {
+			f = &tables[n].g[i];
+			g = expiry_group(t, f->protocol, strlen(f->protocol),
+					 f->state, strlen(f->state));
+			if (g && f->num_sec) {
+				expiry_grow(g, f->num_sec - 1);
+				for (s = 0; s < f->num_sec; s++)
+					g->sec[s] += f->sec[s];
+				g->count += f->count;
+			}
+			free(f->sec);
+		}
+	}
+	qsort(t->g, t->num, sizeof(t->g[0]), expiry_cmp);
+
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+	p = start = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_pad(format_str(p, "Prot State"), start, 19);
+	p = format_str(p, "  Entries");
+	for (k = 0; k < EXPIRY_EDGES; k++) {
+		snprintf(buf, sizeof(buf), "<%u", expiry_edges[k]);
+		p += sprintf(p, "%8s", buf);
+	}
+	p = format_str(p, "    more\n");
+	output_buffer_commit(&output, p);
+
+	/* the entries of each state by seconds left */
+	for (i = 0; i < t->num; i++) {
+		g = &t->g[i];
+		total += g->count;
+		p = start = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		p = format_pad(format_str(p, g->protocol), start, 5);
+		p = format_pad(format_str(p, g->state), start, 19);
+		p = format_uint_right(p, g->count, 9);
+		for (k = s = 0; k <= EXPIRY_EDGES; k++) {
+			for (col = 0; s < g->num_sec &&
+			     (k == EXPIRY_EDGES || s < expiry_edges[k]); s++)
+				col += g->sec[s];
+			p = format_uint_right(p, col, 8);
+		}
+		*p++ = '\n';
+		output_buffer_commit(&output, p);
+	}
+
+	/* the states the timeouts of --set apply to */
+	for (k = 0; k < 3; k++) {
+		timed[k] = NULL;
+		for (i = 0; i < t->num; i++)
+			if (!strcmp(t->g[i].protocol, timed_state[k][0]) &&
+			    !strcmp(t->g[i].state, timed_state[k][1]))
+				timed[k] = &t->g[i];
+	}
+
+	entry_size = expiry_entry_size();
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_str(p, "\nTimeouts     tcp   entries  tcpfin   entries"
+			  "     udp   entries     total    bucket      memory\n");
+	output_buffer_commit(&output, p);
+	print_expiry_scenario("current", timed, now, now, total, entry_size);
+	for (k = 0; k < 3; k++)
+		alt[k] = now[k] / 4;
+	print_expiry_scenario("x1/4", timed, now, alt, total, entry_size);
+	for (k = 0; k < 3; k++)
+		alt[k] = now[k] / 2;
+	print_expiry_scenario("x1/2", timed, now, alt, total, entry_size);
+	for (k = 0; k < 3; k++)
+		alt[k] = MIN(now[k] * 2, MAX_TIMEOUT);
+	print_expiry_scenario("x2", timed, now, alt, total, entry_size);
+
+	/* as with --set, 0 keeps the current timeout */
+	if (expiry_timeouts.tcp_timeout || expiry_timeouts.tcp_fin_timeout ||
+	    expiry_timeouts.udp_timeout) {
+		alt[0] = expiry_timeouts.tcp_timeout ?
+			expiry_timeouts.tcp_timeout : now[0];
+		alt[1] = expiry_timeouts.tcp_fin_timeout ?
+			expiry_timeouts.tcp_fin_timeout : now[1];
+		alt[2] = expiry_timeouts.udp_timeout ?
+			expiry_timeouts.udp_timeout : now[2];
+		print_expiry_scenario("asked", timed, now, alt, total,
+				      entry_size);
+	}
+	output_buffer_destroy(&output);
+
+	for (i = 0; i < t->num; i++)
+		free(t->g[i].sec);
+	free(tables);
+}
+
+
+static inline char *fwd_name(unsigned flags)
+{
+	char *fwd = "(null)";
+
+	switch (flags & IP_VS_CONN_F_FWD_MASK) {
+	case IP_VS_CONN_F_MASQ:
 		fwd = "Masq";
 		break;
 	case IP_VS_CONN_F_LOCALNODE:
@@ -1353,288 +3745,1862 @@ static inline char *fwd_name(unsigned flags)
 		fwd = "Route";
 		break;
 	}
-	return fwd;
+	return fwd;
+}
+
+static inline char *fwd_switch(unsigned flags)
+{
+	char *swt = "(null)";
+
+	switch (flags & IP_VS_CONN_F_FWD_MASK) {
+	case IP_VS_CONN_F_MASQ:
+		swt = "-m"; break;
+	case IP_VS_CONN_F_TUNNEL:
+		swt = "-i"; break;
+	case IP_VS_CONN_F_LOCALNODE:
+	case IP_VS_CONN_F_DROUTE:
+		swt = "-g"; break;
+	}
+	return swt;
+}
+
+
+static char *format_largenum(char *p, unsigned long long i,
+			     unsigned int format)
+{
+	char mytmp[32];
+	int len;
+
+	if (format & FMT_EXACT) {
+		len = format_uint(mytmp, i) - mytmp;
+		return format_uint_right(p, i, len <= 8 ? 9 : len + 1);
+	}
+
+	if (i < 100000000)			/* less than 100 million */
+		return format_uint_right(p, i, 9);
+	else if (i < 1000000000) {		/* less than 1 billion */
+		p = format_uint_right(p, i / 1000, 8);
+		*p++ = 'K';
+	} else if (i < 100000000000ULL) {	/* less than 100 billion */
+		p = format_uint_right(p, i / 1000000, 8);
+		*p++ = 'M';
+	} else if (i < 100000000000000ULL) {	/* less than 100 trillion */
+		p = format_uint_right(p, i / 1000000000ULL, 8);
+		*p++ = 'G';
+	} else {
+		p = format_uint_right(p, i / 1000000000000ULL, 8);
+		*p++ = 'T';
+	}
+	return p;
+}
+
+
+/* a blank and v left aligned in width columns, as " %-*u" */
+static char *format_column(char *p, unsigned long long v, int width)
+{
+	char *start;
+
+	*p++ = ' ';
+	start = p;
+	return format_pad(format_uint(p, v), start, width);
+}
+
+
+static void print_title(unsigned int format)
+{
+	if (format & FMT_STATS)
+		printf("%-33s %8s %8s %8s %8s %8s\n"
+		       "  -> RemoteAddress:Port\n",
+		       "Prot LocalAddress:Port",
+		       "Conns", "InPkts", "OutPkts", "InBytes", "OutBytes");
+	else if (format & FMT_RATE)
+		printf("%-33s %8s %8s %8s %8s %8s\n"
+		       "  -> RemoteAddress:Port\n",
+		       "Prot LocalAddress:Port",
+		       "CPS", "InPPS", "OutPPS", "InBPS", "OutBPS");
+	else if (format & FMT_THRESHOLDS)
+		printf("%-33s %-10s %-10s %-10s %-10s\n"
+		       "  -> RemoteAddress:Port\n",
+		       "Prot LocalAddress:Port",
+		       "Uthreshold", "Lthreshold", "ActiveConn", "InActConn");
+	else if (format & FMT_PERSISTENTCONN)
+		printf("%-33s %-9s %-11s %-10s %-10s\n"
+		       "  -> RemoteAddress:Port\n",
+		       "Prot LocalAddress:Port",
+		       "Weight", "PersistConn", "ActiveConn", "InActConn");
+	else if (!(format & FMT_RULE))
+		printf("Prot LocalAddress:Port Scheduler Flags\n"
+		       "  -> RemoteAddress:Port           Forward Weight ActiveConn InActConn\n");
+}
+
+
+/* whether addr is within the prefix of the given length */
+static int
+prefix_match(int af, const union nf_inet_addr *addr,
+	     int faf, const union nf_inet_addr *prefix, int plen)
+{
+	const unsigned char *a = (const unsigned char *)addr;
+	const unsigned char *n = (const unsigned char *)prefix;
+	int i;
+
+	if (af != faf)
+		return 0;
+	for (i = 0; plen >= 8; i++, plen -= 8)
+		if (a[i] != n[i])
+			return 0;
+	return !plen || !((a[i] ^ n[i]) & (0xff00 >> plen));
+}
+
+/* the service part of --filter, applied before dumping destinations */
+static int list_filter_service(ipvs_service_entry_t *se, void *arg)
+{
+	struct list_filter *f = &list_filter;
+
+	if (f->set & FILTER_VIP &&
+	    (se->fwmark ||
+	     !prefix_match(se->af, &se->addr, f->vip_af, &f->vip,
+			   f->vip_plen)))
+		return 0;
+	if (f->set & FILTER_PROTO &&
+	    (f->protocol ? se->fwmark || se->protocol != f->protocol
+	     : !se->fwmark))
+		return 0;
+	if (f->set & FILTER_SCHED &&
+	    strncmp(se->sched_name, f->sched_name, IP_VS_SCHEDNAME_MAXLEN))
+		return 0;
+	return 1;
+}
+
+/* keep only the destinations matching rs=, return how many are left */
+static int list_filter_dests(struct ip_vs_get_dests *d)
+{
+	struct list_filter *f = &list_filter;
+	int i, n;
+
+	for (i = n = 0; i < d->num_dests; i++)
+		if (prefix_match(d->entrytable[i].af, &d->entrytable[i].addr,
+				 f->rs_af, &f->rs, f->rs_plen))
+			d->entrytable[n++] = d->entrytable[i];
+	d->num_dests = n;
+	return n;
+}
+
+
+/*
+ * JSON output is written to the output buffer as the entries come, one
+ * service object with its destinations at a time; nothing is kept but
+ * whether a separator is needed before the next object.
+ */
+static int json_entries;
+
+static void print_json_begin(const char *name)
+{
+	char *p;
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_str(p, "{\"version\":\"");
+	p = format_uint(p, (ipvs_info.version >> 16) & 0xff);
+	*p++ = '.';
+	p = format_uint(p, (ipvs_info.version >> 8) & 0xff);
+	*p++ = '.';
+	p = format_uint(p, ipvs_info.version & 0xff);
+	p = format_str(p, "\",\"size\":");
+	p = format_uint(p, ipvs_info.size);
+	p = format_str(p, ",\"");
+	p = format_str(p, name);
+	p = format_str(p, "\":[");
+	output_buffer_commit(&output, p);
+	json_entries = 0;
+}
+
+static void print_json_end(void)
+{
+	char *p;
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_str(p, json_entries ? "\n]}\n" : "]}\n");
+	output_buffer_commit(&output, p);
+}
+
+/* the separator and newline that start each entry of the array */
+static char *json_entry(char *p)
+{
+	if (json_entries++)
+		*p++ = ',';
+	*p++ = '\n';
+	return p;
+}
+
+static char *json_key(char *p, const char *key)
+{
+	*p++ = '"';
+	p = format_str(p, key);
+	*p++ = '"';
+	*p++ = ':';
+	return p;
+}
+
+static char *json_uint(char *p, const char *key, unsigned long long v)
+{
+	return format_uint(json_key(p, key), v);
+}
+
+static char *json_stats(char *p, struct ip_vs_stats_user *s)
+{
+	p = json_uint(format_str(p, ",\"stats\":{"), "conns", s->conns);
+	p = json_uint(format_str(p, ","), "inpkts", s->inpkts);
+	p = json_uint(format_str(p, ","), "outpkts", s->outpkts);
+	p = json_uint(format_str(p, ","), "inbytes", s->inbytes);
+	p = json_uint(format_str(p, ","), "outbytes", s->outbytes);
+	p = json_uint(format_str(p, "},\"rate\":{"), "cps", s->cps);
+	p = json_uint(format_str(p, ","), "inpps", s->inpps);
+	p = json_uint(format_str(p, ","), "outpps", s->outpps);
+	p = json_uint(format_str(p, ","), "inbps", s->inbps);
+	p = json_uint(format_str(p, ","), "outbps", s->outbps);
+	*p++ = '}';
+	return p;
+}
+
+static void
+print_service_json(ipvs_service_entry_t *se, struct ip_vs_get_dests *d,
+		   unsigned int format)
+{
+	struct in_addr mask;
+	char *p;
+	int i;
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = json_entry(p);
+	p = format_str(p, se->af == AF_INET6 ?
+		       "{\"af\":\"inet6\"" : "{\"af\":\"inet\"");
+	if (se->fwmark)
+		p = json_uint(format_str(p, ","), "fwmark", se->fwmark);
+	else {
+		p = format_str(p, se->protocol == IPPROTO_TCP ?
+			       ",\"protocol\":\"tcp\"" :
+			       ",\"protocol\":\"udp\"");
+		p = format_str(p, ",\"address\":\"");
+		p = format_addr(p, se->af, &se->addr);
+		p = json_uint(format_str(p, "\","), "port", ntohs(se->port));
+	}
+	p = json_key(format_str(p, ","), "scheduler");
+	p = format_json_str(p, se->sched_name, IP_VS_SCHEDNAME_MAXLEN);
+	if (se->flags & IP_VS_SVC_F_PERSISTENT) {
+		p = json_uint(format_str(p, ","), "persistent", se->timeout);
+		if (se->af == AF_INET) {
+			mask.s_addr = se->netmask;
+			p = format_str(p, ",\"netmask\":\"");
+			p = format_addr(p, AF_INET, &mask);
+			*p++ = '"';
+		} else
+			p = json_uint(format_str(p, ","), "netmask",
+				      se->netmask);
+	}
+	if (se->pe_name[0]) {
+		p = json_key(format_str(p, ","), "pe");
+		p = format_json_str(p, se->pe_name, IP_VS_PENAME_MAXLEN);
+	}
+	if (se->flags & IP_VS_SVC_F_ONEPACKET)
+		p = format_str(p, ",\"ops\":true");
+	p = json_stats(p, &se->stats);
+	p = format_str(p, ",\"destinations\":[");
+	output_buffer_commit(&output, p);
+
+	if (!(format & FMT_NOSORT))
+		ipvs_sort_dests(d, ipvs_cmp_dests);
+
+	for (i = 0; i < d->num_dests; i++) {
+		ipvs_dest_entry_t *e = &d->entrytable[i];
+
+		p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		if (i)
+			*p++ = ',';
+		p = format_str(p, "\n{\"address\":\"");
+		p = format_addr(p, se->af, &e->addr);
+		p = json_uint(format_str(p, "\","), "port", ntohs(e->port));
+		p = format_str(p, ",\"forward\":\"");
+		p = format_str(p, fwd_name(e->conn_flags));
+		p = json_key(format_str(p, "\","), "weight");
+		p = format_int(p, e->weight);
+		p = json_uint(format_str(p, ","), "u_threshold",
+			      e->u_threshold);
+		p = json_uint(format_str(p, ","), "l_threshold",
+			      e->l_threshold);
+		p = json_uint(format_str(p, ","), "activeconns",
+			      e->activeconns);
+		p = json_uint(format_str(p, ","), "inactconns",
+			      e->inactconns);
+		p = json_uint(format_str(p, ","), "persistconns",
+			      e->persistconns);
+		p = json_stats(p, &e->stats);
+		*p++ = '}';
+		output_buffer_commit(&output, p);
+	}
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = format_str(p, "]}");
+	output_buffer_commit(&output, p);
+}
+
+
+static void
+print_service_entry(ipvs_service_entry_t *se, struct ip_vs_get_dests *d,
+		    unsigned int format)
+{
+	char svc_name[SVC_NAME_MAXLEN], *n, *p, *start;
+	struct in_addr mask;
+	int i;
+
+	/* services without a matching real server are left out */
+	if (list_filter.set & FILTER_RS && !list_filter_dests(d))
+		return;
+
+	if (format & FMT_JSON) {
+		print_service_json(se, d, format);
+		return;
+	}
+
+	n = svc_name;
+	if (se->fwmark) {
+		n = format_str(n, format & FMT_RULE ? "-f " : "FWM  ");
+		n = format_int(n, (int)se->fwmark);
+		if (se->af == AF_INET6)
+			n = format_str(n, format & FMT_RULE ? " -6" : " IPv6");
+	} else {
+		if (format & FMT_RULE)
+			n = format_str(n, se->protocol==IPPROTO_TCP?"-t ":"-u ");
+		else
+			n = format_str(n, se->protocol==IPPROTO_TCP?"TCP  ":"UDP  ");
+		n = format_addrport(n, se->af, &se->addr, ntohs(se->port),
+				    se->protocol, format);
+		if (!(format & FMT_RULE) && se->af != AF_INET6 &&
+		    n - svc_name > 33)
+			n = svc_name + 33;
+	}
+	*n = '\0';
+
+	/* print virtual service info */
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	if (format & FMT_RULE) {
+		p = format_str(p, "-A ");
+		p = format_str(p, svc_name);
+		p = format_str(p, " -s ");
+		p = format_strn(p, se->sched_name, IP_VS_SCHEDNAME_MAXLEN);
+		if (se->flags & IP_VS_SVC_F_PERSISTENT) {
+			p = format_str(p, " -p ");
+			p = format_uint(p, se->timeout);
+			if (se->af == AF_INET)
+				if (se->netmask != (unsigned long int) 0xffffffff) {
+					mask.s_addr = se->netmask;
+					p = format_str(p, " -M ");
+					p = format_addr(p, AF_INET, &mask);
+				}
+			if (se->af == AF_INET6)
+				if (se->netmask != 128) {
+					p = format_str(p, " -M ");
+					p = format_int(p, (int)se->netmask);
+				}
+		}
+		if (se->pe_name[0]) {
+			p = format_str(p, " pe ");
+			p = format_strn(p, se->pe_name, IP_VS_PENAME_MAXLEN);
+		}
+		if (se->flags & IP_VS_SVC_F_ONEPACKET)
+			p = format_str(p, " ops");
+	} else if (format & FMT_STATS) {
+		p = format_pad(format_str(p, svc_name), p, 33);
+		p = format_largenum(p, se->stats.conns, format);
+		p = format_largenum(p, se->stats.inpkts, format);
+		p = format_largenum(p, se->stats.outpkts, format);
+		p = format_largenum(p, se->stats.inbytes, format);
+		p = format_largenum(p, se->stats.outbytes, format);
+	} else if (format & FMT_RATE) {
+		p = format_pad(format_str(p, svc_name), p, 33);
+		p = format_largenum(p, se->stats.cps, format);
+		p = format_largenum(p, se->stats.inpps, format);
+		p = format_largenum(p, se->stats.outpps, format);
+		p = format_largenum(p, se->stats.inbps, format);
+		p = format_largenum(p, se->stats.outbps, format);
+	} else {
+		p = format_str(p, svc_name);
+		*p++ = ' ';
+		p = format_strn(p, se->sched_name, IP_VS_SCHEDNAME_MAXLEN);
+		if (se->flags & IP_VS_SVC_F_PERSISTENT) {
+			p = format_str(p, " persistent ");
+			p = format_uint(p, se->timeout);
+			if (se->af == AF_INET)
+				if (se->netmask != (unsigned long int) 0xffffffff) {
+					mask.s_addr = se->netmask;
+					p = format_str(p, " mask ");
+					p = format_addr(p, AF_INET, &mask);
+				}
+			if (se->af == AF_INET6)
+				if (se->netmask != 128) {
+					p = format_str(p, " mask ");
+					p = format_int(p, (int)se->netmask);
+				}
+			if (se->pe_name[0]) {
+				p = format_str(p, " pe ");
+				p = format_strn(p, se->pe_name,
+						IP_VS_PENAME_MAXLEN);
+			}
+			if (se->flags & IP_VS_SVC_F_ONEPACKET)
+				p = format_str(p, " ops");
+		}
+	}
+	*p++ = '\n';
+	output_buffer_commit(&output, p);
+
+	/* print all the destination entries */
+	if (!(format & FMT_NOSORT))
+		ipvs_sort_dests(d, ipvs_cmp_dests);
+
+	for (i = 0; i < d->num_dests; i++) {
+		ipvs_dest_entry_t *e = &d->entrytable[i];
+
+		p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		if (format & FMT_RULE) {
+			p = format_str(p, "-a ");
+			p = format_str(p, svc_name);
+			p = format_str(p, " -r ");
+			p = format_addrport(p, se->af, &(e->addr),
+					    ntohs(e->port), se->protocol,
+					    format);
+			*p++ = ' ';
+			p = format_str(p, fwd_switch(e->conn_flags));
+			p = format_str(p, " -w ");
+			p = format_int(p, e->weight);
+			*p++ = '\n';
+			output_buffer_commit(&output, p);
+			continue;
+		}
+
+		p = format_str(p, "  -> ");
+		start = p;
+		p = format_addrport(p, se->af, &(e->addr), ntohs(e->port),
+				    se->protocol, format);
+		if (se->af != AF_INET6 && p - start > 28)
+			p = start + 28;
+		p = format_pad(p, start, 28);
+
+		if (format & FMT_STATS) {
+			p = format_largenum(p, e->stats.conns, format);
+			p = format_largenum(p, e->stats.inpkts, format);
+			p = format_largenum(p, e->stats.outpkts, format);
+			p = format_largenum(p, e->stats.inbytes, format);
+			p = format_largenum(p, e->stats.outbytes, format);
+		} else if (format & FMT_RATE) {
+			*p++ = ' ';
+			p = format_uint_right(p, e->stats.cps, 8);
+			*p++ = ' ';
+			p = format_uint_right(p, e->stats.inpps, 8);
+			*p++ = ' ';
+			p = format_uint_right(p, e->stats.outpps, 8);
+			p = format_largenum(p, e->stats.inbps, format);
+			p = format_largenum(p, e->stats.outbps, format);
+		} else if (format & FMT_THRESHOLDS) {
+			p = format_column(p, e->u_threshold, 10);
+			p = format_column(p, e->l_threshold, 10);
+			p = format_column(p, e->activeconns, 10);
+			p = format_column(p, e->inactconns, 10);
+		} else if (format & FMT_PERSISTENTCONN) {
+			p = format_column(p, e->weight, 9);
+			p = format_column(p, e->persistconns, 11);
+			p = format_column(p, e->activeconns, 10);
+			p = format_column(p, e->inactconns, 10);
+		} else {
+			*p++ = ' ';
+			start = p;
+			p = format_pad(format_str(p, fwd_name(e->conn_flags)),
+				       start, 7);
+			*p++ = ' ';
+			start = p;
+			p = format_pad(format_int(p, e->weight), start, 6);
+			p = format_column(p, e->activeconns, 10);
+			p = format_column(p, e->inactconns, 10);
+		}
+		*p++ = '\n';
+		output_buffer_commit(&output, p);
+	}
+}
+
+
+static void list_service(ipvs_service_t *svc, unsigned int format)
+{
+	ipvs_service_entry_t *entry;
+	struct ip_vs_get_dests *d;
+
+	if (!(entry = ipvs_get_service(svc->fwmark, svc->af, svc->protocol,
+				       svc->addr, svc->port))) {
+		fprintf(stderr, "%s\n", ipvs_strerror(errno));
+		exit(1);
+	}
+
+	if (!(d = ipvs_get_dests(entry))) {
+		fprintf(stderr, "%s\n", ipvs_strerror(errno));
+		exit(1);
+	}
+
+	if (!(format & (FMT_NUMERIC|FMT_JSON))) {
+		resolve_service(entry, d);
+		resolve_run();
+	}
+
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+	if (format & FMT_JSON)
+		print_json_begin("services");
+	else
+		print_title(format);
+	print_service_entry(entry, d, format);
+	if (format & FMT_JSON)
+		print_json_end();
+	output_buffer_destroy(&output);
+	free(d);
+	free(entry);
+}
+
+
+static int list_walk_cb(ipvs_service_entry_t *svc, struct ip_vs_get_dests *d,
+			void *arg)
+{
+	unsigned int format = *(unsigned int *)arg;
+
+	if (!(format & (FMT_NUMERIC|FMT_JSON))) {
+		resolve_service(svc, d);
+		resolve_run();
+	}
+	print_service_entry(svc, d, format);
+	return 0;
+}
+
+
+static void list_all(unsigned int format)
+{
+	ipvs_service_filter_t filter = NULL;
+	ipvs_snapshot_t *snap;
+	int i;
+
+	if (list_filter.set & (FILTER_VIP|FILTER_PROTO|FILTER_SCHED))
+		filter = list_filter_service;
+
+	if (!(format & (FMT_RULE|FMT_JSON)))
+		printf("IP Virtual Server version %d.%d.%d (size=%d)\n",
+		       NVERSION(ipvs_info.version), ipvs_info.size);
+
+	/* unsorted, print each service as soon as it has been fetched */
+	if (format & FMT_NOSORT) {
+		if (output_buffer_init(&output, stdout, 0))
+			fail(2, "output_buffer_init: %s", strerror(errno));
+		if (format & FMT_JSON)
+			print_json_begin("services");
+		else
+			print_title(format);
+		if (ipvs_walk_services(filter, list_walk_cb, &format)) {
+			output_buffer_destroy(&output);
+			fprintf(stderr, "%s\n", ipvs_strerror(errno));
+			exit(1);
+		}
+		if (format & FMT_JSON)
+			print_json_end();
+		output_buffer_destroy(&output);
+		return;
+	}
+
+	if (!(snap = ipvs_get_snapshot_filter(filter, NULL))) {
+		fprintf(stderr, "%s\n", ipvs_strerror(errno));
+		exit(1);
+	}
+
+	ipvs_sort_snapshot(snap, ipvs_cmp_services);
+	if (!(format & (FMT_NUMERIC|FMT_JSON)))
+		resolve_snapshot(snap);
+
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+	if (format & FMT_JSON)
+		print_json_begin("services");
+	else
+		print_title(format);
+	for (i = 0; i < snap->num_services; i++)
+		print_service_entry(&snap->entrytable[i].svc,
+				    snap->entrytable[i].dests, format);
+	if (format & FMT_JSON)
+		print_json_end();
+	output_buffer_destroy(&output);
+	ipvs_free_snapshot(snap);
 }
 
-static inline char *fwd_switch(unsigned flags)
+
+/*
+ * --top: the N entries with the largest value of a metric, kept in a
+ * min-heap bounded to N while the table is walked, so that only the
+ * winners are ever sorted.
+ */
+struct top_entry {
+	unsigned long long	key;
+	unsigned int		active;		/* summed up for services */
+	unsigned int		inact;
+	ipvs_service_entry_t	svc;
+	ipvs_dest_entry_t	dest;
+};
+
+struct top_heap {
+	struct top_entry	*e;
+	unsigned int		len;
+	unsigned int		size;
+};
+
+struct top_list {
+	struct top_heap		svcs;
+	struct top_heap		dests;
+};
+
+static void top_swap(struct top_entry *a, struct top_entry *b)
 {
-	char *swt = NULL;
+	struct top_entry t = *a;
 
-	switch (flags & IP_VS_CONN_F_FWD_MASK) {
-	case IP_VS_CONN_F_MASQ:
-		swt = "-m"; break;
-	case IP_VS_CONN_F_TUNNEL:
-		swt = "-i"; break;
-	case IP_VS_CONN_F_LOCALNODE:
-	case IP_VS_CONN_F_DROUTE:
-		swt = "-g"; break;
+	*a = *b;
+	*b = t;
+}
+
+static void top_sift_down(struct top_entry *e, unsigned int i, unsigned int n)
+{
+	unsigned int c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && e[c + 1].key < e[c].key)
+			c++;
+		if (e[i].key <= e[c].key)
+			break;
+		top_swap(&e[i], &e[c]);
+		i = c;
+	}
+}
+
+static void top_push(struct top_heap *h, unsigned long long key,
+		     unsigned int active, unsigned int inact,
+		     ipvs_service_entry_t *svc, ipvs_dest_entry_t *dest)
+{
+	struct top_entry *e;
+	unsigned int i;
+
+	if (h->len < h->size) {
+		i = h->len++;
+		for (; i && h->e[(i - 1) / 2].key > key; i = (i - 1) / 2)
+			h->e[i] = h->e[(i - 1) / 2];
+	} else if (key > h->e[0].key) {
+		h->e[0].key = key;
+		i = 0;
+	} else
+		return;
+
+	e = &h->e[i];
+	e->key = key;
+	e->active = active;
+	e->inact = inact;
+	e->svc = *svc;
+	if (dest)
+		e->dest = *dest;
+	if (i == 0 && h->len == h->size)
+		top_sift_down(h->e, 0, h->len);
+}
+
+/* heapsort the winners, largest first */
+static void top_sort(struct top_heap *h)
+{
+	unsigned int n;
+
+	for (n = h->len; n > 1; n--) {
+		top_swap(&h->e[0], &h->e[n - 1]);
+		top_sift_down(h->e, 0, n - 1);
+	}
+}
+
+static unsigned long long
+top_key(struct ip_vs_stats_user *s, unsigned int active, unsigned int inact)
+{
+	switch (top_by) {
+	case TOP_INPPS:
+		return s->inpps;
+	case TOP_OUTPPS:
+		return s->outpps;
+	case TOP_INBPS:
+		return s->inbps;
+	case TOP_OUTBPS:
+		return s->outbps;
+	case TOP_ACTIVECONNS:
+		return active;
+	case TOP_INACTCONNS:
+		return inact;
+	}
+	return s->cps;
+}
+
+static int top_walk_cb(ipvs_service_entry_t *svc, struct ip_vs_get_dests *d,
+		       void *arg)
+{
+	struct top_list *t = (struct top_list *)arg;
+	unsigned int active = 0, inact = 0;
+	int i;
+
+	if (list_filter.set & FILTER_RS && !list_filter_dests(d))
+		return 0;
+
+	for (i = 0; i < d->num_dests; i++) {
+		ipvs_dest_entry_t *e = &d->entrytable[i];
+
+		active += e->activeconns;
+		inact += e->inactconns;
+		top_push(&t->dests, top_key(&e->stats, e->activeconns,
+					    e->inactconns),
+			 e->activeconns, e->inactconns, svc, e);
+	}
+	top_push(&t->svcs, top_key(&svc->stats, active, inact),
+		 active, inact, svc, NULL);
+	return 0;
+}
+
+/* one row of the --top listing, the destination if dest is set */
+static void print_top_entry(struct top_entry *t, int dest, unsigned int format)
+{
+	ipvs_service_entry_t *se = &t->svc;
+	ipvs_dest_entry_t *e = &t->dest;
+	struct ip_vs_stats_user *s;
+	char *p, *start;
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	start = p;
+	if (se->fwmark) {
+		p = format_str(p, "FWM  ");
+		p = format_int(p, (int)se->fwmark);
+		if (se->af == AF_INET6)
+			p = format_str(p, " IPv6");
+	} else {
+		p = format_str(p, se->protocol == IPPROTO_TCP ?
+			       "TCP  " : "UDP  ");
+		p = format_addrport(p, se->af, &se->addr, ntohs(se->port),
+				    se->protocol, format);
+	}
+
+	if (dest) {
+		*p++ = '\n';
+		p = format_str(p, "  -> ");
+		start = p;
+		p = format_addrport(p, se->af, &e->addr, ntohs(e->port),
+				    se->protocol, format);
+		if (se->af != AF_INET6 && p - start > 28)
+			p = start + 28;
+		p = format_pad(p, start, 28);
+		s = &e->stats;
+	} else {
+		if (se->af != AF_INET6 && p - start > 33)
+			p = start + 33;
+		p = format_pad(p, start, 33);
+		s = &se->stats;
+	}
+
+	p = format_largenum(p, s->cps, format);
+	p = format_largenum(p, s->inpps, format);
+	p = format_largenum(p, s->outpps, format);
+	p = format_largenum(p, s->inbps, format);
+	p = format_largenum(p, s->outbps, format);
+	p = format_column(p, t->active, 10);
+	p = format_column(p, t->inact, 10);
+	*p++ = '\n';
+	output_buffer_commit(&output, p);
+}
+
+static void print_top_json(struct top_heap *h, const char *name, int dest)
+{
+	unsigned int i;
+	char *p;
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = json_key(format_str(p, json_entries++ ? ",\n" : "\n"), name);
+	*p++ = '[';
+	output_buffer_commit(&output, p);
+
+	for (i = 0; i < h->len; i++) {
+		struct top_entry *t = &h->e[i];
+
+		p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		p = format_str(p, i ? ",\n{" : "\n{");
+		if (t->svc.fwmark)
+			p = json_uint(p, "fwmark", t->svc.fwmark);
+		else {
+			p = format_str(p, t->svc.protocol == IPPROTO_TCP ?
+				       "\"protocol\":\"tcp\"" :
+				       "\"protocol\":\"udp\"");
+			p = format_str(p, ",\"address\":\"");
+			p = format_addr(p, t->svc.af, &t->svc.addr);
+			p = json_uint(format_str(p, "\","), "port",
+				      ntohs(t->svc.port));
+		}
+		if (dest) {
+			p = format_str(p, ",\"server\":\"");
+			p = format_addr(p, t->svc.af, &t->dest.addr);
+			p = json_uint(format_str(p, "\","), "server_port",
+				      ntohs(t->dest.port));
+		}
+		p = json_uint(format_str(p, ","), "activeconns", t->active);
+		p = json_uint(format_str(p, ","), "inactconns", t->inact);
+		p = json_stats(p, dest ? &t->dest.stats : &t->svc.stats);
+		*p++ = '}';
+		output_buffer_commit(&output, p);
+	}
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	*p++ = ']';
+	output_buffer_commit(&output, p);
+}
+
+static void list_top(unsigned int format)
+{
+	ipvs_service_filter_t filter = NULL;
+	struct top_list t;
+	unsigned int i;
+	char *p;
+
+	if (list_filter.set & (FILTER_VIP|FILTER_PROTO|FILTER_SCHED))
+		filter = list_filter_service;
+
+	memset(&t, 0, sizeof(t));
+	t.svcs.size = t.dests.size = top_count;
+	if (!(t.svcs.e = malloc(sizeof(struct top_entry) * top_count)) ||
+	    !(t.dests.e = malloc(sizeof(struct top_entry) * top_count)))
+		fail(2, "malloc: %s", strerror(errno));
+
+	if (ipvs_walk_services(filter, top_walk_cb, &t)) {
+		fprintf(stderr, "%s\n", ipvs_strerror(errno));
+		exit(1);
+	}
+	top_sort(&t.svcs);
+	top_sort(&t.dests);
+	if (!(format & (FMT_NUMERIC|FMT_JSON))) {
+		for (i = 0; i < t.svcs.len; i++)
+			if (!t.svcs.e[i].svc.fwmark)
+				resolve_addr(t.svcs.e[i].svc.af,
+					     &t.svcs.e[i].svc.addr);
+		for (i = 0; i < t.dests.len; i++)
+			resolve_addr(t.dests.e[i].svc.af,
+				     &t.dests.e[i].dest.addr);
+		resolve_run();
+	}
+
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+
+	if (format & FMT_JSON) {
+		p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		p = format_str(p, "{\"by\":\"");
+		p = format_str(p, top_metrics[top_by]);
+		*p++ = '"';
+		output_buffer_commit(&output, p);
+		json_entries = 1;
+		print_top_json(&t.svcs, "services", 0);
+		print_top_json(&t.dests, "servers", 1);
+		p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		p = format_str(p, "}\n");
+		output_buffer_commit(&output, p);
+	} else {
+		printf("%-33s %8s %8s %8s %8s %8s %-10s %-10s\n"
+		       "  -> RemoteAddress:Port\n",
+		       "Prot LocalAddress:Port",
+		       "CPS", "InPPS", "OutPPS", "InBPS", "OutBPS",
+		       "ActiveConn", "InActConn");
+		printf("Top %u services by %s\n", t.svcs.len,
+		       top_metrics[top_by]);
+		for (i = 0; i < t.svcs.len; i++)
+			print_top_entry(&t.svcs.e[i], 0, format);
+		output_buffer_flush(&output);
+		printf("Top %u real servers by %s\n", t.dests.len,
+		       top_metrics[top_by]);
+		for (i = 0; i < t.dests.len; i++)
+			print_top_entry(&t.dests.e[i], 1, format);
+	}
+
+	output_buffer_destroy(&output);
+	free(t.svcs.e);
+	free(t.dests.e);
+}
+
+
+/*
+ * --watch: list the table again every interval seconds on the same
+ * netlink socket and output buffer.  The rates are worked out here
+ * from the difference of the counters since the previous round, both
+ * snapshots being sorted so that they can be matched in one pass.
+ */
+/* the rate fields of now, from the counters of now and then */
+static void
+watch_rates(struct ip_vs_stats_user *now, struct ip_vs_stats_user *then,
+	    double secs)
+{
+	/* 32 bit counters wrap around, 64 bit ones only go back on -Z */
+	now->cps = (__u32)(now->conns - then->conns) / secs;
+	now->inpps = (__u32)(now->inpkts - then->inpkts) / secs;
+	now->outpps = (__u32)(now->outpkts - then->outpkts) / secs;
+	now->inbps = (now->inbytes >= then->inbytes ?
+		      now->inbytes - then->inbytes : now->inbytes) / secs;
+	now->outbps = (now->outbytes >= then->outbytes ?
+		       now->outbytes - then->outbytes : now->outbytes) / secs;
+}
+
+static void watch_no_rates(struct ip_vs_stats_user *now)
+{
+	now->cps = now->inpps = now->outpps = now->inbps = now->outbps = 0;
+}
+
+static void
+watch_dests(struct ip_vs_get_dests *now, struct ip_vs_get_dests *then,
+	    double secs)
+{
+	int i, j, r;
+
+	for (i = j = 0; i < now->num_dests; i++) {
+		r = 1;
+		while (then && j < then->num_dests &&
+		       (r = ipvs_cmp_dests(&now->entrytable[i],
+					   &then->entrytable[j])) > 0)
+			j++;
+		if (r == 0)
+			watch_rates(&now->entrytable[i].stats,
+				    &then->entrytable[j].stats, secs);
+		else
+			watch_no_rates(&now->entrytable[i].stats);
+	}
+}
+
+static void
+watch_snapshot(ipvs_snapshot_t *now, ipvs_snapshot_t *then, double secs)
+{
+	struct ipvs_snapshot_entry *e, *p;
+	int i, j, r;
+
+	for (i = j = 0; i < now->num_services; i++) {
+		e = &now->entrytable[i];
+		r = 1;
+		while (j < then->num_services &&
+		       (r = ipvs_cmp_services(&e->svc,
+					      &then->entrytable[j].svc)) > 0)
+			j++;
+		p = r == 0 ? &then->entrytable[j] : NULL;
+		if (p)
+			watch_rates(&e->svc.stats, &p->svc.stats, secs);
+		else
+			watch_no_rates(&e->svc.stats);
+		watch_dests(e->dests, p ? p->dests : NULL, secs);
+	}
+}
+
+static ipvs_snapshot_t *watch_get_snapshot(ipvs_service_filter_t filter)
+{
+	ipvs_snapshot_t *snap;
+	int i;
+
+	if (!(snap = ipvs_get_snapshot_filter(filter, NULL))) {
+		fprintf(stderr, "%s\n", ipvs_strerror(errno));
+		exit(1);
+	}
+	ipvs_sort_snapshot(snap, ipvs_cmp_services);
+	for (i = 0; i < snap->num_services; i++)
+		ipvs_sort_dests(snap->entrytable[i].dests, ipvs_cmp_dests);
+	return snap;
+}
+
+static double watch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void list_watch(unsigned int format)
+{
+	ipvs_service_filter_t filter = NULL;
+	ipvs_snapshot_t *now, *then;
+	struct timespec ts;
+	double t_now, t_then;
+	int i, tty;
+
+	if (list_filter.set & (FILTER_VIP|FILTER_PROTO|FILTER_SCHED))
+		filter = list_filter_service;
+	tty = !(format & FMT_JSON) && isatty(STDOUT_FILENO);
+
+	/* printed already sorted, with the rates filled in */
+	format |= FMT_RATE | FMT_NOSORT;
+
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+
+	then = watch_get_snapshot(filter);
+	t_then = watch_now();
+
+	for (;;) {
+		ts.tv_sec = watch_interval;
+		ts.tv_nsec = 0;
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+
+		now = watch_get_snapshot(filter);
+		t_now = watch_now();
+		watch_snapshot(now, then, t_now - t_then);
+		ipvs_free_snapshot(then);
+		if (!(format & (FMT_NUMERIC|FMT_JSON))) {
+			resolve_restart();
+			resolve_snapshot(now);
+		}
+
+		if (format & FMT_JSON)
+			print_json_begin("services");
+		else {
+			if (tty)
+				printf("\033[H\033[J");
+			printf("IP Virtual Server version %d.%d.%d (size=%d), "
+			       "rates over %.1fs\n",
+			       NVERSION(ipvs_info.version), ipvs_info.size,
+			       t_now - t_then);
+			print_title(format);
+		}
+		for (i = 0; i < now->num_services; i++)
+			print_service_entry(&now->entrytable[i].svc,
+					    now->entrytable[i].dests, format);
+		if (format & FMT_JSON)
+			print_json_end();
+		else if (!tty)
+			output_buffer_commit(&output, format_str(
+				output_buffer_reserve(&output, 1), "\n"));
+		output_buffer_flush(&output);
+
+		then = now;
+		t_then = t_now;
+	}
+}
+
+
+/*
+ * --by-real-server: the counters of each real server summed up over
+ * all the services it is in.  The servers are found through an open
+ * addressing hash table on (af, addr, port) while the table is walked.
+ */
+#define RS_WEIGHT		0
+#define RS_ACTIVECONNS		1
+#define RS_INACTCONNS		2
+#define RS_PERSISTCONNS		3
+#define RS_CONNS		4
+#define RS_INPKTS		5
+#define RS_OUTPKTS		6
+#define RS_INBYTES		7
+#define RS_OUTBYTES		8
+#define RS_CPS			9
+#define RS_INPPS		10
+#define RS_OUTPPS		11
+#define RS_INBPS		12
+#define RS_OUTBPS		13
+#define RS_COUNTERS		14
+
+static const char *rs_counter_names[RS_COUNTERS] = {
+	"weight",
+	"activeconns",
+	"inactconns",
+	"persistconns",
+	"conns",
+	"inpkts",
+	"outpkts",
+	"inbytes",
+	"outbytes",
+	"cps",
+	"inpps",
+	"outpps",
+	"inbps",
+	"outbps",
+};
+
+struct rs_entry {
+	__u16			af;
+	__u16			port;
+	__u16			protocol;	/* of the first service */
+	union nf_inet_addr	addr;
+	unsigned int		services;
+	unsigned long long	v[RS_COUNTERS];
+};
+
+struct rs_table {
+	struct rs_entry		*e;
+	unsigned int		len;
+	unsigned int		size;
+	struct index_table	index;
+};
+
+static unsigned int rs_hash(__u16 af, const union nf_inet_addr *addr,
+			    __u16 port)
+{
+	unsigned int h = hash_bytes(HASH_INIT, addr, af == AF_INET6 ? 16 : 4);
+
+	h = hash_bytes(h, &port, sizeof(port));
+	return hash_bytes(h, &af, sizeof(af));
+}
+
+static unsigned int rs_entry_hash(const void *entries, unsigned int i)
+{
+	const struct rs_entry *e = entries;
+
+	return rs_hash(e[i].af, &e[i].addr, e[i].port);
+}
+
+static int rs_match(const void *entries, unsigned int i, const void *key)
+{
+	const struct rs_entry *e = entries;
+	const ipvs_dest_entry_t *d = key;
+
+	return e[i].af == d->af && e[i].port == d->port &&
+	       !memcmp(&e[i].addr, &d->addr, d->af == AF_INET6 ? 16 : 4);
+}
+
+static struct rs_entry *
+rs_lookup(struct rs_table *t, ipvs_dest_entry_t *d, __u16 protocol)
+{
+	struct rs_entry *e;
+	unsigned int j;
+
+	index_reserve(&t->index, t->e, t->len, t->len + 1, rs_entry_hash);
+	j = index_find(&t->index, t->e, d, rs_hash(d->af, &d->addr, d->port),
+		       rs_match);
+	if (t->index.slot[j])
+		return &t->e[t->index.slot[j] - 1];
+
+	if (t->len == t->size) {
+		t->size = t->size ? t->size * 2 : 1024;
+		if (!(e = realloc(t->e, t->size * sizeof(*e))))
+			fail(2, "realloc: %s", strerror(errno));
+		t->e = e;
+	}
+	e = &t->e[t->len++];
+	memset(e, 0, sizeof(*e));
+	e->af = d->af;
+	e->port = d->port;
+	e->protocol = protocol;
+	e->addr = d->addr;
+	t->index.slot[j] = t->len;
+	return e;
+}
+
+static int rs_walk_cb(ipvs_service_entry_t *svc, struct ip_vs_get_dests *d,
+		      void *arg)
+{
+	struct rs_table *t = (struct rs_table *)arg;
+	struct rs_entry *e;
+	int i;
+
+	if (list_filter.set & FILTER_RS && !list_filter_dests(d))
+		return 0;
+
+	for (i = 0; i < d->num_dests; i++) {
+		ipvs_dest_entry_t *de = &d->entrytable[i];
+
+		e = rs_lookup(t, de, svc->protocol);
+		e->services++;
+		e->v[RS_WEIGHT] += de->weight;
+		e->v[RS_ACTIVECONNS] += de->activeconns;
+		e->v[RS_INACTCONNS] += de->inactconns;
+		e->v[RS_PERSISTCONNS] += de->persistconns;
+		e->v[RS_CONNS] += de->stats.conns;
+		e->v[RS_INPKTS] += de->stats.inpkts;
+		e->v[RS_OUTPKTS] += de->stats.outpkts;
+		e->v[RS_INBYTES] += de->stats.inbytes;
+		e->v[RS_OUTBYTES] += de->stats.outbytes;
+		e->v[RS_CPS] += de->stats.cps;
+		e->v[RS_INPPS] += de->stats.inpps;
+		e->v[RS_OUTPPS] += de->stats.outpps;
+		e->v[RS_INBPS] += de->stats.inbps;
+		e->v[RS_OUTBPS] += de->stats.outbps;
+	}
+	return 0;
+}
+
+static int rs_cmp(const void *a, const void *b)
+{
+	const struct rs_entry *e1 = a, *e2 = b;
+	int r;
+
+	if ((r = e1->af - e2->af))
+		return r;
+	if ((r = memcmp(&e1->addr, &e2->addr, e1->af == AF_INET6 ? 16 : 4)))
+		return r;
+	return ntohs(e1->port) - ntohs(e2->port);
+}
+
+static void print_rs_entry(struct rs_entry *e, unsigned int format)
+{
+	char *p, *start;
+	int i, first;
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+
+	if (format & FMT_JSON) {
+		p = json_entry(p);
+		p = format_str(p, "{\"address\":\"");
+		p = format_addr(p, e->af, &e->addr);
+		p = json_uint(format_str(p, "\","), "port", ntohs(e->port));
+		p = json_uint(format_str(p, ","), "services", e->services);
+		for (i = 0; i < RS_COUNTERS; i++)
+			p = json_uint(format_str(p, ","), rs_counter_names[i],
+				      e->v[i]);
+		*p++ = '}';
+		output_buffer_commit(&output, p);
+		return;
+	}
+
+	start = p;
+	p = format_addrport(p, e->af, &e->addr, ntohs(e->port), e->protocol,
+			    format);
+	if (e->af != AF_INET6 && p - start > 33)
+		p = start + 33;
+	p = format_pad(p, start, 33);
+	p = format_column(p, e->services, 8);
+
+	if (format & (FMT_STATS|FMT_RATE)) {
+		first = format & FMT_STATS ? RS_CONNS : RS_CPS;
+		for (i = first; i < first + 5; i++)
+			p = format_largenum(p, e->v[i], format);
+	} else {
+		p = format_column(p, e->v[RS_WEIGHT], 10);
+		p = format_column(p, e->v[RS_ACTIVECONNS], 10);
+		p = format_column(p, e->v[RS_INACTCONNS], 10);
+		p = format_column(p, e->v[RS_PERSISTCONNS], 11);
+	}
+	*p++ = '\n';
+	output_buffer_commit(&output, p);
+}
+
+static void list_by_real_server(unsigned int format)
+{
+	ipvs_service_filter_t filter = NULL;
+	struct rs_table t;
+	unsigned int i;
+
+	if (list_filter.set & (FILTER_VIP|FILTER_PROTO|FILTER_SCHED))
+		filter = list_filter_service;
+
+	memset(&t, 0, sizeof(t));
+	if (ipvs_walk_services(filter, rs_walk_cb, &t)) {
+		fprintf(stderr, "%s\n", ipvs_strerror(errno));
+		exit(1);
+	}
+	if (!(format & FMT_NOSORT))
+		qsort(t.e, t.len, sizeof(*t.e), rs_cmp);
+	if (!(format & (FMT_NUMERIC|FMT_JSON))) {
+		for (i = 0; i < t.len; i++)
+			resolve_addr(t.e[i].af, &t.e[i].addr);
+		resolve_run();
+	}
+
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+
+	if (format & FMT_JSON)
+		print_json_begin("servers");
+	else if (format & FMT_STATS)
+		printf("%-33s %-8s %8s %8s %8s %8s %8s\n",
+		       "RemoteAddress:Port", "Services",
+		       "Conns", "InPkts", "OutPkts", "InBytes", "OutBytes");
+	else if (format & FMT_RATE)
+		printf("%-33s %-8s %8s %8s %8s %8s %8s\n",
+		       "RemoteAddress:Port", "Services",
+		       "CPS", "InPPS", "OutPPS", "InBPS", "OutBPS");
+	else
+		printf("%-33s %-8s %-10s %-10s %-10s %-11s\n",
+		       "RemoteAddress:Port", "Services",
+		       "Weight", "ActiveConn", "InActConn", "PersistConn");
+
+	for (i = 0; i < t.len; i++)
+		print_rs_entry(&t.e[i], format);
+	if (format & FMT_JSON)
+		print_json_end();
+
+	output_buffer_destroy(&output);
+	free(t.e);
+	index_free(&t.index);
+}
+
+
+/*
+ * --export-metrics: the table in the OpenMetrics text format, written
+ * to a file for a textfile collector or served to each client of a
+ * unix:path or tcp:[host:]port listener.  The labels of every service
+ * and server are formatted once and handed from scrape to scrape
+ * through a hash table on their identity.
+ */
+#define METRICS_LABELS_MAXLEN	256
+
+/* what each metric family is read from, indexes into metric_families */
+#define M_CONNS			0
+#define M_INPKTS		1
+#define M_OUTPKTS		2
+#define M_INBYTES		3
+#define M_OUTBYTES		4
+#define M_CPS			5
+#define M_INPPS			6
+#define M_OUTPPS		7
+#define M_INBPS			8
+#define M_OUTBPS		9
+#define M_SERVICE_FAMILIES	10
+#define M_ACTIVECONNS		10
+#define M_INACTCONNS		11
+#define M_PERSISTCONNS		12
+#define M_WEIGHT		13
+#define M_UTHRESHOLD		14
+#define M_LTHRESHOLD		15
+#define M_FAMILIES		16
+
+struct metric_family {
+	const char		*name;
+	const char		*type;
+	const char		*help;
+};
+
+static const struct metric_family metric_families[M_FAMILIES] = {
+	{ "connections", "counter", "Connections scheduled" },
+	{ "incoming_packets", "counter", "Incoming packets" },
+	{ "outgoing_packets", "counter", "Outgoing packets" },
+	{ "incoming_bytes", "counter", "Incoming bytes" },
+	{ "outgoing_bytes", "counter", "Outgoing bytes" },
+	{ "connection_rate", "gauge", "Connections per second" },
+	{ "incoming_packet_rate", "gauge", "Incoming packets per second" },
+	{ "outgoing_packet_rate", "gauge", "Outgoing packets per second" },
+	{ "incoming_byte_rate", "gauge", "Incoming bytes per second" },
+	{ "outgoing_byte_rate", "gauge", "Outgoing bytes per second" },
+	{ "active_connections", "gauge", "Active connections" },
+	{ "inactive_connections", "gauge", "Inactive connections" },
+	{ "persistent_connections", "gauge", "Persistent connections" },
+	{ "weight", "gauge", "Weight" },
+	{ "upper_threshold", "gauge", "Upper connection threshold" },
+	{ "lower_threshold", "gauge", "Lower connection threshold" },
+};
+
+/* a service, or one of its servers when dest is set */
+struct metrics_key {
+	__u32			fwmark;
+	__u16			af;
+	__u16			protocol;
+	__u16			port;
+	__u16			dport;
+	__u16			dest;
+	union nf_inet_addr	addr;
+	union nf_inet_addr	daddr;
+};
+
+struct metrics_label {
+	struct metrics_key	key;
+	char			*labels;
+};
+
+struct metrics_labels {
+	struct metrics_label	*e;
+	unsigned int		len;
+	struct index_table	index;
+};
+
+struct metrics {
+	const char		*path;		/* NULL when listening */
+	struct metrics_labels	labels;
+	char			**svc_labels;	/* of the current snapshot */
+	char			**dest_labels;
+	unsigned int		max_services;
+	unsigned int		max_dests;
+};
+
+static unsigned int metrics_hash(const void *entries, unsigned int i)
+{
+	const struct metrics_label *e = entries;
+
+	return hash_bytes(HASH_INIT, &e[i].key, sizeof(e[i].key));
+}
+
+static int metrics_match(const void *entries, unsigned int i, const void *key)
+{
+	const struct metrics_label *e = entries;
+
+	return !memcmp(&e[i].key, key, sizeof(e[i].key));
+}
+
+static struct metrics_label *
+metrics_lookup(struct metrics_labels *t, const struct metrics_key *k)
+{
+	unsigned int j;
+
+	if (!t->index.mask)
+		return NULL;
+	j = index_find(&t->index, t->e, k, hash_bytes(HASH_INIT, k, sizeof(*k)),
+		       metrics_match);
+	return t->index.slot[j] ? &t->e[t->index.slot[j] - 1] : NULL;
+}
+
+/* the table is sized for all of its entries beforehand */
+static void
+metrics_insert(struct metrics_labels *t, const struct metrics_key *k,
+	       char *labels)
+{
+	unsigned int j;
+
+	j = index_find(&t->index, t->e, k, hash_bytes(HASH_INIT, k, sizeof(*k)),
+		       metrics_match);
+	t->e[t->len].key = *k;
+	t->e[t->len].labels = labels;
+	t->index.slot[j] = ++t->len;
+}
+
+static void metrics_free_labels(struct metrics_labels *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->len; i++)
+		free(t->e[i].labels);
+	free(t->e);
+	index_free(&t->index);
+	memset(t, 0, sizeof(*t));
+}
+
+static void
+metrics_svc_key(struct metrics_key *k, ipvs_service_entry_t *se)
+{
+	memset(k, 0, sizeof(*k));
+	k->fwmark = se->fwmark;
+	k->af = se->af;
+	k->protocol = se->protocol;
+	k->port = se->port;
+	if (!se->fwmark)
+		k->addr = se->addr;
+}
+
+/* the labels of key, from the last scrape if it was there */
+static char *
+metrics_labels(struct metrics_labels *old, const struct metrics_key *k,
+	       const char *svc_labels)
+{
+	struct metrics_label *e;
+	char buf[METRICS_LABELS_MAXLEN], *p, *labels;
+
+	if ((e = metrics_lookup(old, k))) {
+		labels = e->labels;
+		e->labels = NULL;
+		return labels;
+	}
+
+	p = buf;
+	if (k->dest) {
+		/* the service labels without their closing brace */
+		p = format_strn(p, svc_labels, strlen(svc_labels) - 1);
+		p = format_str(p, ",rip=\"");
+		p = format_addr(p, k->af, &k->daddr);
+		p = format_str(p, "\",rport=\"");
+		p = format_uint(p, ntohs(k->dport));
+	} else if (k->fwmark) {
+		p = format_str(p, "{fwmark=\"");
+		p = format_uint(p, k->fwmark);
+		p = format_str(p, k->af == AF_INET6 ?
+			       "\",family=\"inet6" : "\",family=\"inet");
+	} else {
+		p = format_str(p, "{protocol=\"");
+		p = format_str(p, k->protocol == IPPROTO_TCP ? "tcp" : "udp");
+		p = format_str(p, "\",vip=\"");
+		p = format_addr(p, k->af, &k->addr);
+		p = format_str(p, "\",vport=\"");
+		p = format_uint(p, ntohs(k->port));
 	}
-	return swt;
-}
+	p = format_str(p, "\"}");
+	*p = '\0';
 
+	if (!(labels = strdup(buf)))
+		fail(2, "strdup: %s", strerror(errno));
+	return labels;
+}
 
-static void print_largenum(unsigned long long i, unsigned int format)
+/*
+ * Give every service and server of the snapshot its labels and keep
+ * only those in the table, the labels of the rest are freed
+ */
+static void metrics_update_labels(struct metrics *m, ipvs_snapshot_t *s)
 {
-	char mytmp[32];
-	size_t len;
+	struct metrics_labels old = m->labels, *t = &m->labels;
+	unsigned int i, j, n;
+	struct ip_vs_get_dests *d;
+	struct metrics_key k;
+
+	if (s->num_services > m->max_services) {
+		m->max_services = s->num_services;
+		free(m->svc_labels);
+		if (!(m->svc_labels = malloc(m->max_services *
+					     sizeof(char *))))
+			fail(2, "malloc: %s", strerror(errno));
+	}
+	if (s->num_dests > m->max_dests) {
+		m->max_dests = s->num_dests;
+		free(m->dest_labels);
+		if (!(m->dest_labels = malloc(m->max_dests * sizeof(char *))))
+			fail(2, "malloc: %s", strerror(errno));
+	}
 
-	if (format & FMT_EXACT) {
-		len = snprintf(mytmp, 32, "%llu", i);
-		printf("%*llu", len <= 8 ? 9 : len + 1, i);
-		return;
+	n = s->num_services + s->num_dests;
+	memset(t, 0, sizeof(*t));
+	index_reserve(&t->index, NULL, 0, n ? n : 1, metrics_hash);
+	if (!(t->e = malloc((n ? n : 1) * sizeof(*t->e))))
+		fail(2, "malloc: %s", strerror(errno));
+
+	for (i = n = 0; i < s->num_services; i++) {
+		metrics_svc_key(&k, &s->entrytable[i].svc);
+		m->svc_labels[i] = metrics_labels(&old, &k, NULL);
+		metrics_insert(t, &k, m->svc_labels[i]);
+
+		d = s->entrytable[i].dests;
+		k.dest = 1;
+		for (j = 0; j < d->num_dests; j++, n++) {
+			k.daddr = d->entrytable[j].addr;
+			k.dport = d->entrytable[j].port;
+			m->dest_labels[n] = metrics_labels(&old, &k,
+							   m->svc_labels[i]);
+			metrics_insert(t, &k, m->dest_labels[n]);
+		}
 	}
-	
-	if (i < 100000000)			/* less than 100 million */
-		printf("%9llu", i);
-	else if (i < 1000000000)		/* less than 1 billion */
-		printf("%8lluK", i / 1000);
-	else if (i < 100000000000ULL)		/* less than 100 billion */
-		printf("%8lluM", i / 1000000);
-	else if (i < 100000000000000ULL)	/* less than 100 trillion */
-		printf("%8lluG", i / 1000000000ULL);
-	else
-		printf("%8lluT", i / 1000000000000ULL);
+	metrics_free_labels(&old);
 }
 
+static unsigned long long
+metric_value(int f, struct ip_vs_stats_user *st, ipvs_dest_entry_t *de)
+{
+	switch (f) {
+	case M_CONNS:		return st->conns;
+	case M_INPKTS:		return st->inpkts;
+	case M_OUTPKTS:		return st->outpkts;
+	case M_INBYTES:		return st->inbytes;
+	case M_OUTBYTES:	return st->outbytes;
+	case M_CPS:		return st->cps;
+	case M_INPPS:		return st->inpps;
+	case M_OUTPPS:		return st->outpps;
+	case M_INBPS:		return st->inbps;
+	case M_OUTBPS:		return st->outbps;
+	case M_ACTIVECONNS:	return de->activeconns;
+	case M_INACTCONNS:	return de->inactconns;
+	case M_PERSISTCONNS:	return de->persistconns;
+	case M_UTHRESHOLD:	return de->u_threshold;
+	case M_LTHRESHOLD:	return de->l_threshold;
+	}
+	return 0;
+}
 
-static void print_title(unsigned int format)
+static char *
+print_metric_family(char *p, const char *prefix, int f)
 {
-	if (format & FMT_STATS)
-		printf("%-33s %8s %8s %8s %8s %8s\n"
-		       "  -> RemoteAddress:Port\n",
-		       "Prot LocalAddress:Port",
-		       "Conns", "InPkts", "OutPkts", "InBytes", "OutBytes");
-	else if (format & FMT_RATE)
-		printf("%-33s %8s %8s %8s %8s %8s\n"
-		       "  -> RemoteAddress:Port\n",
-		       "Prot LocalAddress:Port",
-		       "CPS", "InPPS", "OutPPS", "InBPS", "OutBPS");
-	else if (format & FMT_THRESHOLDS)
-		printf("%-33s %-10s %-10s %-10s %-10s\n"
-		       "  -> RemoteAddress:Port\n",
-		       "Prot LocalAddress:Port",
-		       "Uthreshold", "Lthreshold", "ActiveConn", "InActConn");
-	else if (format & FMT_PERSISTENTCONN)
-		printf("%-33s %-9s %-11s %-10s %-10s\n"
-		       "  -> RemoteAddress:Port\n",
-		       "Prot LocalAddress:Port",
-		       "Weight", "PersistConn", "ActiveConn", "InActConn");
-	else if (!(format & FMT_RULE))
-		printf("Prot LocalAddress:Port Scheduler Flags\n"
-		       "  -> RemoteAddress:Port           Forward Weight ActiveConn InActConn\n");
+	const struct metric_family *mf = &metric_families[f];
+
+	p = format_str(p, "# TYPE ");
+	p = format_str(format_str(p, prefix), mf->name);
+	*p++ = ' ';
+	p = format_str(format_str(p, mf->type), "\n# HELP ");
+	p = format_str(format_str(p, prefix), mf->name);
+	*p++ = ' ';
+	p = format_str(format_str(p, mf->help), "\n");
+	return p;
 }
 
+static char *
+print_metric(char *p, const char *prefix, int f, const char *labels,
+	     long long v)
+{
+	const struct metric_family *mf = &metric_families[f];
+
+	p = format_str(format_str(p, prefix), mf->name);
+	if (mf->type[0] == 'c')
+		p = format_str(p, "_total");
+	p = format_str(p, labels);
+	*p++ = ' ';
+	p = format_int(p, v);
+	*p++ = '\n';
+	return p;
+}
 
-static void
-print_service_entry(ipvs_service_entry_t *se, unsigned int format)
+static void metrics_write(struct metrics *m, ipvs_snapshot_t *s)
 {
 	struct ip_vs_get_dests *d;
-	char svc_name[64];
-	int i;
-
-	if (!(d = ipvs_get_dests(se))) {
-		fprintf(stderr, "%s\n", ipvs_strerror(errno));
-		exit(1);
-	}
-
-	if (se->fwmark) {
-		if (format & FMT_RULE)
-			if (se->af == AF_INET6)
-				sprintf(svc_name, "-f %d -6", se->fwmark);
-			else
-				sprintf(svc_name, "-f %d", se->fwmark);
-		else
-			if (se->af == AF_INET6)
-				sprintf(svc_name, "FWM  %d IPv6", se->fwmark);
-			else
-				sprintf(svc_name, "FWM  %d", se->fwmark);
-	} else {
-		char *vname;
-
-		if (!(vname = addrport_to_anyname(se->af, &se->addr, ntohs(se->port),
-						  se->protocol, format)))
-			fail(2, "addrport_to_anyname: %s", strerror(errno));
-		if (format & FMT_RULE)
-			sprintf(svc_name, "%s %s",
-				se->protocol==IPPROTO_TCP?"-t":"-u",
-				vname);
-		else {
-			sprintf(svc_name, "%s  %s",
-				se->protocol==IPPROTO_TCP?"TCP":"UDP",
-				vname);
-			if (se->af != AF_INET6)
-				svc_name[33] = '\0';
+	ipvs_dest_entry_t *de;
+	unsigned int i, j, n;
+	long long v;
+	char *p;
+	int f;
+
+	for (f = 0; f < M_SERVICE_FAMILIES; f++) {
+		p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		p = print_metric_family(p, "ipvs_service_", f);
+		output_buffer_commit(&output, p);
+		for (i = 0; i < s->num_services; i++) {
+			p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+			v = metric_value(f, &s->entrytable[i].svc.stats, NULL);
+			p = print_metric(p, "ipvs_service_", f,
+					 m->svc_labels[i], v);
+			output_buffer_commit(&output, p);
 		}
-		free(vname);
 	}
 
-	/* print virtual service info */
-	if (format & FMT_RULE) {
-		printf("-A %s -s %s", svc_name, se->sched_name);
-		if (se->flags & IP_VS_SVC_F_PERSISTENT) {
-			printf(" -p %u", se->timeout);
-			if (se->af == AF_INET)
-				if (se->netmask != (unsigned long int) 0xffffffff) {
-					struct in_addr mask;
-					mask.s_addr = se->netmask;
-					printf(" -M %s", inet_ntoa(mask));
-				}
-			if (se->af == AF_INET6)
-				if (se->netmask != 128) {
-					printf(" -M %i", se->netmask);
-				}
-		}
-		if (se->pe_name[0])
-			printf(" pe %s", se->pe_name);
-		if (se->flags & IP_VS_SVC_F_ONEPACKET)
-			printf(" ops");
-	} else if (format & FMT_STATS) {
-		printf("%-33s", svc_name);
-		print_largenum(se->stats.conns, format);
-		print_largenum(se->stats.inpkts, format);
-		print_largenum(se->stats.outpkts, format);
-		print_largenum(se->stats.inbytes, format);
-		print_largenum(se->stats.outbytes, format);
-	} else if (format & FMT_RATE) {
-		printf("%-33s", svc_name);
-		print_largenum(se->stats.cps, format);
-		print_largenum(se->stats.inpps, format);
-		print_largenum(se->stats.outpps, format);
-		print_largenum(se->stats.inbps, format);
-		print_largenum(se->stats.outbps, format);
-	} else {
-		printf("%s %s", svc_name, se->sched_name);
-		if (se->flags & IP_VS_SVC_F_PERSISTENT) {
-			printf(" persistent %u", se->timeout);
-			if (se->af == AF_INET)
-				if (se->netmask != (unsigned long int) 0xffffffff) {
-					struct in_addr mask;
-					mask.s_addr = se->netmask;
-					printf(" mask %s", inet_ntoa(mask));
-				}
-			if (se->af == AF_INET6)
-				if (se->netmask != 128)
-					printf(" mask %i", se->netmask);
-			if (se->pe_name[0])
-				printf(" pe %s", se->pe_name);
-			if (se->flags & IP_VS_SVC_F_ONEPACKET)
-				printf(" ops");
+	for (f = 0; f < M_FAMILIES; f++) {
+		p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+		p = print_metric_family(p, "ipvs_backend_", f);
+		output_buffer_commit(&output, p);
+		for (i = n = 0; i < s->num_services; i++) {
+			d = s->entrytable[i].dests;
+			for (j = 0; j < d->num_dests; j++, n++) {
+				de = &d->entrytable[j];
+				if (f == M_WEIGHT)
+					v = de->weight;
+				else
+					v = metric_value(f, &de->stats, de);
+				p = output_buffer_reserve(&output,
+							  OUTPUT_BUFFER_LINE);
+				p = print_metric(p, "ipvs_backend_", f,
+						 m->dest_labels[n], v);
+				output_buffer_commit(&output, p);
+			}
 		}
 	}
-	printf("\n");
 
-	/* print all the destination entries */
-	if (!(format & FMT_NOSORT))
-		ipvs_sort_dests(d, ipvs_cmp_dests);
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	output_buffer_commit(&output, format_str(p, "# EOF\n"));
+}
 
-	for (i = 0; i < d->num_dests; i++) {
-		char *dname;
-		ipvs_dest_entry_t *e = &d->entrytable[i];
+static ipvs_snapshot_t *metrics_snapshot(struct metrics *m)
+{
+	ipvs_service_filter_t filter = NULL;
+	ipvs_snapshot_t *s;
+	unsigned int i;
 
-		if (!(dname = addrport_to_anyname(se->af, &(e->addr), ntohs(e->port),
-						  se->protocol, format))) {
-			fprintf(stderr, "addrport_to_anyname fails\n");
-			exit(1);
-		}
-		if (!(format & FMT_RULE) && (se->af != AF_INET6))
-			dname[28] = '\0';
+	if (list_filter.set & (FILTER_VIP|FILTER_PROTO|FILTER_SCHED))
+		filter = list_filter_service;
+	if (!(s = ipvs_get_snapshot_filter(filter, NULL)))
+		return NULL;
 
-		if (format & FMT_RULE) {
-			printf("-a %s -r %s %s -w %d\n", svc_name, dname,
-			       fwd_switch(e->conn_flags), e->weight);
-		} else if (format & FMT_STATS) {
-			printf("  -> %-28s", dname);
-			print_largenum(e->stats.conns, format);
-			print_largenum(e->stats.inpkts, format);
-			print_largenum(e->stats.outpkts, format);
-			print_largenum(e->stats.inbytes, format);
-			print_largenum(e->stats.outbytes, format);
-			printf("\n");
-		} else if (format & FMT_RATE) {
-			printf("  -> %-28s %8u %8u %8u", dname,
-			       e->stats.cps,
-			       e->stats.inpps,
-			       e->stats.outpps);
-			print_largenum(e->stats.inbps, format);
-			print_largenum(e->stats.outbps, format);
-			printf("\n");
-		} else if (format & FMT_THRESHOLDS) {
-			printf("  -> %-28s %-10u %-10u %-10u %-10u\n", dname,
-			       e->u_threshold, e->l_threshold,
-			       e->activeconns, e->inactconns);
-		} else if (format & FMT_PERSISTENTCONN) {
-			printf("  -> %-28s %-9u %-11u %-10u %-10u\n", dname,
-			       e->weight, e->persistconns,
-			       e->activeconns, e->inactconns);
-		} else
-			printf("  -> %-28s %-7s %-6d %-10u %-10u\n",
-			       dname, fwd_name(e->conn_flags),
-			       e->weight, e->activeconns, e->inactconns);
-		free(dname);
+	if (list_filter.set & FILTER_RS) {
+		s->num_dests = 0;
+		for (i = 0; i < s->num_services; i++)
+			s->num_dests += list_filter_dests(s->entrytable[i].dests);
 	}
-	free(d);
+	metrics_update_labels(m, s);
+	return s;
 }
 
+static int metrics_write_file(struct metrics *m)
+{
+	char tmp[PATH_MAX];
+	ipvs_snapshot_t *s;
+	FILE *f;
 
-static void list_service(ipvs_service_t *svc, unsigned int format)
+	if (!(s = metrics_snapshot(m)))
+		return -1;
+
+	if (!(f = replace_open(m->path, tmp, sizeof(tmp)))) {
+		ipvs_free_snapshot(s);
+		return -1;
+	}
+	output_buffer_set_stream(&output, f);
+	metrics_write(m, s);
+	output_buffer_flush(&output);
+	ipvs_free_snapshot(s);
+	return replace_close(f, tmp, m->path);
+}
+
+static void metrics_serve(struct metrics *m, int fd)
 {
-	ipvs_service_entry_t *entry;
+	struct timeval tv = { 5, 0 };
+	char req[4096];
+	ipvs_snapshot_t *s;
+	size_t len = 0;
+	ssize_t r;
+	FILE *f;
 
-	if (!(entry = ipvs_get_service(svc->fwmark, svc->af, svc->protocol,
-				       svc->addr, svc->port))) {
-		fprintf(stderr, "%s\n", ipvs_strerror(errno));
-		exit(1);
+	/*
+	 * Clients are served one at a time, one that stops reading or
+	 * writing must not hold up the others: its writes fail after the
+	 * timeout and nothing more is sent to it.
+	 */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* the request itself does not matter, every path is answered */
+	while (len < sizeof(req) - 1 &&
+	       (r = read(fd, req + len, sizeof(req) - 1 - len)) > 0) {
+		len += r;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
 	}
 
-	print_title(format);
-	print_service_entry(entry, format);
-	free(entry);
+	if (!(f = fdopen(fd, "w"))) {
+		close(fd);
+		return;
+	}
+	if (!(s = metrics_snapshot(m))) {
+		fprintf(f, "HTTP/1.0 503 Service Unavailable\r\n"
+			"Content-Type: text/plain\r\n\r\n%s\n",
+			ipvs_strerror(errno));
+		fclose(f);
+		return;
+	}
+	fputs("HTTP/1.0 200 OK\r\n"
+	      "Content-Type: application/openmetrics-text; version=1.0.0; "
+	      "charset=utf-8\r\n\r\n", f);
+	output_buffer_set_stream(&output, f);
+	metrics_write(m, s);
+	output_buffer_flush(&output);
+	ipvs_free_snapshot(s);
+	fclose(f);
 }
 
-
-static void list_all(unsigned int format)
+static int metrics_listen(const char *target)
 {
-	struct ip_vs_get_services *get;
-	int i;
-
-	if (!(format & FMT_RULE))
-		printf("IP Virtual Server version %d.%d.%d (size=%d)\n",
-		       NVERSION(ipvs_info.version), ipvs_info.size);
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un su;
+	char host[NI_MAXHOST], *port;
+	int fd = -1, on = 1;
+
+	if (!strncmp(target, "unix:", 5)) {
+		memset(&su, 0, sizeof(su));
+		su.sun_family = AF_UNIX;
+		if (strlen(target + 5) >= sizeof(su.sun_path))
+			fail(2, "socket path `%s' is too long", target + 5);
+		strcpy(su.sun_path, target + 5);
+		unlink(su.sun_path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		    bind(fd, (struct sockaddr *)&su, sizeof(su)) ||
+		    listen(fd, 16))
+			fail(2, "%s: %s", target, strerror(errno));
+		return fd;
+	}
 
-	if (!(get = ipvs_get_services())) {
-		fprintf(stderr, "%s\n", ipvs_strerror(errno));
-		exit(1);
+	/* tcp:port, tcp:host:port or tcp:[v6addr]:port */
+	if (strlen(target + 4) >= sizeof(host))
+		fail(2, "illegal listen address `%s'", target);
+	strcpy(host, target + 4);
+	if ((port = strrchr(host, ':'))) {
+		*port++ = '\0';
+		if (host[0] == '[' && port[-2] == ']') {
+			port[-2] = '\0';
+			memmove(host, host + 1, strlen(host));
+		}
+	} else
+		port = host;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(port == host || !host[0] ? NULL : host, port,
+			&hints, &res))
+		fail(2, "illegal listen address `%s'", target);
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+				 ai->ai_protocol)) < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16))
+			break;
+		close(fd);
+		fd = -1;
 	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		fail(2, "%s: %s", target, strerror(errno));
+	return fd;
+}
 
-	if (!(format & FMT_NOSORT))
-		ipvs_sort_services(get, ipvs_cmp_services);
+static void export_metrics(void)
+{
+	struct metrics m;
+	int lfd, fd;
+
+	memset(&m, 0, sizeof(m));
+	if (output_buffer_init(&output, stdout, 0))
+		fail(2, "output_buffer_init: %s", strerror(errno));
+
+	if (strncmp(metrics_target, "unix:", 5) &&
+	    strncmp(metrics_target, "tcp:", 4)) {
+		m.path = metrics_target;
+		if (metrics_write_file(&m))
+			fail(2, "%s: %s", metrics_target,
+			     ipvs_strerror(errno));
+		output_buffer_destroy(&output);
+		metrics_free_labels(&m.labels);
+		free(m.svc_labels);
+		free(m.dest_labels);
+		return;
+	}
 
-	print_title(format);
-	for (i = 0; i < get->num_services; i++)
-		print_service_entry(&get->entrytable[i], format);
-	free(get);
+	/* a scraper going away mid-response must not end the exporter */
+	signal(SIGPIPE, SIG_IGN);
+	lfd = metrics_listen(metrics_target);
+	for (;;) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fail(2, "accept: %s", strerror(errno));
+		}
+		metrics_serve(&m, fd);
+	}
 }
 
 
-void list_timeout(void)
+void list_timeout(unsigned int format)
 {
 	ipvs_timeout_t *u;
 
 	if (!(u = ipvs_get_timeout()))
 		exit(1);
-	printf("Timeout (tcp tcpfin udp): %d %d %d\n",
-	       u->tcp_timeout, u->tcp_fin_timeout, u->udp_timeout);
+	if (format & FMT_JSON)
+		printf("{\"timeout\":{\"tcp\":%d,\"tcpfin\":%d,\"udp\":%d}}\n",
+		       u->tcp_timeout, u->tcp_fin_timeout, u->udp_timeout);
+	else
+		printf("Timeout (tcp tcpfin udp): %d %d %d\n",
+		       u->tcp_timeout, u->tcp_fin_timeout, u->udp_timeout);
 	free(u);
 }
 
 
-static void list_daemon(void)
+static void print_daemon_json(ipvs_daemon_t *u, const char *state)
+{
+	char *p;
+
+	p = output_buffer_reserve(&output, OUTPUT_BUFFER_LINE);
+	p = json_entry(p);
+	p = format_str(p, "{\"state\":\"");
+	p = format_str(p, state);
+	p = json_key(format_str(p, "\","), "mcast_ifn");
+	p = format_json_str(p, u->mcast_ifn, IP_VS_IFNAME_MAXLEN);
+	p = json_uint(format_str(p, ","), "syncid", u->syncid);
+	*p++ = '}';
+	output_buffer_commit(&output, p);
+}
+
+
+static void list_daemon(unsigned int format)
 {
 	ipvs_daemon_t *u;
 
 	if (!(u = ipvs_get_daemon()))
 		exit(1);
 
+	if (format & FMT_JSON) {
+		if (output_buffer_init(&output, stdout, 0))
+			fail(2, "output_buffer_init: %s", strerror(errno));
+		print_json_begin("daemons");
+		if (u[0].state & IP_VS_STATE_MASTER)
+			print_daemon_json(&u[0], "master");
+		if (u[1].state & IP_VS_STATE_BACKUP)
+			print_daemon_json(&u[1], "backup");
+		print_json_end();
+		output_buffer_destroy(&output);
+		free(u);
+		return;
+	}
+
 	if (u[0].state & IP_VS_STATE_MASTER)
 		printf("master sync daemon (mcast=%s, syncid=%d)\n",
 		       u[0].mcast_ifn, u[0].syncid);
@@ -1645,6 +5611,222 @@ static void list_daemon(void)
 }
 
 
+/*
+ * Reverse DNS: every address is looked up only once.  The addresses of
+ * a listing are queued up front and resolved in parallel by a pool of
+ * threads, and all lookups together get RESOLVE_TIMEOUT seconds, after
+ * which what is still unresolved is shown numerically.
+ */
+#define RESOLVE_TIMEOUT		5
+#define RESOLVE_THREADS		32
+
+#define HOST_QUEUED		0
+#define HOST_QUERYING		1
+#define HOST_DONE		2
+
+struct host_entry {
+	__u16			af;
+	int			state;
+	union nf_inet_addr	addr;
+	char			*name;		/* NULL if there is none */
+};
+
+struct host_cache {
+	struct host_entry	*e;
+	unsigned int		len;
+	unsigned int		size;
+	struct index_table	index;
+	unsigned int		next;		/* first queued entry */
+	unsigned int		pending;	/* queued or querying */
+	unsigned int		threads;
+	int			started;
+	int			expired;
+	struct timespec		deadline;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;
+	pthread_cond_t		done;
+};
+
+static struct host_cache hosts = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned int host_hash(const void *entries, unsigned int i)
+{
+	const struct host_entry *e = entries;
+
+	return rs_hash(e[i].af, &e[i].addr, 0);
+}
+
+static int host_match(const void *entries, unsigned int i, const void *key)
+{
+	const struct host_entry *e = entries;
+	const struct host_entry *k = key;
+
+	return e[i].af == k->af &&
+	       !memcmp(&e[i].addr, &k->addr, k->af == AF_INET6 ? 16 : 4);
+}
+
+/* the entry of addr, queued for resolving if it is new; with the lock */
+static struct host_entry *host_lookup(int af, const void *addr)
+{
+	struct host_cache *c = &hosts;
+	size_t alen = af == AF_INET6 ? 16 : 4;
+	struct host_entry *e, k;
+	unsigned int j;
+
+	k.af = af;
+	memcpy(&k.addr, addr, alen);
+	index_reserve(&c->index, c->e, c->len, c->len + 1, host_hash);
+	j = index_find(&c->index, c->e, &k, rs_hash(af, &k.addr, 0),
+		       host_match);
+	if (c->index.slot[j])
+		return &c->e[c->index.slot[j] - 1];
+
+	if (c->len == c->size) {
+		c->size = c->size ? c->size * 2 : 256;
+		if (!(e = realloc(c->e, c->size * sizeof(*e))))
+			fail(2, "realloc: %s", strerror(errno));
+		c->e = e;
+	}
+	e = &c->e[c->len++];
+	memset(e, 0, sizeof(*e));
+	e->af = af;
+	memcpy(&e->addr, addr, alen);
+	c->index.slot[j] = c->len;
+
+	/* out of time, it is not even asked for */
+	if (c->expired)
+		e->state = HOST_DONE;
+	else
+		c->pending++;
+	return e;
+}
+
+static void *host_resolver(void *arg)
+{
+	struct host_cache *c = &hosts;
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+	char name[NI_MAXHOST];
+	unsigned int i;
+	socklen_t len;
+	int r;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (c->next == c->len || c->expired)
+			pthread_cond_wait(&c->work, &c->lock);
+		i = c->next++;
+		c->e[i].state = HOST_QUERYING;
+
+		memset(&ss, 0, sizeof(ss));
+		if (c->e[i].af == AF_INET6) {
+			sin6->sin6_family = AF_INET6;
+			memcpy(&sin6->sin6_addr, &c->e[i].addr, 16);
+			len = sizeof(*sin6);
+		} else {
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, &c->e[i].addr, 4);
+			len = sizeof(*sin);
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		r = getnameinfo((struct sockaddr *)&ss, len, name,
+				sizeof(name), NULL, 0, NI_NAMEREQD);
+
+		pthread_mutex_lock(&c->lock);
+		/* given up on when the deadline passed */
+		if (c->e[i].state != HOST_QUERYING)
+			continue;
+		if (!r)
+			c->e[i].name = strdup(name);
+		c->e[i].state = HOST_DONE;
+		if (!--c->pending)
+			pthread_cond_broadcast(&c->done);
+	}
+	return NULL;
+}
+
+/* resolve everything queued, or give up on it at the deadline */
+static void resolve_run(void)
+{
+	struct host_cache *c = &hosts;
+	pthread_attr_t attr;
+	pthread_t tid;
+	unsigned int i;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->started) {
+		clock_gettime(CLOCK_REALTIME, &c->deadline);
+		c->deadline.tv_sec += RESOLVE_TIMEOUT;
+		c->started = 1;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (c->threads < RESOLVE_THREADS && c->threads < c->pending &&
+	       !pthread_create(&tid, &attr, host_resolver, NULL))
+		c->threads++;
+	pthread_attr_destroy(&attr);
+	pthread_cond_broadcast(&c->work);
+
+	while (c->pending && !c->expired)
+		if (pthread_cond_timedwait(&c->done, &c->lock,
+					   &c->deadline) == ETIMEDOUT)
+			c->expired = 1;
+
+	if (c->expired) {
+		for (i = 0; i < c->len; i++)
+			c->e[i].state = HOST_DONE;
+		c->next = c->len;
+		c->pending = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* a new RESOLVE_TIMEOUT for the lookups from here on */
+static void resolve_restart(void)
+{
+	pthread_mutex_lock(&hosts.lock);
+	hosts.started = 0;
+	hosts.expired = 0;
+	pthread_mutex_unlock(&hosts.lock);
+}
+
+/* queue an address for the next resolve_run() */
+static void resolve_addr(int af, const void *addr)
+{
+	pthread_mutex_lock(&hosts.lock);
+	host_lookup(af, addr);
+	pthread_mutex_unlock(&hosts.lock);
+}
+
+/* queue the addresses a service is listed with */
+static void
+resolve_service(ipvs_service_entry_t *se, struct ip_vs_get_dests *d)
+{
+	int i;
+
+	if (!se->fwmark)
+		resolve_addr(se->af, &se->addr);
+	for (i = 0; i < d->num_dests; i++)
+		resolve_addr(se->af, &d->entrytable[i].addr);
+}
+
+static void resolve_snapshot(ipvs_snapshot_t *s)
+{
+	int i;
+
+	for (i = 0; i < s->num_services; i++)
+		resolve_service(&s->entrytable[i].svc, s->entrytable[i].dests);
+	resolve_run();
+}
+
+
 int host_to_addr(const char *name, struct in_addr *addr)
 {
 	struct hostent *host;
@@ -1663,96 +5845,172 @@ int host_to_addr(const char *name, struct in_addr *addr)
 
 static char * addr_to_host(int af, const void *addr)
 {
-	struct hostent *host;
+	struct host_entry *e;
+	char *name;
+	int state;
+
+	pthread_mutex_lock(&hosts.lock);
+	e = host_lookup(af, addr);
+	name = e->name;
+	state = e->state;
+	pthread_mutex_unlock(&hosts.lock);
+	if (state == HOST_DONE)
+		return name;
 
-	if ((host = gethostbyaddr((char *) addr,
-				  sizeof(struct in_addr), af)) != NULL)
-		return (char *) host->h_name;
-	else
-		return (char *) NULL;
+	resolve_run();
+	pthread_mutex_lock(&hosts.lock);
+	name = host_lookup(af, addr)->name;
+	pthread_mutex_unlock(&hosts.lock);
+	return name;
 }
 
 
-static char * addr_to_anyname(int af, const void *addr)
+/*
+ * Service names: the services database is read once, on first use, into
+ * a table indexed by port and a hash table of names and aliases, one of
+ * each for tcp and for udp.  As with getservbyport() and getservbyname()
+ * the first entry of a port or name wins.
+ */
+struct serv_name {
+	char			*name;
+	int			port;
+};
+
+struct serv_table {
+	char			**byport;	/* 65536 names, NULL if none */
+	struct serv_name	*names;
+	unsigned int		len;
+	size_t			size;
+	struct index_table	index;
+};
+
+static struct serv_table serv_tables[2];	/* tcp, udp */
+static pthread_once_t serv_once = PTHREAD_ONCE_INIT;
+
+static unsigned int serv_hash(const void *entries, unsigned int i)
 {
-	char *name;
-	static char buf[INET6_ADDRSTRLEN];
+	const struct serv_name *n = entries;
 
-	if ((name = addr_to_host(af, addr)) != NULL)
-		return name;
-	inet_ntop(af, addr, buf, sizeof(buf));
-	return buf;
+	return hash_bytes(HASH_INIT, n[i].name, strlen(n[i].name));
 }
 
+static int serv_match(const void *entries, unsigned int i, const void *key)
+{
+	const struct serv_name *n = entries;
 
-int service_to_port(const char *name, unsigned short proto)
+	return !strcmp(n[i].name, key);
+}
+
+/* the slot of name, a free one if it is not in the table */
+static unsigned int serv_slot(struct serv_table *t, const char *name)
 {
-	struct servent *service;
+	return index_find(&t->index, t->names, name,
+			  hash_bytes(HASH_INIT, name, strlen(name)),
+			  serv_match);
+}
 
-	if (proto == IPPROTO_TCP
-	    && (service = getservbyname(name, "tcp")) != NULL)
-		return ntohs((unsigned short) service->s_port);
-	else if (proto == IPPROTO_UDP
-		 && (service = getservbyname(name, "udp")) != NULL)
-		return ntohs((unsigned short) service->s_port);
-	else
-		return -1;
+/* the copy of name kept in the table, added with port if it is new */
+static char *serv_add_name(struct serv_table *t, const char *name, int port)
+{
+	struct serv_name *n;
+	unsigned int j;
+
+	index_reserve(&t->index, t->names, t->len, t->len + 1, serv_hash);
+	j = serv_slot(t, name);
+	if (t->index.slot[j])
+		return t->names[t->index.slot[j] - 1].name;
+
+	t->names = array_grow(t->names, t->len, &t->size, sizeof(*n));
+	n = &t->names[t->len];
+	if (!(n->name = strdup(name)))
+		fail(2, "strdup: %s", strerror(errno));
+	n->port = port;
+	t->index.slot[j] = ++t->len;
+	return n->name;
 }
 
+static void serv_load(void)
+{
+	struct serv_table *t;
+	struct servent *s;
+	char *name;
+	int i, port;
+
+	for (i = 0; i < 2; i++)
+		if (!(serv_tables[i].byport = calloc(65536, sizeof(char *))))
+			fail(2, "calloc: %s", strerror(errno));
+
+	setservent(1);
+	while ((s = getservent()) != NULL) {
+		if (!strcmp(s->s_proto, "tcp"))
+			t = &serv_tables[0];
+		else if (!strcmp(s->s_proto, "udp"))
+			t = &serv_tables[1];
+		else
+			continue;
+		port = ntohs((unsigned short) s->s_port);
+		name = serv_add_name(t, s->s_name, port);
+		if (!t->byport[port])
+			t->byport[port] = name;
+		for (i = 0; s->s_aliases[i]; i++)
+			serv_add_name(t, s->s_aliases[i], port);
+	}
+	endservent();
+}
 
-static char * port_to_service(unsigned short port, unsigned short proto)
+static struct serv_table *serv_table(unsigned short proto)
 {
-	struct servent *service;
+	if (proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+		return NULL;
+	pthread_once(&serv_once, serv_load);
+	return &serv_tables[proto == IPPROTO_TCP ? 0 : 1];
+}
 
-	if (proto == IPPROTO_TCP &&
-	    (service = getservbyport(htons(port), "tcp")) != NULL)
-		return service->s_name;
-	else if (proto == IPPROTO_UDP &&
-		 (service = getservbyport(htons(port), "udp")) != NULL)
-		return service->s_name;
-	else
-		return (char *) NULL;
+
+int service_to_port(const char *name, unsigned short proto)
+{
+	struct serv_table *t;
+	unsigned int j;
+
+	if (!(t = serv_table(proto)) || !t->len)
+		return -1;
+	j = serv_slot(t, name);
+	return t->index.slot[j] ? t->names[t->index.slot[j] - 1].port : -1;
 }
 
 
-static char * port_to_anyname(unsigned short port, unsigned short proto)
+static char * port_to_service(unsigned short port, unsigned short proto)
 {
-	char *name;
-	static char buf[10];
+	struct serv_table *t;
 
-	if ((name = port_to_service(port, proto)) != NULL)
-		return name;
-	else {
-		sprintf(buf, "%u", port);
-		return buf;
-	}
+	if (!(t = serv_table(proto)))
+		return (char *) NULL;
+	return t->byport[port];
 }
 
 
+/* address:port, by name unless FMT_NUMERIC, cut to ADDRPORT_MAXLEN */
 static char *
-addrport_to_anyname(int af, const void *addr, unsigned short port,
-		    unsigned short proto, unsigned int format)
+format_addrport(char *p, int af, const void *addr, unsigned short port,
+		unsigned short proto, unsigned int format)
 {
-  char *buf, pbuf[INET6_ADDRSTRLEN];
-
-	if (!(buf=malloc(60)))
-		return NULL;
+	char *start = p, *name;
 
-	if (format & FMT_NUMERIC) {
-		snprintf(buf, 60, "%s%s%s:%u",
-			 af == AF_INET ? "" : "[",
-			 inet_ntop(af, addr, pbuf, sizeof(pbuf)),
-			 af == AF_INET ? "" : "]",
-			 port);
-	} else {
-	  snprintf(buf, 60, "%s%s%s:%s",
-		   af == AF_INET ? "" : "[",
-		   addr_to_anyname(af, addr),
-		   af == AF_INET ? "" : "]",
-		   port_to_anyname(port, proto));
-	}
+	if (af != AF_INET)
+		*p++ = '[';
+	if (format & FMT_NUMERIC || !(name = addr_to_host(af, addr)))
+		p = format_addr(p, af, addr);
+	else
+		p = format_strn(p, name, ADDRPORT_MAXLEN);
+	if (af != AF_INET)
+		*p++ = ']';
+	*p++ = ':';
+	if (format & FMT_NUMERIC || !(name = port_to_service(port, proto)))
+		p = format_uint(p, port);
+	else
+		p = format_strn(p, name, ADDRPORT_MAXLEN);
 
-	return buf;
+	return p - start > ADDRPORT_MAXLEN ? start + ADDRPORT_MAXLEN : p;
 }
 
 
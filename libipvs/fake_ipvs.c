@@ -0,0 +1,1105 @@
+/*
+ * fake_ipvs:	In-memory stand-in for the IPVS generic netlink family
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Requests are taken apart and replies put together by hand on the
+ * netlink structures, so that what is tested is libnl on the library
+ * side only.  Updates are applied when they are sent, as the kernel
+ * does in sendmsg(), while dumps are produced a datagram at a time as
+ * they are read, so that tables of millions of entries are never
+ * rendered in one go.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "fake_ipvs.h"
+
+#define FAKE_FAMILY		0x20	/* any id past the netlink control ones */
+#define FAKE_CONN_TAB_SIZE	4096
+#define FAKE_ENTRY_MAX		512	/* room a reply takes at most */
+
+#define FAKE_SVC_KEYLEN		26	/* fwmark, af, protocol, addr, port */
+#define FAKE_DEST_KEYLEN	24	/* service, af, addr, port */
+
+static const char *fake_schedulers[] = {
+	"rr", "wrr", "lc", "wlc", "lblc", "lblcr", "dh", "sh", "sed", "nq",
+	NULL
+};
+
+struct fake_service {
+	ipvs_service_entry_t	e;
+	ipvs_dest_entry_t	*dests;
+	unsigned int		num_dests;
+	unsigned int		size_dests;
+};
+
+/* a destination in the index, dest is its position + 1, 0 if free */
+struct fake_slot {
+	unsigned int		svc;
+	unsigned int		dest;
+};
+
+struct fake_ipvs {
+	struct fake_service	*svc;
+	unsigned int		num_svc;
+	unsigned int		size_svc;
+	unsigned int		num_dests;
+
+	/* open addressing, half full at most */
+	unsigned int		*svc_index;	/* position + 1, 0 if free */
+	size_t			svc_index_size;
+	struct fake_slot	*dest_index;
+	size_t			dest_index_size;
+
+	ipvs_timeout_t		timeout;
+	ipvs_daemon_t		daemon[2];	/* master, backup */
+};
+
+/* a request whose replies have not all been read */
+struct fake_req {
+	struct fake_req		*next;
+	struct nlmsghdr		nlh;
+	int			cmd;
+	int			error;
+	int			dump;
+	unsigned int		svc;		/* of GET_SERVICE and GET_DEST */
+	unsigned int		pos;		/* next entry of a dump */
+};
+
+struct fake_session {
+	struct ipvs_transport	t;		/* first, for fake_ipvs_close() */
+	fake_ipvs_t		*f;
+	struct fake_req		*head;
+	struct fake_req		*tail;
+};
+
+
+/*
+ * The indexes.  Entries are looked up on packed keys; deleting an entry
+ * moves the ones after it, so the indexes are rebuilt then: the stand-in
+ * is meant for large tables that are read, not for churning them.
+ */
+static unsigned int fake_hash(const unsigned char *k, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *k++) * 16777619u;
+	return h;
+}
+
+static void fake_put_addr(unsigned char *k, __u16 af,
+			  const union nf_inet_addr *addr)
+{
+	memset(k, 0, 16);
+	memcpy(k, addr, af == AF_INET6 ? 16 : 4);
+}
+
+static void fake_svc_key(const ipvs_service_entry_t *e, unsigned char *k)
+{
+	memset(k, 0, FAKE_SVC_KEYLEN);
+	memcpy(k, &e->fwmark, 4);
+	memcpy(k + 4, &e->af, 2);
+	if (e->fwmark)
+		return;
+	memcpy(k + 6, &e->protocol, 2);
+	fake_put_addr(k + 8, e->af, &e->addr);
+	memcpy(k + 24, &e->port, 2);
+}
+
+static void fake_dest_key(unsigned int svc, const ipvs_dest_entry_t *d,
+			  unsigned char *k)
+{
+	memcpy(k, &svc, 4);
+	memcpy(k + 4, &d->af, 2);
+	fake_put_addr(k + 6, d->af, &d->addr);
+	memcpy(k + 22, &d->port, 2);
+}
+
+/* the slot of e in the service index, or the free one it would take */
+static size_t fake_svc_slot(fake_ipvs_t *f, const ipvs_service_entry_t *e)
+{
+	unsigned char k[FAKE_SVC_KEYLEN], k2[FAKE_SVC_KEYLEN];
+	size_t mask = f->svc_index_size - 1, i;
+
+	fake_svc_key(e, k);
+	for (i = fake_hash(k, sizeof(k)) & mask; f->svc_index[i];
+	     i = (i + 1) & mask) {
+		fake_svc_key(&f->svc[f->svc_index[i] - 1].e, k2);
+		if (!memcmp(k, k2, sizeof(k)))
+			break;
+	}
+	return i;
+}
+
+static size_t fake_dest_slot(fake_ipvs_t *f, unsigned int svc,
+			     const ipvs_dest_entry_t *d)
+{
+	unsigned char k[FAKE_DEST_KEYLEN], k2[FAKE_DEST_KEYLEN];
+	size_t mask = f->dest_index_size - 1, i;
+	struct fake_slot *s;
+
+	fake_dest_key(svc, d, k);
+	for (i = fake_hash(k, sizeof(k)) & mask; f->dest_index[i].dest;
+	     i = (i + 1) & mask) {
+		s = &f->dest_index[i];
+		fake_dest_key(s->svc, &f->svc[s->svc].dests[s->dest - 1], k2);
+		if (!memcmp(k, k2, sizeof(k)))
+			break;
+	}
+	return i;
+}
+
+/* index every entry again, in tables big enough for want of each */
+static int fake_reindex(fake_ipvs_t *f, size_t want_svc, size_t want_dests)
+{
+	size_t svc_size = 64, dest_size = 64, i;
+	unsigned int j;
+
+	while (svc_size < 2 * want_svc)
+		svc_size *= 2;
+	while (dest_size < 2 * want_dests)
+		dest_size *= 2;
+
+	free(f->svc_index);
+	free(f->dest_index);
+	f->svc_index = calloc(svc_size, sizeof(*f->svc_index));
+	f->dest_index = calloc(dest_size, sizeof(*f->dest_index));
+	if (!f->svc_index || !f->dest_index) {
+		free(f->svc_index);
+		free(f->dest_index);
+		f->svc_index = NULL;
+		f->dest_index = NULL;
+		f->svc_index_size = f->dest_index_size = 0;
+		return -1;
+	}
+	f->svc_index_size = svc_size;
+	f->dest_index_size = dest_size;
+
+	for (i = 0; i < f->num_svc; i++) {
+		f->svc_index[fake_svc_slot(f, &f->svc[i].e)] = i + 1;
+		for (j = 0; j < f->svc[i].num_dests; j++) {
+			struct fake_slot *s;
+
+			s = &f->dest_index[fake_dest_slot(f, i,
+						&f->svc[i].dests[j])];
+			s->svc = i;
+			s->dest = j + 1;
+		}
+	}
+	return 0;
+}
+
+/* position of the service e, -1 if there is none */
+static int fake_find_service(fake_ipvs_t *f, const ipvs_service_entry_t *e)
+{
+	return (int)f->svc_index[fake_svc_slot(f, e)] - 1;
+}
+
+static int fake_find_dest(fake_ipvs_t *f, unsigned int svc,
+			  const ipvs_dest_entry_t *d)
+{
+	return (int)f->dest_index[fake_dest_slot(f, svc, d)].dest - 1;
+}
+
+static ipvs_service_entry_t *fake_add_service(fake_ipvs_t *f,
+					      const ipvs_service_entry_t *e)
+{
+	struct fake_service *s;
+
+	if (2 * (f->num_svc + 1) > f->svc_index_size &&
+	    fake_reindex(f, 2 * (f->num_svc + 1), f->num_dests))
+		return NULL;
+	if (f->num_svc == f->size_svc) {
+		unsigned int size = f->size_svc ? f->size_svc * 2 : 64;
+
+		if (!(s = realloc(f->svc, size * sizeof(*s))))
+			return NULL;
+		f->svc = s;
+		f->size_svc = size;
+	}
+
+	s = &f->svc[f->num_svc];
+	memset(s, 0, sizeof(*s));
+	s->e = *e;
+	f->svc_index[fake_svc_slot(f, e)] = ++f->num_svc;
+	return &s->e;
+}
+
+static ipvs_dest_entry_t *fake_add_dest(fake_ipvs_t *f, unsigned int svc,
+					const ipvs_dest_entry_t *d)
+{
+	struct fake_service *s = &f->svc[svc];
+	struct fake_slot *slot;
+	ipvs_dest_entry_t *n;
+
+	if (2 * (f->num_dests + 1) > f->dest_index_size &&
+	    fake_reindex(f, f->num_svc, 2 * (f->num_dests + 1)))
+		return NULL;
+	if (s->num_dests == s->size_dests) {
+		unsigned int size = s->size_dests ? s->size_dests * 2 : 8;
+
+		if (!(n = realloc(s->dests, size * sizeof(*n))))
+			return NULL;
+		s->dests = n;
+		s->size_dests = size;
+	}
+
+	n = &s->dests[s->num_dests];
+	*n = *d;
+	slot = &f->dest_index[fake_dest_slot(f, svc, d)];
+	slot->svc = svc;
+	slot->dest = ++s->num_dests;
+	f->num_dests++;
+	return n;
+}
+
+static int fake_del_service(fake_ipvs_t *f, unsigned int svc)
+{
+	f->num_dests -= f->svc[svc].num_dests;
+	free(f->svc[svc].dests);
+	memmove(&f->svc[svc], &f->svc[svc + 1],
+		(f->num_svc - svc - 1) * sizeof(*f->svc));
+	f->num_svc--;
+	return fake_reindex(f, f->num_svc, f->num_dests);
+}
+
+static int fake_del_dest(fake_ipvs_t *f, unsigned int svc, unsigned int dest)
+{
+	struct fake_service *s = &f->svc[svc];
+
+	memmove(&s->dests[dest], &s->dests[dest + 1],
+		(s->num_dests - dest - 1) * sizeof(*s->dests));
+	s->num_dests--;
+	f->num_dests--;
+	return fake_reindex(f, f->num_svc, f->num_dests);
+}
+
+static void fake_flush(fake_ipvs_t *f)
+{
+	unsigned int i;
+
+	for (i = 0; i < f->num_svc; i++)
+		free(f->svc[i].dests);
+	f->num_svc = f->num_dests = 0;
+	memset(f->svc_index, 0, f->svc_index_size * sizeof(*f->svc_index));
+	memset(f->dest_index, 0,
+	       f->dest_index_size * sizeof(*f->dest_index));
+}
+
+static void fake_zero(struct fake_service *s)
+{
+	unsigned int i;
+
+	memset(&s->e.stats, 0, sizeof(s->e.stats));
+	for (i = 0; i < s->num_dests; i++)
+		memset(&s->dests[i].stats, 0, sizeof(s->dests[i].stats));
+}
+
+
+/* Taking requests apart */
+#define FAKE_DATA(a)	((void *)((char *)(a) + NLA_HDRLEN))
+#define FAKE_LEN(a)	((int)(a)->nla_len - NLA_HDRLEN)
+
+/* the attributes in [data, data + len) by type */
+static void fake_parse(struct nlattr **tb, int max, void *data, int len)
+{
+	struct nlattr *a = data;
+	int type;
+
+	memset(tb, 0, sizeof(*tb) * (max + 1));
+	while (len >= NLA_HDRLEN && a->nla_len >= NLA_HDRLEN &&
+	       a->nla_len <= len) {
+		type = a->nla_type & NLA_TYPE_MASK;
+		if (type <= max)
+			tb[type] = a;
+		len -= NLA_ALIGN(a->nla_len);
+		a = (struct nlattr *)((char *)a + NLA_ALIGN(a->nla_len));
+	}
+}
+
+static int fake_parse_nested(struct nlattr **tb, int max, struct nlattr *a)
+{
+	if (!a)
+		return -EINVAL;
+	fake_parse(tb, max, FAKE_DATA(a), FAKE_LEN(a));
+	return 0;
+}
+
+static __u32 fake_u32(struct nlattr *a)
+{
+	__u32 v = 0;
+
+	memcpy(&v, FAKE_DATA(a), FAKE_LEN(a) < 4 ? FAKE_LEN(a) : 4);
+	return v;
+}
+
+static __u16 fake_u16(struct nlattr *a)
+{
+	__u16 v = 0;
+
+	memcpy(&v, FAKE_DATA(a), FAKE_LEN(a) < 2 ? FAKE_LEN(a) : 2);
+	return v;
+}
+
+/* a string attribute into buf of size len, -EINVAL if it does not fit */
+static int fake_string(char *buf, size_t len, struct nlattr *a)
+{
+	size_t n = strnlen(FAKE_DATA(a), FAKE_LEN(a));
+
+	if (n >= len)
+		return -EINVAL;
+	memcpy(buf, FAKE_DATA(a), n);
+	buf[n] = '\0';
+	return 0;
+}
+
+/*
+ * The service of a request; full when it is added or changed and
+ * everything must be there, otherwise only what identifies it
+ */
+static int fake_parse_service(struct nlattr *nest, ipvs_service_entry_t *e,
+			      int full)
+{
+	struct nlattr *tb[IPVS_SVC_ATTR_MAX + 1];
+	struct ip_vs_flags flags;
+
+	memset(e, 0, sizeof(*e));
+	if (fake_parse_nested(tb, IPVS_SVC_ATTR_MAX, nest))
+		return -EINVAL;
+
+	if (!(tb[IPVS_SVC_ATTR_AF] &&
+	      (tb[IPVS_SVC_ATTR_FWMARK] ||
+	       (tb[IPVS_SVC_ATTR_PROTOCOL] && tb[IPVS_SVC_ATTR_ADDR] &&
+		tb[IPVS_SVC_ATTR_PORT]))))
+		return -EINVAL;
+	e->af = fake_u16(tb[IPVS_SVC_ATTR_AF]);
+	if (e->af != AF_INET && e->af != AF_INET6)
+		return -EAFNOSUPPORT;
+	if (tb[IPVS_SVC_ATTR_FWMARK])
+		e->fwmark = fake_u32(tb[IPVS_SVC_ATTR_FWMARK]);
+	else {
+		e->protocol = fake_u16(tb[IPVS_SVC_ATTR_PROTOCOL]);
+		memcpy(&e->addr, FAKE_DATA(tb[IPVS_SVC_ATTR_ADDR]),
+		       e->af == AF_INET6 ? 16 : 4);
+		e->port = fake_u16(tb[IPVS_SVC_ATTR_PORT]);
+	}
+	if (!full)
+		return 0;
+
+	if (!(tb[IPVS_SVC_ATTR_SCHED_NAME] && tb[IPVS_SVC_ATTR_FLAGS] &&
+	      tb[IPVS_SVC_ATTR_TIMEOUT] && tb[IPVS_SVC_ATTR_NETMASK]) ||
+	    FAKE_LEN(tb[IPVS_SVC_ATTR_FLAGS]) != sizeof(flags))
+		return -EINVAL;
+	if (fake_string(e->sched_name, sizeof(e->sched_name),
+			tb[IPVS_SVC_ATTR_SCHED_NAME]) ||
+	    (tb[IPVS_SVC_ATTR_PE_NAME] &&
+	     fake_string(e->pe_name, sizeof(e->pe_name),
+			 tb[IPVS_SVC_ATTR_PE_NAME])))
+		return -EINVAL;
+	memcpy(&flags, FAKE_DATA(tb[IPVS_SVC_ATTR_FLAGS]), sizeof(flags));
+	e->flags = flags.flags & flags.mask;
+	e->timeout = fake_u32(tb[IPVS_SVC_ATTR_TIMEOUT]);
+	e->netmask = fake_u32(tb[IPVS_SVC_ATTR_NETMASK]);
+	return 0;
+}
+
+static int fake_parse_dest(struct nlattr *nest, __u16 af,
+			   ipvs_dest_entry_t *d, int full)
+{
+	struct nlattr *tb[IPVS_DEST_ATTR_MAX + 1];
+
+	memset(d, 0, sizeof(*d));
+	if (fake_parse_nested(tb, IPVS_DEST_ATTR_MAX, nest))
+		return -EINVAL;
+
+	if (!(tb[IPVS_DEST_ATTR_ADDR] && tb[IPVS_DEST_ATTR_PORT]))
+		return -EINVAL;
+	d->af = af;
+	memcpy(&d->addr, FAKE_DATA(tb[IPVS_DEST_ATTR_ADDR]),
+	       af == AF_INET6 ? 16 : 4);
+	d->port = fake_u16(tb[IPVS_DEST_ATTR_PORT]);
+	if (!full)
+		return 0;
+
+	if (!(tb[IPVS_DEST_ATTR_FWD_METHOD] && tb[IPVS_DEST_ATTR_WEIGHT] &&
+	      tb[IPVS_DEST_ATTR_U_THRESH] && tb[IPVS_DEST_ATTR_L_THRESH]))
+		return -EINVAL;
+	d->conn_flags = fake_u32(tb[IPVS_DEST_ATTR_FWD_METHOD]) &
+		IP_VS_CONN_F_FWD_MASK;
+	d->weight = fake_u32(tb[IPVS_DEST_ATTR_WEIGHT]);
+	d->u_threshold = fake_u32(tb[IPVS_DEST_ATTR_U_THRESH]);
+	d->l_threshold = fake_u32(tb[IPVS_DEST_ATTR_L_THRESH]);
+	if (d->weight < 0 ||
+	    (d->u_threshold && d->l_threshold > d->u_threshold))
+		return -ERANGE;
+	return 0;
+}
+
+/* the scheduler and persistence engine must be ones the kernel has */
+static int fake_check_modules(const ipvs_service_entry_t *e)
+{
+	int i;
+
+	for (i = 0; fake_schedulers[i]; i++)
+		if (!strcmp(e->sched_name, fake_schedulers[i]))
+			break;
+	if (!fake_schedulers[i])
+		return -ENOENT;
+	if (e->pe_name[0] && strcmp(e->pe_name, "sip"))
+		return -ENOENT;
+	return 0;
+}
+
+static int fake_service_cmd(fake_ipvs_t *f, int cmd, struct nlattr **tb)
+{
+	ipvs_service_entry_t e, *old;
+	int svc, err;
+
+	if ((err = fake_parse_service(tb[IPVS_CMD_ATTR_SERVICE], &e,
+				      cmd != IPVS_CMD_DEL_SERVICE)))
+		return err;
+	svc = fake_find_service(f, &e);
+
+	switch (cmd) {
+	case IPVS_CMD_NEW_SERVICE:
+		if (svc >= 0)
+			return -EEXIST;
+		if ((err = fake_check_modules(&e)))
+			return err;
+		return fake_add_service(f, &e) ? 0 : -ENOMEM;
+	case IPVS_CMD_SET_SERVICE:
+		if (svc < 0)
+			return -ESRCH;
+		if ((err = fake_check_modules(&e)))
+			return err;
+		old = &f->svc[svc].e;
+		memcpy(old->sched_name, e.sched_name, sizeof(e.sched_name));
+		memcpy(old->pe_name, e.pe_name, sizeof(e.pe_name));
+		old->flags = e.flags;
+		old->timeout = e.timeout;
+		old->netmask = e.netmask;
+		return 0;
+	default:
+		if (svc < 0)
+			return -ESRCH;
+		return fake_del_service(f, svc) ? -ENOMEM : 0;
+	}
+}
+
+static int fake_dest_cmd(fake_ipvs_t *f, int cmd, struct nlattr **tb)
+{
+	ipvs_service_entry_t e;
+	ipvs_dest_entry_t d, *old;
+	int svc, dest, err;
+
+	if ((err = fake_parse_service(tb[IPVS_CMD_ATTR_SERVICE], &e, 0)))
+		return err;
+	if ((svc = fake_find_service(f, &e)) < 0)
+		return -ESRCH;
+	if ((err = fake_parse_dest(tb[IPVS_CMD_ATTR_DEST], e.af, &d,
+				   cmd != IPVS_CMD_DEL_DEST)))
+		return err;
+	dest = fake_find_dest(f, svc, &d);
+
+	switch (cmd) {
+	case IPVS_CMD_NEW_DEST:
+		if (dest >= 0)
+			return -EEXIST;
+		return fake_add_dest(f, svc, &d) ? 0 : -ENOMEM;
+	case IPVS_CMD_SET_DEST:
+		if (dest < 0)
+			return -ENOENT;
+		old = &f->svc[svc].dests[dest];
+		old->conn_flags = d.conn_flags;
+		old->weight = d.weight;
+		old->u_threshold = d.u_threshold;
+		old->l_threshold = d.l_threshold;
+		return 0;
+	default:
+		if (dest < 0)
+			return -ENOENT;
+		return fake_del_dest(f, svc, dest) ? -ENOMEM : 0;
+	}
+}
+
+static int fake_daemon_cmd(fake_ipvs_t *f, int cmd, struct nlattr **tb)
+{
+	struct nlattr *da[IPVS_DAEMON_ATTR_MAX + 1];
+	ipvs_daemon_t *dm;
+	int state;
+
+	if (fake_parse_nested(da, IPVS_DAEMON_ATTR_MAX,
+			      tb[IPVS_CMD_ATTR_DAEMON]) ||
+	    !(da[IPVS_DAEMON_ATTR_STATE] && da[IPVS_DAEMON_ATTR_MCAST_IFN] &&
+	      da[IPVS_DAEMON_ATTR_SYNC_ID]))
+		return -EINVAL;
+	state = fake_u32(da[IPVS_DAEMON_ATTR_STATE]);
+	if (state != IP_VS_STATE_MASTER && state != IP_VS_STATE_BACKUP)
+		return -EINVAL;
+	dm = &f->daemon[state == IP_VS_STATE_BACKUP];
+
+	if (cmd == IPVS_CMD_DEL_DAEMON) {
+		if (!dm->state)
+			return -ESRCH;
+		memset(dm, 0, sizeof(*dm));
+		return 0;
+	}
+	if (dm->state)
+		return -EEXIST;
+	if (fake_string(dm->mcast_ifn, sizeof(dm->mcast_ifn),
+			da[IPVS_DAEMON_ATTR_MCAST_IFN]))
+		return -EINVAL;
+	dm->syncid = fake_u32(da[IPVS_DAEMON_ATTR_SYNC_ID]);
+	dm->state = state;
+	return 0;
+}
+
+/* carry out a request, whatever it returns is left for its replies */
+static int fake_cmd(fake_ipvs_t *f, struct fake_req *r, struct nlattr **tb)
+{
+	ipvs_service_entry_t e;
+	int svc, err;
+
+	switch (r->cmd) {
+	case IPVS_CMD_NEW_SERVICE:
+	case IPVS_CMD_SET_SERVICE:
+	case IPVS_CMD_DEL_SERVICE:
+		return fake_service_cmd(f, r->cmd, tb);
+
+	case IPVS_CMD_NEW_DEST:
+	case IPVS_CMD_SET_DEST:
+	case IPVS_CMD_DEL_DEST:
+		return fake_dest_cmd(f, r->cmd, tb);
+
+	case IPVS_CMD_GET_SERVICE:
+		if (r->dump)
+			return 0;
+		/* fall through */
+	case IPVS_CMD_GET_DEST:
+		if (r->cmd == IPVS_CMD_GET_DEST && !r->dump)
+			return -EOPNOTSUPP;
+		if ((err = fake_parse_service(tb[IPVS_CMD_ATTR_SERVICE], &e, 0)))
+			return err;
+		if ((svc = fake_find_service(f, &e)) < 0)
+			return -ESRCH;
+		r->svc = svc;
+		return 0;
+
+	case IPVS_CMD_NEW_DAEMON:
+	case IPVS_CMD_DEL_DAEMON:
+		return fake_daemon_cmd(f, r->cmd, tb);
+
+	case IPVS_CMD_GET_DAEMON:
+		return r->dump ? 0 : -EOPNOTSUPP;
+
+	case IPVS_CMD_SET_TIMEOUT:
+		/* 0 leaves a timeout as it is */
+		if (tb[IPVS_CMD_ATTR_TIMEOUT_TCP] &&
+		    fake_u32(tb[IPVS_CMD_ATTR_TIMEOUT_TCP]))
+			f->timeout.tcp_timeout =
+				fake_u32(tb[IPVS_CMD_ATTR_TIMEOUT_TCP]);
+		if (tb[IPVS_CMD_ATTR_TIMEOUT_TCP_FIN] &&
+		    fake_u32(tb[IPVS_CMD_ATTR_TIMEOUT_TCP_FIN]))
+			f->timeout.tcp_fin_timeout =
+				fake_u32(tb[IPVS_CMD_ATTR_TIMEOUT_TCP_FIN]);
+		if (tb[IPVS_CMD_ATTR_TIMEOUT_UDP] &&
+		    fake_u32(tb[IPVS_CMD_ATTR_TIMEOUT_UDP]))
+			f->timeout.udp_timeout =
+				fake_u32(tb[IPVS_CMD_ATTR_TIMEOUT_UDP]);
+		return 0;
+
+	case IPVS_CMD_GET_TIMEOUT:
+	case IPVS_CMD_GET_INFO:
+		return 0;
+
+	case IPVS_CMD_ZERO:
+		if (!tb[IPVS_CMD_ATTR_SERVICE]) {
+			for (svc = 0; svc < (int)f->num_svc; svc++)
+				fake_zero(&f->svc[svc]);
+			return 0;
+		}
+		if ((err = fake_parse_service(tb[IPVS_CMD_ATTR_SERVICE], &e, 0)))
+			return err;
+		if ((svc = fake_find_service(f, &e)) < 0)
+			return -ESRCH;
+		fake_zero(&f->svc[svc]);
+		return 0;
+
+	case IPVS_CMD_FLUSH:
+		fake_flush(f);
+		return 0;
+	}
+	return -EOPNOTSUPP;
+}
+
+/* take one request and queue what it is to be answered with */
+static int fake_request(struct fake_session *s, struct nlmsghdr *nlh)
+{
+	struct nlattr *tb[IPVS_CMD_ATTR_MAX + 1];
+	struct genlmsghdr *g = NLMSG_DATA(nlh);
+	struct fake_req *r;
+
+	if (!(r = calloc(1, sizeof(*r)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	r->nlh = *nlh;
+	r->dump = (nlh->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP;
+
+	if (nlh->nlmsg_type != FAKE_FAMILY)
+		r->error = -EOPNOTSUPP;
+	else if (nlh->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN))
+		r->error = -EINVAL;
+	else {
+		r->cmd = g->cmd;
+		fake_parse(tb, IPVS_CMD_ATTR_MAX, (char *)g + GENL_HDRLEN,
+			   nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+		r->error = fake_cmd(s->f, r, tb);
+	}
+
+	if (s->tail)
+		s->tail->next = r;
+	else
+		s->head = r;
+	s->tail = r;
+	return 0;
+}
+
+
+/* Putting replies together, in a datagram of size bytes */
+struct fake_out {
+	char			*buf;
+	size_t			len;
+	size_t			size;
+};
+
+static struct nlmsghdr *fake_msg(struct fake_out *o, struct fake_req *r,
+				 int type, int flags, int cmd)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)(o->buf + o->len);
+	struct genlmsghdr *g = NLMSG_DATA(nlh);
+
+	nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = flags;
+	nlh->nlmsg_seq = r->nlh.nlmsg_seq;
+	nlh->nlmsg_pid = r->nlh.nlmsg_pid;
+	memset(g, 0, GENL_HDRLEN);
+	g->cmd = cmd;
+	g->version = IPVS_GENL_VERSION;
+	return nlh;
+}
+
+static void fake_msg_end(struct fake_out *o, struct nlmsghdr *nlh)
+{
+	o->len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static struct nlattr *fake_nest(struct nlmsghdr *nlh, int type)
+{
+	struct nlattr *a = (struct nlattr *)((char *)nlh + nlh->nlmsg_len);
+
+	a->nla_type = type;
+	nlh->nlmsg_len += NLA_HDRLEN;
+	return a;
+}
+
+static void fake_nest_end(struct nlmsghdr *nlh, struct nlattr *a)
+{
+	a->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)a;
+}
+
+static void fake_put(struct nlmsghdr *nlh, int type, const void *data,
+		     int len)
+{
+	struct nlattr *a = (struct nlattr *)((char *)nlh + nlh->nlmsg_len);
+
+	a->nla_len = NLA_HDRLEN + len;
+	a->nla_type = type;
+	memcpy(FAKE_DATA(a), data, len);
+	memset((char *)FAKE_DATA(a) + len, 0, NLA_ALIGN(len) - len);
+	nlh->nlmsg_len += NLA_ALIGN(a->nla_len);
+}
+
+static void fake_put_u16(struct nlmsghdr *nlh, int type, __u16 v)
+{
+	fake_put(nlh, type, &v, sizeof(v));
+}
+
+static void fake_put_u32(struct nlmsghdr *nlh, int type, __u32 v)
+{
+	fake_put(nlh, type, &v, sizeof(v));
+}
+
+static void fake_put_u64(struct nlmsghdr *nlh, int type, __u64 v)
+{
+	fake_put(nlh, type, &v, sizeof(v));
+}
+
+static void fake_put_string(struct nlmsghdr *nlh, int type, const char *s)
+{
+	fake_put(nlh, type, s, strlen(s) + 1);
+}
+
+static void fake_put_stats(struct nlmsghdr *nlh, int type,
+			   const struct ip_vs_stats_user *st)
+{
+	struct nlattr *nest = fake_nest(nlh, type);
+
+	fake_put_u32(nlh, IPVS_STATS_ATTR_CONNS, st->conns);
+	fake_put_u32(nlh, IPVS_STATS_ATTR_INPKTS, st->inpkts);
+	fake_put_u32(nlh, IPVS_STATS_ATTR_OUTPKTS, st->outpkts);
+	fake_put_u64(nlh, IPVS_STATS_ATTR_INBYTES, st->inbytes);
+	fake_put_u64(nlh, IPVS_STATS_ATTR_OUTBYTES, st->outbytes);
+	fake_put_u32(nlh, IPVS_STATS_ATTR_CPS, st->cps);
+	fake_put_u32(nlh, IPVS_STATS_ATTR_INPPS, st->inpps);
+	fake_put_u32(nlh, IPVS_STATS_ATTR_OUTPPS, st->outpps);
+	fake_put_u32(nlh, IPVS_STATS_ATTR_INBPS, st->inbps);
+	fake_put_u32(nlh, IPVS_STATS_ATTR_OUTBPS, st->outbps);
+	fake_nest_end(nlh, nest);
+}
+
+static void fake_put_service(struct fake_out *o, struct fake_req *r,
+			     int flags, const ipvs_service_entry_t *e)
+{
+	struct nlmsghdr *nlh;
+	struct nlattr *nest;
+	struct ip_vs_flags fl;
+
+	nlh = fake_msg(o, r, FAKE_FAMILY, flags, IPVS_CMD_NEW_SERVICE);
+	nest = fake_nest(nlh, IPVS_CMD_ATTR_SERVICE);
+	fake_put_u16(nlh, IPVS_SVC_ATTR_AF, e->af);
+	if (e->fwmark)
+		fake_put_u32(nlh, IPVS_SVC_ATTR_FWMARK, e->fwmark);
+	else {
+		fake_put_u16(nlh, IPVS_SVC_ATTR_PROTOCOL, e->protocol);
+		fake_put(nlh, IPVS_SVC_ATTR_ADDR, &e->addr, sizeof(e->addr));
+		fake_put_u16(nlh, IPVS_SVC_ATTR_PORT, e->port);
+	}
+	fake_put_string(nlh, IPVS_SVC_ATTR_SCHED_NAME, e->sched_name);
+	if (e->pe_name[0])
+		fake_put_string(nlh, IPVS_SVC_ATTR_PE_NAME, e->pe_name);
+	/* the kernel reports its own flags too */
+	fl.flags = e->flags | IP_VS_SVC_F_HASHED;
+	fl.mask = ~0;
+	fake_put(nlh, IPVS_SVC_ATTR_FLAGS, &fl, sizeof(fl));
+	fake_put_u32(nlh, IPVS_SVC_ATTR_TIMEOUT, e->timeout);
+	fake_put_u32(nlh, IPVS_SVC_ATTR_NETMASK, e->netmask);
+	fake_put_stats(nlh, IPVS_SVC_ATTR_STATS, &e->stats);
+	fake_nest_end(nlh, nest);
+	fake_msg_end(o, nlh);
+}
+
+static void fake_put_dest(struct fake_out *o, struct fake_req *r,
+			  const ipvs_dest_entry_t *d)
+{
+	struct nlmsghdr *nlh;
+	struct nlattr *nest;
+
+	nlh = fake_msg(o, r, FAKE_FAMILY, NLM_F_MULTI, IPVS_CMD_NEW_DEST);
+	nest = fake_nest(nlh, IPVS_CMD_ATTR_DEST);
+	fake_put(nlh, IPVS_DEST_ATTR_ADDR, &d->addr, sizeof(d->addr));
+	fake_put_u16(nlh, IPVS_DEST_ATTR_PORT, d->port);
+	fake_put_u32(nlh, IPVS_DEST_ATTR_FWD_METHOD,
+		     d->conn_flags & IP_VS_CONN_F_FWD_MASK);
+	fake_put_u32(nlh, IPVS_DEST_ATTR_WEIGHT, d->weight);
+	fake_put_u32(nlh, IPVS_DEST_ATTR_U_THRESH, d->u_threshold);
+	fake_put_u32(nlh, IPVS_DEST_ATTR_L_THRESH, d->l_threshold);
+	fake_put_u32(nlh, IPVS_DEST_ATTR_ACTIVE_CONNS, d->activeconns);
+	fake_put_u32(nlh, IPVS_DEST_ATTR_INACT_CONNS, d->inactconns);
+	fake_put_u32(nlh, IPVS_DEST_ATTR_PERSIST_CONNS, d->persistconns);
+	fake_put_stats(nlh, IPVS_DEST_ATTR_STATS, &d->stats);
+	fake_nest_end(nlh, nest);
+	fake_msg_end(o, nlh);
+}
+
+static void fake_put_daemon(struct fake_out *o, struct fake_req *r,
+			    const ipvs_daemon_t *dm)
+{
+	struct nlmsghdr *nlh;
+	struct nlattr *nest;
+
+	nlh = fake_msg(o, r, FAKE_FAMILY, NLM_F_MULTI, IPVS_CMD_NEW_DAEMON);
+	nest = fake_nest(nlh, IPVS_CMD_ATTR_DAEMON);
+	fake_put_u32(nlh, IPVS_DAEMON_ATTR_STATE, dm->state);
+	fake_put_string(nlh, IPVS_DAEMON_ATTR_MCAST_IFN, dm->mcast_ifn);
+	fake_put_u32(nlh, IPVS_DAEMON_ATTR_SYNC_ID, dm->syncid);
+	fake_nest_end(nlh, nest);
+	fake_msg_end(o, nlh);
+}
+
+/* the NLMSG_ERROR that acknowledges a request, or the NLMSG_DONE */
+static void fake_put_end(struct fake_out *o, struct fake_req *r, int type,
+			 int error)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)(o->buf + o->len);
+	struct nlmsgerr *e = NLMSG_DATA(nlh);
+
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = type == NLMSG_DONE ? NLM_F_MULTI : 0;
+	nlh->nlmsg_seq = r->nlh.nlmsg_seq;
+	nlh->nlmsg_pid = r->nlh.nlmsg_pid;
+	if (type == NLMSG_DONE) {
+		nlh->nlmsg_len = NLMSG_LENGTH(sizeof(int));
+		*(int *)e = 0;
+	} else {
+		nlh->nlmsg_len = NLMSG_LENGTH(sizeof(*e));
+		e->error = error;
+		e->msg = r->nlh;
+	}
+	o->len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/* whether the next entry of a dump still fits */
+static int fake_room(struct fake_out *o)
+{
+	return o->size - o->len >= FAKE_ENTRY_MAX;
+}
+
+/*
+ * Put what is left of the replies to r into the datagram; returns 1
+ * once they are all in, 0 if the datagram filled up first
+ */
+static int fake_reply(fake_ipvs_t *f, struct fake_req *r, struct fake_out *o)
+{
+	struct nlmsghdr *nlh;
+	struct fake_service *s;
+
+	if (!fake_room(o))
+		return 0;
+	if (r->error) {
+		fake_put_end(o, r, NLMSG_ERROR, r->error);
+		return 1;
+	}
+
+	if (!r->dump) {
+		switch (r->cmd) {
+		case IPVS_CMD_GET_SERVICE:
+			if (r->svc >= f->num_svc) {
+				fake_put_end(o, r, NLMSG_ERROR, -ESRCH);
+				return 1;
+			}
+			fake_put_service(o, r, 0, &f->svc[r->svc].e);
+			break;
+		case IPVS_CMD_GET_INFO:
+			nlh = fake_msg(o, r, FAKE_FAMILY, 0, IPVS_CMD_SET_INFO);
+			fake_put_u32(nlh, IPVS_INFO_ATTR_VERSION,
+				     IP_VS_VERSION_CODE);
+			fake_put_u32(nlh, IPVS_INFO_ATTR_CONN_TAB_SIZE,
+				     FAKE_CONN_TAB_SIZE);
+			fake_msg_end(o, nlh);
+			break;
+		case IPVS_CMD_GET_TIMEOUT:
+			nlh = fake_msg(o, r, FAKE_FAMILY, 0,
+				       IPVS_CMD_SET_TIMEOUT);
+			fake_put_u32(nlh, IPVS_CMD_ATTR_TIMEOUT_TCP,
+				     f->timeout.tcp_timeout);
+			fake_put_u32(nlh, IPVS_CMD_ATTR_TIMEOUT_TCP_FIN,
+				     f->timeout.tcp_fin_timeout);
+			fake_put_u32(nlh, IPVS_CMD_ATTR_TIMEOUT_UDP,
+				     f->timeout.udp_timeout);
+			fake_msg_end(o, nlh);
+			break;
+		}
+		if (r->nlh.nlmsg_flags & NLM_F_ACK)
+			fake_put_end(o, r, NLMSG_ERROR, 0);
+		return 1;
+	}
+
+	switch (r->cmd) {
+	case IPVS_CMD_GET_SERVICE:
+		for (; r->pos < f->num_svc && fake_room(o); r->pos++)
+			fake_put_service(o, r, NLM_F_MULTI,
+					 &f->svc[r->pos].e);
+		if (r->pos < f->num_svc)
+			return 0;
+		break;
+	case IPVS_CMD_GET_DEST:
+		/* the service may have gone since the request */
+		if (r->svc >= f->num_svc)
+			break;
+		s = &f->svc[r->svc];
+		for (; r->pos < s->num_dests && fake_room(o); r->pos++)
+			fake_put_dest(o, r, &s->dests[r->pos]);
+		if (r->pos < s->num_dests)
+			return 0;
+		break;
+	case IPVS_CMD_GET_DAEMON:
+		for (; r->pos < 2; r->pos++)
+			if (f->daemon[r->pos].state)
+				fake_put_daemon(o, r, &f->daemon[r->pos]);
+		break;
+	}
+	if (!fake_room(o))
+		return 0;
+	fake_put_end(o, r, NLMSG_DONE, 0);
+	return 1;
+}
+
+
+/* The transport */
+static int fake_send(void *priv, const void *buf, size_t len)
+{
+	struct fake_session *s = (struct fake_session *)priv;
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+
+	while (len >= NLMSG_HDRLEN && nlh->nlmsg_len >= NLMSG_HDRLEN &&
+	       nlh->nlmsg_len <= len) {
+		if (fake_request(s, nlh))
+			return -1;
+		if (NLMSG_ALIGN(nlh->nlmsg_len) >= len)
+			break;
+		len -= NLMSG_ALIGN(nlh->nlmsg_len);
+		nlh = (struct nlmsghdr *)((char *)nlh +
+					  NLMSG_ALIGN(nlh->nlmsg_len));
+	}
+	return 0;
+}
+
+static int fake_recv(void *priv, void *buf, size_t len)
+{
+	struct fake_session *s = (struct fake_session *)priv;
+	struct fake_out o;
+	struct fake_req *r;
+
+	/* the kernel would block forever */
+	if (!s->head) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	o.buf = buf;
+	o.len = 0;
+	o.size = len;
+	while ((r = s->head) && fake_reply(s->f, r, &o)) {
+		if (!(s->head = r->next))
+			s->tail = NULL;
+		free(r);
+	}
+	return o.len;
+}
+
+struct ipvs_transport *fake_ipvs_open(fake_ipvs_t *f)
+{
+	struct fake_session *s;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return NULL;
+	s->t.family = FAKE_FAMILY;
+	s->t.send = fake_send;
+	s->t.recv = fake_recv;
+	s->t.priv = s;
+	s->f = f;
+	return &s->t;
+}
+
+void fake_ipvs_close(struct ipvs_transport *t)
+{
+	struct fake_session *s = (struct fake_session *)t;
+	struct fake_req *r;
+
+	if (!s)
+		return;
+	while ((r = s->head)) {
+		s->head = r->next;
+		free(r);
+	}
+	free(s);
+}
+
+
+fake_ipvs_t *fake_ipvs_create(void)
+{
+	fake_ipvs_t *f;
+
+	if (!(f = calloc(1, sizeof(*f))))
+		return NULL;
+	/* the defaults of the kernel */
+	f->timeout.tcp_timeout = 900;
+	f->timeout.tcp_fin_timeout = 120;
+	f->timeout.udp_timeout = 300;
+	if (fake_reindex(f, 0, 0)) {
+		free(f);
+		return NULL;
+	}
+	return f;
+}
+
+void fake_ipvs_destroy(fake_ipvs_t *f)
+{
+	if (!f)
+		return;
+	fake_flush(f);
+	free(f->svc);
+	free(f->svc_index);
+	free(f->dest_index);
+	free(f);
+}
+
+int fake_ipvs_load(fake_ipvs_t *f, unsigned int services,
+		   unsigned int dests)
+{
+	ipvs_service_entry_t e;
+	ipvs_dest_entry_t d;
+	unsigned int i, j, n;
+
+	/* indexed once up front rather than grown step by step */
+	if (fake_reindex(f, f->num_svc + services,
+			 f->num_dests + (size_t)services * dests))
+		return -1;
+
+	for (i = 0; i < services; i++) {
+		n = f->num_svc;
+		memset(&e, 0, sizeof(e));
+		e.af = AF_INET;
+		e.protocol = IPPROTO_TCP;
+		e.addr.ip = htonl(0x0a000001 + n);
+		e.port = htons(80);
+		strcpy(e.sched_name, "wlc");
+		e.netmask = ~0;
+		e.stats.conns = n;
+		e.stats.inbytes = (__u64)n << 20;
+		if (fake_find_service(f, &e) >= 0) {
+			errno = EEXIST;
+			return -1;
+		}
+		if (!fake_add_service(f, &e))
+			return -1;
+
+		for (j = 0; j < dests; j++) {
+			memset(&d, 0, sizeof(d));
+			d.af = AF_INET;
+			d.addr.ip = htonl(0xac100001 + j);
+			d.port = htons(8080);
+			d.conn_flags = IP_VS_CONN_F_MASQ;
+			d.weight = 1 + j % 100;
+			d.activeconns = j % 1000;
+			d.inactconns = j % 7;
+			d.stats.conns = j;
+			d.stats.outbytes = (__u64)j << 10;
+			if (!fake_add_dest(f, n, &d))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+unsigned int fake_ipvs_num_services(fake_ipvs_t *f)
+{
+	return f->num_svc;
+}
+
+unsigned int fake_ipvs_num_dests(fake_ipvs_t *f)
+{
+	return f->num_dests;
+}
@@ -0,0 +1,48 @@
+/*
+ * fake_ipvs:	In-memory stand-in for the IPVS generic netlink family
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _FAKE_IPVS_H
+#define _FAKE_IPVS_H
+
+#include "libipvs.h"
+
+/*
+ * A table of services and destinations kept in memory and answering
+ * the IPVS_CMD_* requests of libipvs the way the kernel does, through
+ * ipvs_ctx_create_transport().  Each session is one transport with
+ * replies of its own; all sessions of a stand-in share its table.
+ */
+typedef struct fake_ipvs	fake_ipvs_t;
+
+/* an empty table, NULL on failure */
+extern fake_ipvs_t *fake_ipvs_create(void);
+
+/* free the table, its sessions must be closed first */
+extern void fake_ipvs_destroy(fake_ipvs_t *f);
+
+/* open a session on the table, to be passed to ipvs_ctx_create_transport() */
+extern struct ipvs_transport *fake_ipvs_open(fake_ipvs_t *f);
+
+/* close a session, replies not read yet are dropped */
+extern void fake_ipvs_close(struct ipvs_transport *t);
+
+/*
+ * put the given number of TCP services, each with the given number of
+ * destinations, straight into the table rather than a request at a
+ * time; the counters are filled in so that they are not all zero.
+ * Returns -1 with errno set on failure.
+ */
+extern int fake_ipvs_load(fake_ipvs_t *f, unsigned int services,
+			  unsigned int dests);
+
+/* what the table holds */
+extern unsigned int fake_ipvs_num_services(fake_ipvs_t *f);
+extern unsigned int fake_ipvs_num_dests(fake_ipvs_t *f);
+
+#endif /* _FAKE_IPVS_H */
@@ -0,0 +1,229 @@
+/*
+ * fake_ipvs_bench:	Time how long libipvs takes to parse dumps
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Each dump is taken once from fake_ipvs and its datagrams are kept;
+ * the timed runs then get those datagrams back as they are, so that
+ * what is measured is libipvs reading and parsing the replies and
+ * building its results, not the stand-in putting them together.
+ *
+ * Usage: fake_ipvs_bench [entries [runs]], 100000 entries by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/netlink.h>
+
+#include "fake_ipvs.h"
+
+/* a transport recording the replies of another one, or replaying them */
+struct replay {
+	struct ipvs_transport	t;
+	struct ipvs_transport	*inner;
+	int			recording;
+	int			replaying;
+	__u32			seq;		/* of the last request */
+	void			**msgs;
+	int			*lens;
+	unsigned int		num_msgs;
+	unsigned int		size_msgs;
+	unsigned int		pos;
+};
+
+static int replay_send(void *priv, const void *buf, size_t len)
+{
+	struct replay *r = priv;
+
+	r->seq = ((const struct nlmsghdr *)buf)->nlmsg_seq;
+	if (r->replaying)
+		return 0;
+	return r->inner->send(r->inner->priv, buf, len);
+}
+
+static int replay_recv(void *priv, void *buf, size_t len)
+{
+	struct replay *r = priv;
+	struct nlmsghdr *nlh;
+	int n, left;
+
+	if (r->replaying) {
+		if (r->pos == r->num_msgs) {
+			errno = EAGAIN;
+			return -1;
+		}
+		n = left = r->lens[r->pos];
+		memcpy(buf, r->msgs[r->pos++], n);
+		/* answer the request being made, not the recorded one */
+		for (nlh = buf; NLMSG_OK(nlh, left);
+		     nlh = NLMSG_NEXT(nlh, left))
+			nlh->nlmsg_seq = r->seq;
+		return n;
+	}
+
+	n = r->inner->recv(r->inner->priv, buf, len);
+	if (n <= 0 || !r->recording)
+		return n;
+	if (r->num_msgs == r->size_msgs) {
+		unsigned int size = r->size_msgs ? r->size_msgs * 2 : 64;
+
+		if (!(r->msgs = realloc(r->msgs, size * sizeof(*r->msgs))) ||
+		    !(r->lens = realloc(r->lens, size * sizeof(*r->lens))))
+			return -1;
+		r->size_msgs = size;
+	}
+	if (!(r->msgs[r->num_msgs] = malloc(n)))
+		return -1;
+	memcpy(r->msgs[r->num_msgs], buf, n);
+	r->lens[r->num_msgs++] = n;
+	return n;
+}
+
+static void replay_reset(struct replay *r)
+{
+	while (r->num_msgs)
+		free(r->msgs[--r->num_msgs]);
+	r->recording = r->replaying = 0;
+	r->pos = 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the dump to time, returns the number of entries it got or -1 */
+typedef long (*bench_fn_t)(ipvs_ctx_t *ctx);
+
+static long bench_get_services(ipvs_ctx_t *ctx)
+{
+	struct ip_vs_get_services *s;
+	long n;
+
+	if (!(s = ipvs_ctx_get_services(ctx)))
+		return -1;
+	n = s->num_services;
+	free(s);
+	return n;
+}
+
+static long bench_get_dests(ipvs_ctx_t *ctx)
+{
+	/* looked up before recording, the replay only has the dests */
+	static ipvs_service_entry_t svc;
+	struct ip_vs_get_services *s;
+	struct ip_vs_get_dests *d;
+	long n;
+
+	if (!svc.af) {
+		if (!(s = ipvs_ctx_get_services(ctx)))
+			return -1;
+		svc = s->entrytable[0];
+		free(s);
+	}
+	if (!(d = ipvs_ctx_get_dests(ctx, &svc)))
+		return -1;
+	n = d->num_dests;
+	free(d);
+	return n;
+}
+
+static long bench_snapshot(ipvs_ctx_t *ctx)
+{
+	ipvs_snapshot_t *s;
+	long n;
+
+	if (!(s = ipvs_ctx_get_snapshot(ctx)))
+		return -1;
+	n = s->num_services + s->num_dests;
+	ipvs_free_snapshot(s);
+	return n;
+}
+
+static int bench(const char *name, unsigned int services, unsigned int dests,
+		 bench_fn_t fn, int runs)
+{
+	fake_ipvs_t *f;
+	struct replay r;
+	ipvs_ctx_t *ctx;
+	double t0, t1, t2;
+	long n = 0;
+	int i;
+
+	memset(&r, 0, sizeof(r));
+	if (!(f = fake_ipvs_create()) || fake_ipvs_load(f, services, dests) ||
+	    !(r.inner = fake_ipvs_open(f))) {
+		perror("fake_ipvs");
+		return -1;
+	}
+	r.t.family = r.inner->family;
+	r.t.send = replay_send;
+	r.t.recv = replay_recv;
+	r.t.priv = &r;
+	if (!(ctx = ipvs_ctx_create_transport(&r.t))) {
+		perror("ipvs_ctx_create_transport");
+		return -1;
+	}
+
+	/* once against the stand-in, to keep what it replies */
+	fn(ctx);
+	r.recording = 1;
+	t0 = now();
+	n = fn(ctx);
+	t1 = now();
+	if (n < 0) {
+		perror(name);
+		return -1;
+	}
+
+	r.replaying = 1;
+	for (i = 0; i < runs; i++) {
+		r.pos = 0;
+		if (fn(ctx) != n) {
+			fprintf(stderr, "%s: replay got a different dump\n",
+				name);
+			return -1;
+		}
+	}
+	t2 = now();
+
+	printf("%-14s %8u services %8u dests  %7.1f ns/entry parse  "
+	       "%7.1f ns/entry with stand-in\n", name, services,
+	       services * dests, (t2 - t1) * 1e9 / runs / n,
+	       (t1 - t0) * 1e9 / n);
+
+	replay_reset(&r);
+	free(r.msgs);
+	free(r.lens);
+	ipvs_ctx_destroy(ctx);
+	fake_ipvs_close(r.inner);
+	fake_ipvs_destroy(f);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int entries = argc > 1 ? atoi(argv[1]) : 100000;
+	int runs = argc > 2 ? atoi(argv[2]) : 10;
+
+	if (!entries || runs <= 0) {
+		fprintf(stderr, "Usage: %s [entries [runs]]\n", argv[0]);
+		return 2;
+	}
+
+	if (bench("get_dests", 1, entries, bench_get_dests, runs) ||
+	    bench("get_services", entries, 0, bench_get_services, runs) ||
+	    bench("snapshot", entries / 100 ? entries / 100 : 1, 100,
+		  bench_snapshot, runs))
+		return 1;
+	return 0;
+}
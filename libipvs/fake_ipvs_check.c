@@ -0,0 +1,302 @@
+/*
+ * fake_ipvs_check:	Run libipvs against the IPVS stand-in
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Each request libipvs makes goes through ipvs_ctx_create_transport()
+ * to fake_ipvs, and what comes back is compared with what was put in.
+ * Exits non-zero if anything did not match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "fake_ipvs.h"
+
+static int failed;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed (%s)\n",	\
+				__FILE__, __LINE__, #cond,		\
+				strerror(errno));			\
+			failed++;					\
+		}							\
+	} while (0)
+
+static void make_service(ipvs_service_t *svc, const char *addr, int port)
+{
+	memset(svc, 0, sizeof(*svc));
+	svc->af = AF_INET;
+	svc->protocol = IPPROTO_TCP;
+	inet_pton(AF_INET, addr, &svc->addr.ip);
+	svc->__addr_v4 = svc->addr.ip;
+	svc->port = htons(port);
+	strcpy(svc->sched_name, "wlc");
+	svc->netmask = ~0;
+}
+
+static void make_dest(ipvs_dest_t *dest, const char *addr, int port,
+		      int weight)
+{
+	memset(dest, 0, sizeof(*dest));
+	dest->af = AF_INET;
+	inet_pton(AF_INET, addr, &dest->addr.ip);
+	dest->__addr_v4 = dest->addr.ip;
+	dest->port = htons(port);
+	dest->conn_flags = IP_VS_CONN_F_MASQ;
+	dest->weight = weight;
+}
+
+static ipvs_service_entry_t *get_service(ipvs_ctx_t *ctx, ipvs_service_t *svc)
+{
+	return ipvs_ctx_get_service(ctx, svc->fwmark, svc->af, svc->protocol,
+				    svc->addr, svc->port);
+}
+
+static int count_walk(ipvs_service_entry_t *svc, struct ip_vs_get_dests *d,
+		      void *arg)
+{
+	unsigned int *n = arg;
+
+	n[0]++;
+	n[1] += d->num_dests;
+	return 0;
+}
+
+static void check_services(ipvs_ctx_t *ctx)
+{
+	ipvs_service_t svc, svc6;
+	ipvs_service_entry_t *se;
+	struct ip_vs_get_services *s;
+
+	make_service(&svc, "192.168.0.1", 80);
+	CHECK(ipvs_ctx_add_service(ctx, &svc) == 0);
+	CHECK(ipvs_ctx_add_service(ctx, &svc) == -1 && errno == EEXIST);
+
+	strcpy(svc.sched_name, "nosuch");
+	CHECK(ipvs_ctx_update_service(ctx, &svc) == -1 && errno == ENOENT);
+	strcpy(svc.sched_name, "rr");
+	svc.flags = IP_VS_SVC_F_PERSISTENT;
+	svc.timeout = 600;
+	strcpy(svc.pe_name, "sip");
+	CHECK(ipvs_ctx_update_service(ctx, &svc) == 0);
+
+	CHECK((se = get_service(ctx, &svc)) != NULL);
+	if (se) {
+		CHECK(!strcmp(se->sched_name, "rr"));
+		CHECK(!strcmp(se->pe_name, "sip"));
+		CHECK(se->flags & IP_VS_SVC_F_PERSISTENT);
+		CHECK(se->timeout == 600);
+		free(se);
+	}
+
+	/* a firewall mark and an IPv6 service next to it */
+	memset(&svc, 0, sizeof(svc));
+	svc.af = AF_INET;
+	svc.fwmark = 7;
+	strcpy(svc.sched_name, "sh");
+	svc.netmask = ~0;
+	CHECK(ipvs_ctx_add_service(ctx, &svc) == 0);
+
+	memset(&svc6, 0, sizeof(svc6));
+	svc6.af = AF_INET6;
+	svc6.protocol = IPPROTO_UDP;
+	inet_pton(AF_INET6, "2001:db8::1", &svc6.addr.in6);
+	svc6.port = htons(53);
+	strcpy(svc6.sched_name, "lc");
+	svc6.netmask = 128;
+	CHECK(ipvs_ctx_add_service(ctx, &svc6) == 0);
+	CHECK((se = get_service(ctx, &svc6)) != NULL);
+	if (se) {
+		CHECK(!memcmp(&se->addr, &svc6.addr, sizeof(se->addr)));
+		free(se);
+	}
+
+	CHECK((s = ipvs_ctx_get_services(ctx)) != NULL);
+	if (s) {
+		CHECK(s->num_services == 3);
+		free(s);
+	}
+}
+
+static void check_dests(ipvs_ctx_t *ctx)
+{
+	ipvs_service_t svc, none;
+	ipvs_service_entry_t *se;
+	ipvs_dest_t dest;
+	struct ip_vs_get_dests *d;
+	char buf[INET_ADDRSTRLEN];
+	int i;
+
+	make_service(&svc, "192.168.0.1", 80);
+	for (i = 1; i <= 3; i++) {
+		snprintf(buf, sizeof(buf), "10.1.0.%d", i);
+		make_dest(&dest, buf, 8080, i);
+		CHECK(ipvs_ctx_add_dest(ctx, &svc, &dest) == 0);
+	}
+	CHECK(ipvs_ctx_add_dest(ctx, &svc, &dest) == -1 && errno == EEXIST);
+
+	dest.weight = 10;
+	dest.u_threshold = 100;
+	dest.l_threshold = 50;
+	CHECK(ipvs_ctx_update_dest(ctx, &svc, &dest) == 0);
+
+	make_dest(&dest, "10.1.0.1", 8080, 1);
+	CHECK(ipvs_ctx_del_dest(ctx, &svc, &dest) == 0);
+	CHECK(ipvs_ctx_del_dest(ctx, &svc, &dest) == -1 && errno == ENOENT);
+
+	make_service(&none, "192.168.0.99", 80);
+	CHECK(ipvs_ctx_add_dest(ctx, &none, &dest) == -1 && errno == ESRCH);
+
+	CHECK((se = get_service(ctx, &svc)) != NULL);
+	if (!se)
+		return;
+	CHECK((d = ipvs_ctx_get_dests(ctx, se)) != NULL);
+	if (d) {
+		CHECK(d->num_dests == 2);
+		if (d->num_dests == 2) {
+			CHECK(d->entrytable[1].weight == 10);
+			CHECK(d->entrytable[1].u_threshold == 100);
+			CHECK(d->entrytable[1].l_threshold == 50);
+			CHECK((d->entrytable[1].conn_flags &
+			       IP_VS_CONN_F_FWD_MASK) == IP_VS_CONN_F_MASQ);
+		}
+		free(d);
+	}
+	free(se);
+}
+
+static void check_timeout_daemon(ipvs_ctx_t *ctx)
+{
+	ipvs_timeout_t to, *t;
+	ipvs_daemon_t dm, *u;
+
+	memset(&to, 0, sizeof(to));
+	to.tcp_timeout = 1000;
+	to.udp_timeout = 30;
+	CHECK(ipvs_ctx_set_timeout(ctx, &to) == 0);
+	CHECK((t = ipvs_ctx_get_timeout(ctx)) != NULL);
+	if (t) {
+		CHECK(t->tcp_timeout == 1000);
+		CHECK(t->tcp_fin_timeout == 120);
+		CHECK(t->udp_timeout == 30);
+		free(t);
+	}
+
+	memset(&dm, 0, sizeof(dm));
+	dm.state = IP_VS_STATE_BACKUP;
+	strcpy(dm.mcast_ifn, "eth1");
+	dm.syncid = 3;
+	CHECK(ipvs_ctx_start_daemon(ctx, &dm) == 0);
+	CHECK(ipvs_ctx_start_daemon(ctx, &dm) == -1 && errno == EEXIST);
+	CHECK((u = ipvs_ctx_get_daemon(ctx)) != NULL);
+	if (u) {
+		CHECK(u[0].state == IP_VS_STATE_BACKUP);
+		CHECK(!strcmp(u[0].mcast_ifn, "eth1"));
+		CHECK(u[0].syncid == 3);
+		CHECK(u[1].state == 0);
+		free(u);
+	}
+	CHECK(ipvs_ctx_stop_daemon(ctx, &dm) == 0);
+	CHECK(ipvs_ctx_stop_daemon(ctx, &dm) == -1 && errno == ESRCH);
+}
+
+static void check_batch(ipvs_ctx_t *ctx)
+{
+	ipvs_batch_t *b;
+	ipvs_service_t svc;
+	ipvs_dest_t dest;
+	const int *res;
+
+	CHECK((b = ipvs_ctx_batch_begin(ctx)) != NULL);
+	if (!b)
+		return;
+	make_service(&svc, "192.168.0.2", 443);
+	CHECK(ipvs_batch_queue(b, IPVS_CMD_NEW_SERVICE, &svc, NULL) == 0);
+	make_dest(&dest, "10.2.0.1", 443, 1);
+	CHECK(ipvs_batch_queue(b, IPVS_CMD_NEW_DEST, &svc, &dest) == 0);
+	CHECK(ipvs_batch_queue(b, IPVS_CMD_NEW_DEST, &svc, &dest) == 0);
+	make_dest(&dest, "10.2.0.2", 443, 1);
+	CHECK(ipvs_batch_queue(b, IPVS_CMD_NEW_DEST, &svc, &dest) == 0);
+
+	CHECK(ipvs_batch_commit(b) == 1);
+	res = ipvs_batch_results(b);
+	CHECK(res[0] == 0 && res[1] == 0 && res[2] == EEXIST && res[3] == 0);
+	ipvs_batch_free(b);
+}
+
+static void check_snapshot(ipvs_ctx_t *ctx, unsigned int services,
+			   unsigned int dests)
+{
+	ipvs_snapshot_t *s;
+	unsigned int n[2] = { 0, 0 };
+
+	CHECK((s = ipvs_ctx_get_snapshot(ctx)) != NULL);
+	if (s) {
+		CHECK(s->num_services == services);
+		CHECK(s->num_dests == dests);
+		ipvs_free_snapshot(s);
+	}
+	CHECK(ipvs_ctx_walk_services(ctx, NULL, count_walk, n) == 0);
+	CHECK(n[0] == services && n[1] == dests);
+}
+
+int main(int argc, char **argv)
+{
+	fake_ipvs_t *f;
+	struct ipvs_transport *t;
+	ipvs_ctx_t *ctx;
+	ipvs_service_t svc;
+
+	if (!(f = fake_ipvs_create()) || !(t = fake_ipvs_open(f))) {
+		perror("fake_ipvs");
+		return 2;
+	}
+	if (!(ctx = ipvs_ctx_create_transport(t))) {
+		perror("ipvs_ctx_create_transport");
+		return 2;
+	}
+	CHECK(ipvs_ctx_version(ctx) == IP_VS_VERSION_CODE);
+
+	check_services(ctx);
+	check_dests(ctx);
+	check_timeout_daemon(ctx);
+	check_batch(ctx);
+	check_snapshot(ctx, 4, 4);
+
+	memset(&svc, 0, sizeof(svc));
+	CHECK(ipvs_ctx_zero_service(ctx, &svc) == 0);
+	make_service(&svc, "192.168.0.2", 443);
+	CHECK(ipvs_ctx_del_service(ctx, &svc) == 0);
+	CHECK(ipvs_ctx_del_service(ctx, &svc) == -1 && errno == ESRCH);
+	CHECK(ipvs_ctx_zero_service(ctx, &svc) == -1 && errno == ESRCH);
+	check_snapshot(ctx, 3, 2);
+
+	CHECK(ipvs_ctx_flush(ctx) == 0);
+	check_snapshot(ctx, 0, 0);
+
+	/* enough entries that the dumps take many datagrams */
+	CHECK(fake_ipvs_load(f, 1000, 10) == 0);
+	check_snapshot(ctx, 1000, 10000);
+	CHECK(fake_ipvs_load(f, 1, 20000) == 0);
+	check_snapshot(ctx, 1001, 30000);
+
+	ipvs_ctx_destroy(ctx);
+	fake_ipvs_close(t);
+	fake_ipvs_destroy(f);
+
+	if (failed) {
+		fprintf(stderr, "%s: %d checks failed\n", argv[0], failed);
+		return 1;
+	}
+	printf("%s: all checks passed\n", argv[0]);
+	return 0;
+}
@@ -13,12 +13,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #include "libipvs.h"
 
@@ -27,14 +29,35 @@ typedef struct ipvs_servicedest_s {
 	struct ip_vs_dest_kern		dest;
 } ipvs_servicedest_t;
 
-static int sockfd = -1;
-static void* ipvs_func = NULL;
+/*
+ * Everything a caller talks to the kernel through: the sockets, the
+ * last operation for ipvs_ctx_strerror() and the cached ip_vs_getinfo.
+ * A context must only be used by one thread at a time.
+ */
+struct ipvs_ctx {
+	int			sockfd;
+	void			*func;		/* last operation */
+	struct ip_vs_getinfo	*info;
+	struct ip_vs_getinfo	__info;
+#ifdef LIBIPVS_USE_NL
+	struct nl_handle	*sock;
+	int			family;
+	int			try_nl;
+	const struct ipvs_transport *transport;	/* instead of the kernel */
+	struct ipvs_ctx		*dump;		/* second session for walks */
+#endif
+};
+
 struct ip_vs_getinfo ipvs_info;
 
+/* the context behind the ipvs_*() calls that do not take one */
+static ipvs_ctx_t default_ctx = {
+	.sockfd		= -1,
+	.info		= &ipvs_info,
 #ifdef LIBIPVS_USE_NL
-static struct nl_handle *sock = NULL;
-static int family, try_nl = 1;
+	.try_nl		= 1,
 #endif
+};
 
 #define CHECK_IPV4(s, ret) if (s->af && s->af != AF_INET)	\
 	{ errno = EAFNOSUPPORT; return ret; }			\
@@ -49,8 +72,67 @@ static int family, try_nl = 1;
 	CHECK_IPV4(s, ret);					\
 	CHECK_PE(s, ret);
 
+/*
+ * Dump results are built in one growing block of memory: a header such
+ * as struct ip_vs_get_services followed by its entries, or for a
+ * snapshot a sequence of struct ip_vs_get_dests each directly followed
+ * by its entries.  The block is presized when the number of entries is
+ * known and doubled when it runs out, and the caller frees it in one go.
+ */
+#define IPVS_SERVICES_HDRLEN	offsetof(struct ip_vs_get_services, entrytable)
+#define IPVS_DESTS_HDRLEN	offsetof(struct ip_vs_get_dests, entrytable)
+
+struct ipvs_arena {
+	char		*buf;
+	size_t		len;
+	size_t		size;
+	size_t		cur;	/* offset of the header being filled */
+};
+
+static void *ipvs_arena_reserve(struct ipvs_arena *a, size_t len)
+{
+	if (!a->buf || a->len + len > a->size) {
+		size_t size = a->size ? a->size : 4096;
+		char *buf;
+
+		while (size < a->len + len)
+			size *= 2;
+		if (!(buf = realloc(a->buf, size)))
+			return NULL;
+		a->buf = buf;
+		a->size = size;
+	}
+	return a->buf + a->len;
+}
+
+static int ipvs_arena_init(struct ipvs_arena *a, size_t size)
+{
+	memset(a, 0, sizeof(*a));
+	return ipvs_arena_reserve(a, size) ? 0 : -1;
+}
+
+static struct ip_vs_get_dests *
+ipvs_arena_start_dests(struct ipvs_arena *a, ipvs_service_entry_t *svc)
+{
+	struct ip_vs_get_dests *d;
+
+	if (!(d = ipvs_arena_reserve(a, IPVS_DESTS_HDRLEN)))
+		return NULL;
+
+	memset(d, 0, IPVS_DESTS_HDRLEN);
+	d->fwmark = svc->fwmark;
+	d->protocol = svc->protocol;
+	d->addr = svc->addr;
+	d->port = svc->port;
+	d->af = svc->af;
+
+	a->cur = a->len;
+	a->len += IPVS_DESTS_HDRLEN;
+	return d;
+}
+
 #ifdef LIBIPVS_USE_NL
-struct nl_msg *ipvs_nl_message(int cmd, int flags)
+struct nl_msg *ipvs_nl_message(ipvs_ctx_t *ctx, int cmd, int flags)
 {
 	struct nl_msg *msg;
 
@@ -58,7 +140,7 @@ struct nl_msg *ipvs_nl_message(int cmd, int flags)
 	if (!msg)
 		return NULL;
 
-	genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, flags,
+	genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, ctx->family, 0, flags,
 		    cmd, IPVS_GENL_VERSION);
 
 	return msg;
@@ -69,76 +151,344 @@ static int ipvs_nl_noop_cb(struct nl_msg *msg, void *arg)
 	return NL_OK;
 }
 
-int ipvs_nl_send_message(struct nl_msg *msg, nl_recvmsg_msg_cb_t func, void *arg)
+/*
+ * State of one request/reply exchange on the persistent session.
+ * The callbacks below fill it in while nl_recvmsgs() walks the replies.
+ */
+struct ipvs_nl_reply {
+	unsigned int	seq;	/* sequence number of our request */
+	int		done;	/* ACK, NLMSG_DONE or error seen */
+	int		error;	/* errno reported by the kernel */
+};
+
+static int ipvs_nl_seq_check_cb(struct nl_msg *msg, void *arg)
 {
-	int err = EINVAL;
+	struct ipvs_nl_reply *r = (struct ipvs_nl_reply *)arg;
 
-	sock = nl_handle_alloc();
-	if (!sock) {
-		nlmsg_free(msg);
+	/* silently drop anything left over from an earlier request */
+	if (nlmsg_hdr(msg)->nlmsg_seq != r->seq)
+		return NL_SKIP;
+	return NL_OK;
+}
+
+static int ipvs_nl_finish_cb(struct nl_msg *msg, void *arg)
+{
+	struct ipvs_nl_reply *r = (struct ipvs_nl_reply *)arg;
+
+	r->done = 1;
+	return NL_STOP;
+}
+
+static int ipvs_nl_error_cb(struct sockaddr_nl *nla, struct nlmsgerr *nlerr,
+			    void *arg)
+{
+	struct ipvs_nl_reply *r = (struct ipvs_nl_reply *)arg;
+
+	r->done = 1;
+	r->error = -nlerr->error;
+	return NL_SKIP;
+}
+
+/*
+ * libnl-1 hands out netlink port ids from a process-wide table that it
+ * does not lock.  Sessions are opened and closed whenever a context is
+ * created, reconnects after an error or closes, from whatever thread
+ * uses it, so handles are only allocated and freed under this lock.
+ */
+static pthread_mutex_t ipvs_nl_handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct nl_handle *ipvs_nl_handle_alloc(void)
+{
+	struct nl_handle *h;
+
+	pthread_mutex_lock(&ipvs_nl_handle_lock);
+	h = nl_handle_alloc();
+	pthread_mutex_unlock(&ipvs_nl_handle_lock);
+	return h;
+}
+
+static void ipvs_nl_handle_destroy(struct nl_handle *h)
+{
+	pthread_mutex_lock(&ipvs_nl_handle_lock);
+	nl_handle_destroy(h);
+	pthread_mutex_unlock(&ipvs_nl_handle_lock);
+}
+
+static void ipvs_nl_disconnect(ipvs_ctx_t *ctx)
+{
+	if (ctx->sock) {
+		ipvs_nl_handle_destroy(ctx->sock);
+		ctx->sock = NULL;
+	}
+}
+
+/*
+ * Open the generic netlink session and resolve the IPVS family.
+ * The session is kept until ipvs_close() or until it errors out,
+ * in which case the next request reconnects.
+ */
+static int ipvs_nl_connect(ipvs_ctx_t *ctx)
+{
+	if (ctx->sock)
+		return 0;
+
+	ctx->sock = ipvs_nl_handle_alloc();
+	if (!ctx->sock)
 		return -1;
+
+	/* the handle only hands out sequence numbers and the port id */
+	if (ctx->transport) {
+		ctx->family = ctx->transport->family;
+		return 0;
 	}
 
-	if (genl_connect(sock) < 0)
+	if (genl_connect(ctx->sock) < 0)
 		goto fail_genl;
 
-	family = genl_ctrl_resolve(sock, IPVS_GENL_NAME);
-	if (family < 0)
+	ctx->family = genl_ctrl_resolve(ctx->sock, IPVS_GENL_NAME);
+	if (ctx->family < 0)
 		goto fail_genl;
 
-	/* To test connections and set the family */
-	if (msg == NULL) {
-		nl_handle_destroy(sock);
-		sock = NULL;
-		return 0;
+	return 0;
+
+fail_genl:
+	ipvs_nl_disconnect(ctx);
+	return -1;
+}
+
+/*
+ * The kernel runs one dump at a time per socket, so the destinations of
+ * a walk are dumped on a second session.  It is opened by the first
+ * walk on a context and kept until the context is closed; it shares
+ * the info of the first and takes its family before every walk, as
+ * the first may have reconnected and resolved it again since.
+ */
+static int ipvs_nl_connect_dump(ipvs_ctx_t *ctx)
+{
+	ipvs_ctx_t *d = ctx->dump;
+
+	if (!d) {
+		if (!(d = calloc(1, sizeof(*d))))
+			return -1;
+		d->sockfd = -1;
+		d->info = ctx->info;
+		d->try_nl = 1;
+	}
+	if (!d->sock) {
+		if (!(d->sock = ipvs_nl_handle_alloc()) ||
+		    genl_connect(d->sock) < 0) {
+			int err = errno;
+
+			ipvs_nl_disconnect(d);
+			if (d != ctx->dump)
+				free(d);
+			errno = err;
+			return -1;
+		}
+	}
+	d->family = ctx->family;
+	ctx->dump = d;
+	return 0;
+}
+
+/* send a buffer of complete requests */
+static int ipvs_nl_xmit(ipvs_ctx_t *ctx, void *buf, size_t len)
+{
+	if (ctx->transport)
+		return ctx->transport->send(ctx->transport->priv, buf, len);
+	return nl_sendto(ctx->sock, buf, len);
+}
+
+/* receive one datagram of replies into *buf, to be freed by the caller */
+static int ipvs_nl_recv(ipvs_ctx_t *ctx, unsigned char **buf)
+{
+	struct sockaddr_nl nla;
+	int len;
+
+	if (!ctx->transport)
+		return nl_recv(ctx->sock, &nla, buf, NULL);
+
+	if (!(*buf = malloc(IPVS_TRANSPORT_MSGSIZE)))
+		return -ENOMEM;
+	len = ctx->transport->recv(ctx->transport->priv, *buf,
+				   IPVS_TRANSPORT_MSGSIZE);
+	if (len <= 0) {
+		free(*buf);
+		*buf = NULL;
+		return len ? -errno : 0;
+	}
+	return len;
+}
+
+/*
+ * ipvs_nl_send_message() for a transport: the same exchange, but done
+ * by hand as libnl only knows how to talk to its own socket.
+ */
+static int ipvs_nl_transport_exchange(ipvs_ctx_t *ctx, struct nl_msg *msg,
+				      nl_recvmsg_msg_cb_t func, void *arg)
+{
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	unsigned char *buf;
+	struct nlmsghdr *hdr;
+	int len, done = 0, error = 0;
+
+	nlh->nlmsg_type = ctx->family;
+	nlh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+	nlh->nlmsg_pid = nl_socket_get_local_port(ctx->sock);
+	nlh->nlmsg_seq = nl_socket_use_seq(ctx->sock);
+
+	if (ipvs_nl_xmit(ctx, nlh, nlh->nlmsg_len) < 0) {
+		error = errno ? errno : EIO;
+		goto out;
 	}
 
-	if (nl_socket_modify_cb(sock, NL_CB_VALID, NL_CB_CUSTOM, func, arg) != 0)
-		goto fail_genl;
+	while (!done) {
+		if ((len = ipvs_nl_recv(ctx, &buf)) <= 0) {
+			error = len ? -len : EIO;
+			break;
+		}
 
-	if (nl_send_auto_complete(sock, msg) < 0)
+		for (hdr = (struct nlmsghdr *)buf; nlmsg_ok(hdr, len);
+		     hdr = nlmsg_next(hdr, &len)) {
+			struct nl_msg *reply;
+
+			if (hdr->nlmsg_seq != nlh->nlmsg_seq)
+				continue;
+			if (hdr->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+			} else if (hdr->nlmsg_type == NLMSG_ERROR) {
+				/* the ACK, or the error that ends a dump early */
+				error = -((struct nlmsgerr *)nlmsg_data(hdr))->error;
+				done = 1;
+			} else if (!error) {
+				if (!(reply = nlmsg_convert(hdr))) {
+					error = ENOMEM;
+					continue;
+				}
+				if (func(reply, arg) < 0)
+					error = EINVAL;
+				nlmsg_free(reply);
+			}
+		}
+		free(buf);
+	}
+
+out:
+	nlmsg_free(msg);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int ipvs_nl_send_message(ipvs_ctx_t *ctx, struct nl_msg *msg,
+			 nl_recvmsg_msg_cb_t func, void *arg)
+{
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	struct ipvs_nl_reply reply;
+	int dump = nlh->nlmsg_flags & NLM_F_DUMP;
+	int err = EINVAL;
+
+	if (ipvs_nl_connect(ctx) < 0)
 		goto fail_genl;
 
-	if ((err = -nl_recvmsgs_default(sock)) > 0)
+	if (ctx->transport)
+		return ipvs_nl_transport_exchange(ctx, msg, func, arg);
+
+	/* the family id may have changed if we had to reconnect */
+	nlh->nlmsg_type = ctx->family;
+
+	if (nl_send_auto_complete(ctx->sock, msg) < 0) {
+		/* the socket went bad under us, try once more on a new one */
+		ipvs_nl_disconnect(ctx);
+		if (ipvs_nl_connect(ctx) < 0)
+			goto fail_genl;
+		nlh->nlmsg_type = ctx->family;
+		if (nl_send_auto_complete(ctx->sock, msg) < 0)
+			goto fail_genl;
+	}
+
+	memset(&reply, 0, sizeof(reply));
+	reply.seq = nlh->nlmsg_seq;
+
+	if (nl_socket_modify_cb(ctx->sock, NL_CB_VALID, NL_CB_CUSTOM, func, arg) ||
+	    nl_socket_modify_cb(ctx->sock, NL_CB_SEQ_CHECK, NL_CB_CUSTOM,
+				ipvs_nl_seq_check_cb, &reply) ||
+	    nl_socket_modify_cb(ctx->sock, NL_CB_FINISH, NL_CB_CUSTOM,
+				ipvs_nl_finish_cb, &reply) ||
+	    nl_socket_modify_cb(ctx->sock, NL_CB_ACK, NL_CB_CUSTOM,
+				ipvs_nl_finish_cb, &reply) ||
+	    nl_cb_err(nl_socket_get_cb(ctx->sock), NL_CB_CUSTOM,
+		      ipvs_nl_error_cb, &reply))
 		goto fail_genl;
 
+	/*
+	 * A dump ends with NLMSG_DONE; any other request is answered by
+	 * an optional reply followed by the ACK.  Read until we have seen
+	 * the end so that nothing is left behind for the next request.
+	 */
+	while (!reply.done) {
+		if ((err = -nl_recvmsgs_default(ctx->sock)) > 0)
+			goto fail_genl;
+		if (dump)
+			break;
+	}
+
 	nlmsg_free(msg);
 
-	nl_handle_destroy(sock);
+	if (reply.error) {
+		errno = reply.error;
+		return -1;
+	}
 
 	return 0;
 
 fail_genl:
-	nl_handle_destroy(sock);
-	sock = NULL;
+	/* state of the socket is unknown, reconnect on next use */
+	ipvs_nl_disconnect(ctx);
 	nlmsg_free(msg);
 	errno = err;
 	return -1;
 }
 #endif
 
-int ipvs_init(void)
+static int ipvs_ctx_open(ipvs_ctx_t *ctx)
 {
 	socklen_t len;
+	int err;
 
-	ipvs_func = ipvs_init;
+	ctx->func = ipvs_ctx_open;
 
 #ifdef LIBIPVS_USE_NL
-	if (ipvs_nl_send_message(NULL, NULL, NULL) == 0) {
-		try_nl = 1;
-		return ipvs_getinfo();
+	if (ipvs_nl_connect(ctx) == 0) {
+		ctx->try_nl = 1;
+		if (ipvs_ctx_getinfo(ctx) == 0)
+			return 0;
+		/* leave nothing open for the caller to retry on */
+		err = errno;
+		ipvs_nl_disconnect(ctx);
+		errno = err;
+		return -1;
 	}
+	if (ctx->transport)
+		return -1;
 
-	try_nl = 0;
+	ctx->try_nl = 0;
 #endif
 
-	len = sizeof(ipvs_info);
-	if ((sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1)
+	len = sizeof(*ctx->info);
+	if ((ctx->sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1)
 		return -1;
 
-	if (getsockopt(sockfd, IPPROTO_IP, IP_VS_SO_GET_INFO,
-		       (char *)&ipvs_info, &len))
+	if (getsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_GET_INFO,
+		       (char *)ctx->info, &len)) {
+		err = errno;
+		close(ctx->sockfd);
+		ctx->sockfd = -1;
+		errno = err;
 		return -1;
+	}
 
 	return 0;
 }
@@ -149,6 +499,8 @@ static int ipvs_getinfo_parse_cb(struct nl_msg *msg, void *arg)
 	struct nlmsghdr *nlh = nlmsg_hdr(msg);
 	struct nlattr *attrs[IPVS_INFO_ATTR_MAX + 1];
 
+	struct ip_vs_getinfo *info = (struct ip_vs_getinfo *)arg;
+
 	if (genlmsg_parse(nlh, 0, attrs, IPVS_INFO_ATTR_MAX, ipvs_info_policy) != 0)
 		return -1;
 
@@ -156,53 +508,53 @@ static int ipvs_getinfo_parse_cb(struct nl_msg *msg, void *arg)
 	      attrs[IPVS_INFO_ATTR_CONN_TAB_SIZE]))
 		return -1;
 
-	ipvs_info.version = nla_get_u32(attrs[IPVS_INFO_ATTR_VERSION]);
-	ipvs_info.size = nla_get_u32(attrs[IPVS_INFO_ATTR_CONN_TAB_SIZE]);
+	info->version = nla_get_u32(attrs[IPVS_INFO_ATTR_VERSION]);
+	info->size = nla_get_u32(attrs[IPVS_INFO_ATTR_CONN_TAB_SIZE]);
 
 	return NL_OK;
 }
 #endif
 
-int ipvs_getinfo(void)
+int ipvs_ctx_getinfo(ipvs_ctx_t *ctx)
 {
 	socklen_t len;
 
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->try_nl) {
 		struct nl_msg *msg;
-		msg = ipvs_nl_message(IPVS_CMD_GET_INFO, 0);
+		msg = ipvs_nl_message(ctx, IPVS_CMD_GET_INFO, 0);
 		if (msg)
-			return ipvs_nl_send_message(msg, ipvs_getinfo_parse_cb,
-						    NULL);
+			return ipvs_nl_send_message(ctx, msg, ipvs_getinfo_parse_cb,
+						    ctx->info);
 		return -1;
 	}
 #endif
 
-	ipvs_func = ipvs_getinfo;
-	len = sizeof(ipvs_info);
-	return getsockopt(sockfd, IPPROTO_IP, IP_VS_SO_GET_INFO,
-			  (char *)&ipvs_info, &len);
+	ctx->func = ipvs_ctx_getinfo;
+	len = sizeof(*ctx->info);
+	return getsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_GET_INFO,
+			  (char *)ctx->info, &len);
 }
 
 
-unsigned int ipvs_version(void)
+unsigned int ipvs_ctx_version(ipvs_ctx_t *ctx)
 {
-	return ipvs_info.version;
+	return ctx->info->version;
 }
 
 
-int ipvs_flush(void)
+int ipvs_ctx_flush(ipvs_ctx_t *ctx)
 {
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_FLUSH, 0);
-		if (msg && (ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL) == 0))
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_FLUSH, 0);
+		if (msg && (ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL) == 0))
 			return 0;
 
 		return -1;
 	}
 #endif
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_FLUSH, NULL, 0);
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_FLUSH, NULL, 0);
 }
 
 #ifdef LIBIPVS_USE_NL
@@ -241,73 +593,73 @@ nla_put_failure:
 }
 #endif
 
-int ipvs_add_service(ipvs_service_t *svc)
+int ipvs_ctx_add_service(ipvs_ctx_t *ctx, ipvs_service_t *svc)
 {
-	ipvs_func = ipvs_add_service;
+	ctx->func = ipvs_ctx_add_service;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_NEW_SERVICE, 0);
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_NEW_SERVICE, 0);
 		if (!msg) return -1;
 		if (ipvs_nl_fill_service_attr(msg, svc)) {
 			nlmsg_free(msg);
 			return -1;
 		}
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 	}
 #endif
 
 	CHECK_COMPAT_SVC(svc, -1);
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_ADD, (char *)svc,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_ADD, (char *)svc,
 			  sizeof(struct ip_vs_service_kern));
 }
 
 
-int ipvs_update_service(ipvs_service_t *svc)
+int ipvs_ctx_update_service(ipvs_ctx_t *ctx, ipvs_service_t *svc)
 {
-	ipvs_func = ipvs_update_service;
+	ctx->func = ipvs_ctx_update_service;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_SET_SERVICE, 0);
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_SET_SERVICE, 0);
 		if (!msg) return -1;
 		if (ipvs_nl_fill_service_attr(msg, svc)) {
 			nlmsg_free(msg);
 			return -1;
 		}
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 	}
 #endif
 	CHECK_COMPAT_SVC(svc, -1);
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_EDIT, (char *)svc,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_EDIT, (char *)svc,
 			  sizeof(struct ip_vs_service_kern));
 }
 
 
-int ipvs_del_service(ipvs_service_t *svc)
+int ipvs_ctx_del_service(ipvs_ctx_t *ctx, ipvs_service_t *svc)
 {
-	ipvs_func = ipvs_del_service;
+	ctx->func = ipvs_ctx_del_service;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_DEL_SERVICE, 0);
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_DEL_SERVICE, 0);
 		if (!msg) return -1;
 		if (ipvs_nl_fill_service_attr(msg, svc)) {
 			nlmsg_free(msg);
 			return -1;
 		}
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 	}
 #endif
 	CHECK_COMPAT_SVC(svc, -1);
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_DEL, (char *)svc,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_DEL, (char *)svc,
 			  sizeof(struct ip_vs_service_kern));
 }
 
 
-int ipvs_zero_service(ipvs_service_t *svc)
+int ipvs_ctx_zero_service(ipvs_ctx_t *ctx, ipvs_service_t *svc)
 {
-	ipvs_func = ipvs_zero_service;
+	ctx->func = ipvs_ctx_zero_service;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_ZERO, 0);
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_ZERO, 0);
 		if (!msg) return -1;
 
 		if (svc->fwmark
@@ -318,11 +670,11 @@ int ipvs_zero_service(ipvs_service_t *svc)
 				return -1;
 			}
 		}
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 	}
 #endif
 	CHECK_COMPAT_SVC(svc, -1);
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_ZERO, (char *)svc,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_ZERO, (char *)svc,
 			  sizeof(struct ip_vs_service_kern));
 }
 
@@ -350,20 +702,21 @@ nla_put_failure:
 }
 #endif
 
-int ipvs_add_dest(ipvs_service_t *svc, ipvs_dest_t *dest)
+int ipvs_ctx_add_dest(ipvs_ctx_t *ctx, ipvs_service_t *svc,
+		      ipvs_dest_t *dest)
 {
 	ipvs_servicedest_t svcdest;
 
 #ifdef LIBIPVS_USE_NL
-	ipvs_func = ipvs_add_dest;
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_NEW_DEST, 0);
+	ctx->func = ipvs_ctx_add_dest;
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_NEW_DEST, 0);
 		if (!msg) return -1;
 		if (ipvs_nl_fill_service_attr(msg, svc))
 			goto nla_put_failure;
 		if (ipvs_nl_fill_dest_attr(msg, dest))
 			goto nla_put_failure;
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 
 nla_put_failure:
 		nlmsg_free(msg);
@@ -375,25 +728,26 @@ nla_put_failure:
 	CHECK_COMPAT_DEST(dest, -1);
 	memcpy(&svcdest.svc, svc, sizeof(svcdest.svc));
 	memcpy(&svcdest.dest, dest, sizeof(svcdest.dest));
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_ADDDEST,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_ADDDEST,
 			  (char *)&svcdest, sizeof(svcdest));
 }
 
 
-int ipvs_update_dest(ipvs_service_t *svc, ipvs_dest_t *dest)
+int ipvs_ctx_update_dest(ipvs_ctx_t *ctx, ipvs_service_t *svc,
+		         ipvs_dest_t *dest)
 {
 	ipvs_servicedest_t svcdest;
 
-	ipvs_func = ipvs_update_dest;
+	ctx->func = ipvs_ctx_update_dest;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_SET_DEST, 0);
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_SET_DEST, 0);
 		if (!msg) return -1;
 		if (ipvs_nl_fill_service_attr(msg, svc))
 			goto nla_put_failure;
 		if (ipvs_nl_fill_dest_attr(msg, dest))
 			goto nla_put_failure;
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 
 nla_put_failure:
 		nlmsg_free(msg);
@@ -404,25 +758,26 @@ nla_put_failure:
 	CHECK_COMPAT_DEST(dest, -1);
 	memcpy(&svcdest.svc, svc, sizeof(svcdest.svc));
 	memcpy(&svcdest.dest, dest, sizeof(svcdest.dest));
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_EDITDEST,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_EDITDEST,
 			  (char *)&svcdest, sizeof(svcdest));
 }
 
 
-int ipvs_del_dest(ipvs_service_t *svc, ipvs_dest_t *dest)
+int ipvs_ctx_del_dest(ipvs_ctx_t *ctx, ipvs_service_t *svc,
+		      ipvs_dest_t *dest)
 {
 	ipvs_servicedest_t svcdest;
 
-	ipvs_func = ipvs_del_dest;
+	ctx->func = ipvs_ctx_del_dest;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_DEL_DEST, 0);
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_DEL_DEST, 0);
 		if (!msg) return -1;
 		if (ipvs_nl_fill_service_attr(msg, svc))
 			goto nla_put_failure;
 		if (ipvs_nl_fill_dest_attr(msg, dest))
 			goto nla_put_failure;
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 
 nla_put_failure:
 		nlmsg_free(msg);
@@ -434,40 +789,40 @@ nla_put_failure:
 	CHECK_COMPAT_DEST(dest, -1);
 	memcpy(&svcdest.svc, svc, sizeof(svcdest.svc));
 	memcpy(&svcdest.dest, dest, sizeof(svcdest.dest));
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_DELDEST,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_DELDEST,
 			  (char *)&svcdest, sizeof(svcdest));
 }
 
 
-int ipvs_set_timeout(ipvs_timeout_t *to)
+int ipvs_ctx_set_timeout(ipvs_ctx_t *ctx, ipvs_timeout_t *to)
 {
-	ipvs_func = ipvs_set_timeout;
+	ctx->func = ipvs_ctx_set_timeout;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_SET_TIMEOUT, 0);
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_SET_TIMEOUT, 0);
 		if (!msg) return -1;
 		NLA_PUT_U32(msg, IPVS_CMD_ATTR_TIMEOUT_TCP, to->tcp_timeout);
 		NLA_PUT_U32(msg, IPVS_CMD_ATTR_TIMEOUT_TCP_FIN, to->tcp_fin_timeout);
 		NLA_PUT_U32(msg, IPVS_CMD_ATTR_TIMEOUT_UDP, to->udp_timeout);
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 
 nla_put_failure:
 		nlmsg_free(msg);
 		return -1;
 	}
 #endif
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_TIMEOUT, (char *)to,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_TIMEOUT, (char *)to,
 			  sizeof(*to));
 }
 
 
-int ipvs_start_daemon(ipvs_daemon_t *dm)
+int ipvs_ctx_start_daemon(ipvs_ctx_t *ctx, ipvs_daemon_t *dm)
 {
-	ipvs_func = ipvs_start_daemon;
+	ctx->func = ipvs_ctx_start_daemon;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->try_nl) {
 		struct nlattr *nl_daemon;
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_NEW_DAEMON, 0);
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_NEW_DAEMON, 0);
 		if (!msg) return -1;
 
 		nl_daemon = nla_nest_start(msg, IPVS_CMD_ATTR_DAEMON);
@@ -480,25 +835,25 @@ int ipvs_start_daemon(ipvs_daemon_t *dm)
 
 		nla_nest_end(msg, nl_daemon);
 
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 
 nla_put_failure:
 		nlmsg_free(msg);
 		return -1;
 	}
 #endif
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_STARTDAEMON,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_STARTDAEMON,
 			  (char *)dm, sizeof(*dm));
 }
 
 
-int ipvs_stop_daemon(ipvs_daemon_t *dm)
+int ipvs_ctx_stop_daemon(ipvs_ctx_t *ctx, ipvs_daemon_t *dm)
 {
-	ipvs_func = ipvs_stop_daemon;
+	ctx->func = ipvs_ctx_stop_daemon;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->try_nl) {
 		struct nlattr *nl_daemon;
-		struct nl_msg *msg = ipvs_nl_message(IPVS_CMD_DEL_DAEMON, 0);
+		struct nl_msg *msg = ipvs_nl_message(ctx, IPVS_CMD_DEL_DAEMON, 0);
 		if (!msg) return -1;
 
 		nl_daemon = nla_nest_start(msg, IPVS_CMD_ATTR_DAEMON);
@@ -511,17 +866,314 @@ int ipvs_stop_daemon(ipvs_daemon_t *dm)
 
 		nla_nest_end(msg, nl_daemon);
 
-		return ipvs_nl_send_message(msg, ipvs_nl_noop_cb, NULL);
+		return ipvs_nl_send_message(ctx, msg, ipvs_nl_noop_cb, NULL);
 
 nla_put_failure:
 		nlmsg_free(msg);
 		return -1;
 	}
 #endif
-	return setsockopt(sockfd, IPPROTO_IP, IP_VS_SO_SET_STOPDAEMON,
+	return setsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_SET_STOPDAEMON,
 			  (char *)dm, sizeof(*dm));
 }
 
+/*
+ * Batched service and destination updates.  Operations are queued in
+ * order and sent in chunks of IPVS_BATCH_WINDOW netlink messages per
+ * sendmsg, each with its own sequence number, and the ACKs of a chunk
+ * are collected before the next one is sent so that they fit into the
+ * socket receive buffer.
+ */
+#define IPVS_BATCH_WINDOW	128
+
+struct ipvs_batch_op {
+	int			cmd;
+	ipvs_service_t		svc;
+	ipvs_dest_t		dest;
+};
+
+struct ipvs_batch {
+	ipvs_ctx_t		*ctx;
+	struct ipvs_batch_op	*ops;
+	int			*errors;
+	unsigned int		num_ops;
+	unsigned int		size;
+};
+
+ipvs_batch_t *ipvs_ctx_batch_begin(ipvs_ctx_t *ctx)
+{
+	ipvs_batch_t *b;
+
+	if (!(b = calloc(1, sizeof(*b))))
+		return NULL;
+	b->ctx = ctx;
+	return b;
+}
+
+/* only service and destination updates can be batched */
+static int ipvs_batch_check(int cmd, ipvs_dest_t *dest)
+{
+	switch (cmd) {
+	case IPVS_CMD_NEW_SERVICE:
+	case IPVS_CMD_SET_SERVICE:
+	case IPVS_CMD_DEL_SERVICE:
+		break;
+	case IPVS_CMD_NEW_DEST:
+	case IPVS_CMD_SET_DEST:
+	case IPVS_CMD_DEL_DEST:
+		if (dest)
+			break;
+		/* fall through */
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int ipvs_batch_queue(ipvs_batch_t *b, int cmd, ipvs_service_t *svc,
+		     ipvs_dest_t *dest)
+{
+	struct ipvs_batch_op *op;
+
+	if (ipvs_batch_check(cmd, dest))
+		return -1;
+
+	if (b->num_ops == b->size) {
+		unsigned int size = b->size ? b->size * 2 : 64;
+
+		op = realloc(b->ops, size * sizeof(*op));
+		if (!op)
+			return -1;
+		b->ops = op;
+		b->size = size;
+	}
+
+	op = &b->ops[b->num_ops++];
+	memset(op, 0, sizeof(*op));
+	op->cmd = cmd;
+	op->svc = *svc;
+	if (dest)
+		op->dest = *dest;
+	return 0;
+}
+
+static int ipvs_batch_run_one(ipvs_ctx_t *ctx, struct ipvs_batch_op *op)
+{
+	switch (op->cmd) {
+	case IPVS_CMD_NEW_SERVICE:
+		return ipvs_ctx_add_service(ctx, &op->svc);
+	case IPVS_CMD_SET_SERVICE:
+		return ipvs_ctx_update_service(ctx, &op->svc);
+	case IPVS_CMD_DEL_SERVICE:
+		return ipvs_ctx_del_service(ctx, &op->svc);
+	case IPVS_CMD_NEW_DEST:
+		return ipvs_ctx_add_dest(ctx, &op->svc, &op->dest);
+	case IPVS_CMD_SET_DEST:
+		return ipvs_ctx_update_dest(ctx, &op->svc, &op->dest);
+	case IPVS_CMD_DEL_DEST:
+		return ipvs_ctx_del_dest(ctx, &op->svc, &op->dest);
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+#ifdef LIBIPVS_USE_NL
+/* build the request for a service or destination update */
+static struct nl_msg *ipvs_nl_update_message(ipvs_ctx_t *ctx, int cmd,
+					     ipvs_service_t *svc,
+					     ipvs_dest_t *dest, int flags)
+{
+	struct nl_msg *msg;
+
+	msg = ipvs_nl_message(ctx, cmd, flags);
+	if (!msg)
+		return NULL;
+	if (ipvs_nl_fill_service_attr(msg, svc))
+		goto nla_put_failure;
+	if ((cmd == IPVS_CMD_NEW_DEST || cmd == IPVS_CMD_SET_DEST ||
+	     cmd == IPVS_CMD_DEL_DEST) &&
+	    ipvs_nl_fill_dest_attr(msg, dest))
+		goto nla_put_failure;
+	return msg;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+/* append one request to the chunk buffer, returns its sequence number */
+static int ipvs_nl_batch_put(ipvs_ctx_t *ctx, struct ipvs_batch_op *op,
+			     char **buf, size_t *len, size_t *size,
+			     unsigned int *seq)
+{
+	struct nl_msg *msg;
+	struct nlmsghdr *nlh;
+	size_t msglen;
+
+	msg = ipvs_nl_update_message(ctx, op->cmd, &op->svc, &op->dest,
+				     NLM_F_REQUEST | NLM_F_ACK);
+	if (!msg)
+		return -1;
+
+	nlh = nlmsg_hdr(msg);
+	nlh->nlmsg_type = ctx->family;
+	nlh->nlmsg_pid = nl_socket_get_local_port(ctx->sock);
+	nlh->nlmsg_seq = *seq = nl_socket_use_seq(ctx->sock);
+	msglen = NLMSG_ALIGN(nlh->nlmsg_len);
+
+	if (*len + msglen > *size) {
+		size_t nsize = *size ? *size * 2 : 16384;
+		char *nbuf;
+
+		while (nsize < *len + msglen)
+			nsize *= 2;
+		if (!(nbuf = realloc(*buf, nsize)))
+			goto fail;
+		*buf = nbuf;
+		*size = nsize;
+	}
+	memset(*buf + *len, 0, msglen);
+	memcpy(*buf + *len, nlh, nlh->nlmsg_len);
+	*len += msglen;
+
+	nlmsg_free(msg);
+	return 0;
+
+fail:
+	nlmsg_free(msg);
+	return -1;
+}
+
+/* wait for the ACKs of ops [first, first + n) sent starting at seq */
+static int ipvs_nl_batch_collect(ipvs_batch_t *b, unsigned int first,
+				 unsigned int count, unsigned int seq)
+{
+	ipvs_ctx_t *ctx = b->ctx;
+	unsigned char *buf;
+	struct nlmsghdr *hdr;
+	unsigned int n = count;
+	int len;
+
+	while (n) {
+		len = ipvs_nl_recv(ctx, &buf);
+		if (len <= 0) {
+			errno = len ? -len : EIO;
+			return -1;
+		}
+
+		hdr = (struct nlmsghdr *)buf;
+		while (nlmsg_ok(hdr, len)) {
+			unsigned int i = hdr->nlmsg_seq - seq;
+
+			if (hdr->nlmsg_type == NLMSG_ERROR &&
+			    i < count && b->errors[first + i] < 0) {
+				struct nlmsgerr *e = nlmsg_data(hdr);
+
+				b->errors[first + i] = -e->error;
+				n--;
+			}
+			hdr = nlmsg_next(hdr, &len);
+		}
+		free(buf);
+	}
+	return 0;
+}
+
+static int ipvs_nl_batch_commit(ipvs_batch_t *b)
+{
+	ipvs_ctx_t *ctx = b->ctx;
+	char *buf = NULL;
+	size_t len, size = 0;
+	unsigned int first, i, n, seq, s;
+
+	if (ipvs_nl_connect(ctx) < 0)
+		return -1;
+
+	for (first = 0; first < b->num_ops; first += n) {
+		n = b->num_ops - first;
+		if (n > IPVS_BATCH_WINDOW)
+			n = IPVS_BATCH_WINDOW;
+
+		len = 0;
+		seq = 0;
+		for (i = 0; i < n; i++) {
+			if (ipvs_nl_batch_put(ctx, &b->ops[first + i], &buf, &len,
+					      &size, &s))
+				goto fail;
+			if (i == 0)
+				seq = s;
+		}
+
+		if (ipvs_nl_xmit(ctx, buf, len) < 0)
+			goto fail;
+		if (ipvs_nl_batch_collect(b, first, n, seq))
+			goto fail;
+	}
+
+	free(buf);
+	return 0;
+
+fail:
+	/* we cannot tell what is left on the socket, start over next time */
+	ipvs_nl_disconnect(ctx);
+	free(buf);
+	return -1;
+}
+#endif
+
+int ipvs_batch_commit(ipvs_batch_t *b)
+{
+	ipvs_ctx_t *ctx = b->ctx;
+	unsigned int i;
+	int failed = 0;
+
+	free(b->errors);
+	if (!(b->errors = malloc((b->num_ops + 1) * sizeof(int))))
+		return -1;
+	for (i = 0; i < b->num_ops; i++)
+		b->errors[i] = -1;
+
+#ifdef LIBIPVS_USE_NL
+	if (ctx->try_nl) {
+		if (ipvs_nl_batch_commit(b)) {
+			int err = errno ? errno : EIO;
+
+			for (i = 0; i < b->num_ops; i++)
+				if (b->errors[i] < 0)
+					b->errors[i] = err;
+			errno = err;
+			return -1;
+		}
+		for (i = 0; i < b->num_ops; i++)
+			if (b->errors[i])
+				failed++;
+		return failed;
+	}
+#endif
+
+	for (i = 0; i < b->num_ops; i++) {
+		b->errors[i] = ipvs_batch_run_one(ctx, &b->ops[i]) ? errno : 0;
+		if (b->errors[i])
+			failed++;
+	}
+	return failed;
+}
+
+const int *ipvs_batch_results(ipvs_batch_t *b)
+{
+	return b->errors;
+}
+
+void ipvs_batch_free(ipvs_batch_t *b)
+{
+	if (!b)
+		return;
+	free(b->ops);
+	free(b->errors);
+	free(b);
+}
+
 #ifdef LIBIPVS_USE_NL
 static int ipvs_parse_stats(struct ip_vs_stats_user *stats, struct nlattr *nla)
 {
@@ -557,15 +1209,12 @@ static int ipvs_parse_stats(struct ip_vs_stats_user *stats, struct nlattr *nla)
 
 }
 
-static int ipvs_services_parse_cb(struct nl_msg *msg, void *arg)
+static int ipvs_parse_service(struct nl_msg *msg, ipvs_service_entry_t *e)
 {
 	struct nlmsghdr *nlh = nlmsg_hdr(msg);
 	struct nlattr *attrs[IPVS_CMD_ATTR_MAX + 1];
 	struct nlattr *svc_attrs[IPVS_SVC_ATTR_MAX + 1];
-	struct ip_vs_get_services **getp = (struct ip_vs_get_services **)arg;
-	struct ip_vs_get_services *get = (struct ip_vs_get_services *)*getp;
 	struct ip_vs_flags flags;
-	int i = get->num_services;
 
 	if (genlmsg_parse(nlh, 0, attrs, IPVS_CMD_ATTR_MAX, ipvs_cmd_policy) != 0)
 		return -1;
@@ -576,7 +1225,7 @@ static int ipvs_services_parse_cb(struct nl_msg *msg, void *arg)
 	if (nla_parse_nested(svc_attrs, IPVS_SVC_ATTR_MAX, attrs[IPVS_CMD_ATTR_SERVICE], ipvs_service_policy))
 		return -1;
 
-	memset(&(get->entrytable[i]), 0, sizeof(get->entrytable[i]));
+	memset(e, 0, sizeof(*e));
 
 	if (!(svc_attrs[IPVS_SVC_ATTR_AF] &&
 	      (svc_attrs[IPVS_SVC_ATTR_FWMARK] ||
@@ -589,48 +1238,57 @@ static int ipvs_services_parse_cb(struct nl_msg *msg, void *arg)
 	      svc_attrs[IPVS_SVC_ATTR_FLAGS]))
 		return -1;
 
-	get->entrytable[i].af = nla_get_u16(svc_attrs[IPVS_SVC_ATTR_AF]);
+	e->af = nla_get_u16(svc_attrs[IPVS_SVC_ATTR_AF]);
 
 	if (svc_attrs[IPVS_SVC_ATTR_FWMARK])
-		get->entrytable[i].fwmark = nla_get_u32(svc_attrs[IPVS_SVC_ATTR_FWMARK]);
+		e->fwmark = nla_get_u32(svc_attrs[IPVS_SVC_ATTR_FWMARK]);
 	else {
-		get->entrytable[i].protocol = nla_get_u16(svc_attrs[IPVS_SVC_ATTR_PROTOCOL]);
-		memcpy(&(get->entrytable[i].addr), nla_data(svc_attrs[IPVS_SVC_ATTR_ADDR]),
-		       sizeof(get->entrytable[i].addr));
-		get->entrytable[i].port = nla_get_u16(svc_attrs[IPVS_SVC_ATTR_PORT]);
+		e->protocol = nla_get_u16(svc_attrs[IPVS_SVC_ATTR_PROTOCOL]);
+		memcpy(&(e->addr), nla_data(svc_attrs[IPVS_SVC_ATTR_ADDR]),
+		       sizeof(e->addr));
+		e->port = nla_get_u16(svc_attrs[IPVS_SVC_ATTR_PORT]);
 	}
 
-	strncpy(get->entrytable[i].sched_name,
+	strncpy(e->sched_name,
 		nla_get_string(svc_attrs[IPVS_SVC_ATTR_SCHED_NAME]),
 		IP_VS_SCHEDNAME_MAXLEN);
 
 	if (svc_attrs[IPVS_SVC_ATTR_PE_NAME])
-		strncpy(get->entrytable[i].pe_name,
+		strncpy(e->pe_name,
 			nla_get_string(svc_attrs[IPVS_SVC_ATTR_PE_NAME]),
 			IP_VS_PENAME_MAXLEN);
 
-	get->entrytable[i].netmask = nla_get_u32(svc_attrs[IPVS_SVC_ATTR_NETMASK]);
-	get->entrytable[i].timeout = nla_get_u32(svc_attrs[IPVS_SVC_ATTR_TIMEOUT]);
+	e->netmask = nla_get_u32(svc_attrs[IPVS_SVC_ATTR_NETMASK]);
+	e->timeout = nla_get_u32(svc_attrs[IPVS_SVC_ATTR_TIMEOUT]);
 	nla_memcpy(&flags, svc_attrs[IPVS_SVC_ATTR_FLAGS], sizeof(flags));
-	get->entrytable[i].flags = flags.flags & flags.mask;
+	e->flags = flags.flags & flags.mask;
 
-	if (ipvs_parse_stats(&(get->entrytable[i].stats),
+	if (ipvs_parse_stats(&(e->stats),
 			     svc_attrs[IPVS_SVC_ATTR_STATS]) != 0)
 		return -1;
 
-	get->entrytable[i].num_dests = 0;
+	e->num_dests = 0;
+
+	return 0;
+}
+
+static int ipvs_services_parse_cb(struct nl_msg *msg, void *arg)
+{
+	struct ipvs_arena *a = (struct ipvs_arena *)arg;
+	ipvs_service_entry_t *e;
 
-	i++;
+	if (!(e = ipvs_arena_reserve(a, sizeof(*e))))
+		return -1;
+	if (ipvs_parse_service(msg, e) != 0)
+		return -1;
 
-	get->num_services = i;
-	get = realloc(get, sizeof(*get)
-	      + sizeof(ipvs_service_entry_t) * (get->num_services + 1));
-	*getp = get;
+	((struct ip_vs_get_services *)a->buf)->num_services++;
+	a->len += sizeof(*e);
 	return 0;
 }
 #endif
 
-struct ip_vs_get_services *ipvs_get_services(void)
+struct ip_vs_get_services *ipvs_ctx_get_services(ipvs_ctx_t *ctx)
 {
 	struct ip_vs_get_services *get;
 	struct ip_vs_get_services_kern *getk;
@@ -638,35 +1296,39 @@ struct ip_vs_get_services *ipvs_get_services(void)
 	int i;
 
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->try_nl) {
 		struct nl_msg *msg;
-		len = sizeof(*get) +
-			sizeof(ipvs_service_entry_t);
-		if (!(get = malloc(len)))
+		struct ipvs_arena a;
+
+		if (ipvs_arena_init(&a, IPVS_SERVICES_HDRLEN +
+				    sizeof(ipvs_service_entry_t) *
+				    ctx->info->num_services))
 			return NULL;
+		get = (struct ip_vs_get_services *)a.buf;
 		get->num_services = 0;
+		a.len = IPVS_SERVICES_HDRLEN;
 
-		msg = ipvs_nl_message(IPVS_CMD_GET_SERVICE, NLM_F_DUMP);
-		if (msg && (ipvs_nl_send_message(msg, ipvs_services_parse_cb, &get) == 0))
-			return get;
+		msg = ipvs_nl_message(ctx, IPVS_CMD_GET_SERVICE, NLM_F_DUMP);
+		if (msg && (ipvs_nl_send_message(ctx, msg, ipvs_services_parse_cb, &a) == 0))
+			return (struct ip_vs_get_services *)a.buf;
 
-		free(get);
+		free(a.buf);
 		return NULL;
 	}
 #endif
 
 	len = sizeof(*get) +
-		sizeof(ipvs_service_entry_t) * ipvs_info.num_services;
+		sizeof(ipvs_service_entry_t) * ctx->info->num_services;
 	if (!(get = malloc(len)))
 		return NULL;
 	len = sizeof(*getk) +
-		sizeof(struct ip_vs_service_entry_kern) * ipvs_info.num_services;
+		sizeof(struct ip_vs_service_entry_kern) * ctx->info->num_services;
 	if (!(getk = malloc(len)))
 		return NULL;
 
-	ipvs_func = ipvs_get_services;
-	getk->num_services = ipvs_info.num_services;
-	if (getsockopt(sockfd, IPPROTO_IP,
+	ctx->func = ipvs_ctx_get_services;
+	getk->num_services = ctx->info->num_services;
+	if (getsockopt(ctx->sockfd, IPPROTO_IP,
 		       IP_VS_SO_GET_SERVICES, getk, &len) < 0) {
 		free(get);
 		free(getk);
@@ -686,12 +1348,167 @@ struct ip_vs_get_services *ipvs_get_services(void)
 
 typedef int (*qsort_cmp_t)(const void *, const void *);
 
-int
-ipvs_cmp_services(ipvs_service_entry_t *s1, ipvs_service_entry_t *s2)
-{
-	int r, i;
-
-	r = s1->fwmark - s2->fwmark;
+/*
+ * The default orders are sorted on packed keys that compare bytewise:
+ * all fields in network byte order, IPv4 addresses padded to the size
+ * of IPv6 ones.  An MSD radix sort splits the keys on one byte at a
+ * time, skipping bytes that are the same throughout a bucket (af,
+ * protocol, the common prefix of the addresses), and finishes small
+ * buckets by insertion.  Other comparators, and short tables, go
+ * through qsort().
+ */
+#define IPVS_SERVICE_KEYLEN	26	/* fwmark, af, protocol, addr, port */
+#define IPVS_DEST_KEYLEN	20	/* af, addr, port */
+#define IPVS_SORT_KEYLEN	IPVS_SERVICE_KEYLEN
+#define IPVS_SORT_MIN		64
+
+struct ipvs_sort_rec {
+	unsigned char	key[IPVS_SORT_KEYLEN];
+	unsigned int	idx;
+};
+
+typedef void (*ipvs_sort_key_t)(const void *, unsigned char *);
+
+static void ipvs_put_addr(unsigned char *k, __u16 af,
+			  const union nf_inet_addr *addr)
+{
+	if (af == AF_INET6)
+		memcpy(k, &addr->in6, 16);
+	else
+		memcpy(k, &addr->ip, 4);
+}
+
+static void ipvs_service_key(const void *e, unsigned char *k)
+{
+	const ipvs_service_entry_t *s = e;
+	__u32 fwmark = htonl(s->fwmark);
+	__u16 af = htons(s->af);
+	__u16 protocol = htons(s->protocol);
+
+	memset(k, 0, IPVS_SORT_KEYLEN);
+	memcpy(k, &fwmark, 4);
+	memcpy(k + 4, &af, 2);
+	memcpy(k + 6, &protocol, 2);
+	ipvs_put_addr(k + 8, s->af, &s->addr);
+	memcpy(k + 24, &s->port, 2);
+}
+
+static void ipvs_dest_key(const void *e, unsigned char *k)
+{
+	const ipvs_dest_entry_t *d = e;
+	__u16 af = htons(d->af);
+
+	memset(k, 0, IPVS_SORT_KEYLEN);
+	memcpy(k, &af, 2);
+	ipvs_put_addr(k + 2, d->af, &d->addr);
+	memcpy(k + 18, &d->port, 2);
+}
+
+/* sort a[0..n) on key bytes [pos, keylen), b is scratch space */
+static void ipvs_radix_split(struct ipvs_sort_rec *a, struct ipvs_sort_rec *b,
+			     size_t n, size_t pos, size_t keylen)
+{
+	size_t count[256], start[256], sum, i, j;
+
+	if (n < 32) {
+		for (i = 1; i < n; i++) {
+			struct ipvs_sort_rec r = a[i];
+
+			for (j = i; j > 0 && memcmp(a[j - 1].key + pos, r.key + pos,
+						    keylen - pos) > 0; j--)
+				a[j] = a[j - 1];
+			a[j] = r;
+		}
+		return;
+	}
+
+	for (; pos < keylen; pos++) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[a[i].key[pos]]++;
+		if (count[a[0].key[pos]] != n)
+			break;
+	}
+	if (pos == keylen)
+		return;
+
+	for (sum = 0, i = 0; i < 256; i++) {
+		start[i] = sum;
+		sum += count[i];
+	}
+	for (i = 0; i < n; i++)
+		b[start[a[i].key[pos]]++] = a[i];
+	memcpy(a, b, n * sizeof(*a));
+
+	for (sum = 0, i = 0; i < 256; sum += count[i++])
+		if (count[i] > 1)
+			ipvs_radix_split(a + sum, b + sum, count[i], pos + 1,
+					 keylen);
+}
+
+static int ipvs_radix_sort(void *base, size_t n, size_t size,
+			   size_t keylen, ipvs_sort_key_t mkkey)
+{
+	struct ipvs_sort_rec *a, *b;
+	char *tmp;
+	size_t i, j, k;
+
+	a = malloc(n * sizeof(*a));
+	b = malloc(n * sizeof(*b));
+	tmp = malloc(size);
+	if (!a || !b || !tmp) {
+		free(a);
+		free(b);
+		free(tmp);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		mkkey((char *)base + i * size, a[i].key);
+		a[i].idx = i;
+	}
+
+	ipvs_radix_split(a, b, n, 0, keylen);
+
+	/* move the entries into place one permutation cycle at a time */
+	for (i = 0; i < n; i++) {
+		if (a[i].idx == i)
+			continue;
+		memcpy(tmp, (char *)base + i * size, size);
+		for (j = i; (k = a[j].idx) != i; j = k) {
+			memcpy((char *)base + j * size, (char *)base + k * size,
+			       size);
+			a[j].idx = j;
+		}
+		memcpy((char *)base + j * size, tmp, size);
+		a[j].idx = j;
+	}
+
+	free(a);
+	free(b);
+	free(tmp);
+	return 0;
+}
+
+static int ipvs_cmp_u32(__u32 a, __u32 b)
+{
+	return a < b ? -1 : a > b;
+}
+
+static int ipvs_cmp_addr(__u16 af, const union nf_inet_addr *a1,
+			 const union nf_inet_addr *a2)
+{
+	if (af == AF_INET6)
+		return memcmp(&a1->in6, &a2->in6, sizeof(a1->in6));
+	return ipvs_cmp_u32(ntohl(a1->ip), ntohl(a2->ip));
+}
+
+int
+ipvs_cmp_services(ipvs_service_entry_t *s1, ipvs_service_entry_t *s2)
+{
+	int r;
+
+	r = ipvs_cmp_u32(s1->fwmark, s2->fwmark);
 	if (r != 0)
 		return r;
 
@@ -703,11 +1520,7 @@ ipvs_cmp_services(ipvs_service_entry_t *s1, ipvs_service_entry_t *s2)
 	if (r != 0)
 		return r;
 
-	if (s1->af == AF_INET6)
-		for (i = 0; !r && (i < 4); i++)
-			r = ntohl(s1->addr.in6.s6_addr32[i]) - ntohl(s2->addr.in6.s6_addr32[i]);
-	else
-		r = ntohl(s1->addr.ip) - ntohl(s2->addr.ip);
+	r = ipvs_cmp_addr(s1->af, &s1->addr, &s2->addr);
 	if (r != 0)
 		return r;
 
@@ -718,19 +1531,21 @@ ipvs_cmp_services(ipvs_service_entry_t *s1, ipvs_service_entry_t *s2)
 void
 ipvs_sort_services(struct ip_vs_get_services *s, ipvs_service_cmp_t f)
 {
+	if (f == ipvs_cmp_services && s->num_services >= IPVS_SORT_MIN &&
+	    !ipvs_radix_sort(s->entrytable, s->num_services,
+			     sizeof(ipvs_service_entry_t),
+			     IPVS_SERVICE_KEYLEN, ipvs_service_key))
+		return;
 	qsort(s->entrytable, s->num_services,
 	      sizeof(ipvs_service_entry_t), (qsort_cmp_t)f);
 }
 
 #ifdef LIBIPVS_USE_NL
-static int ipvs_dests_parse_cb(struct nl_msg *msg, void *arg)
+static int ipvs_parse_dest(struct nl_msg *msg, ipvs_dest_entry_t *e)
 {
 	struct nlmsghdr *nlh = nlmsg_hdr(msg);
-	struct nlattr *attrs[IPVS_DEST_ATTR_MAX + 1];
-	struct nlattr *dest_attrs[IPVS_SVC_ATTR_MAX + 1];
-	struct ip_vs_get_dests **dp = (struct ip_vs_get_dests **)arg;
-	struct ip_vs_get_dests *d = (struct ip_vs_get_dests *)*dp;
-	int i = d->num_dests;
+	struct nlattr *attrs[IPVS_CMD_ATTR_MAX + 1];
+	struct nlattr *dest_attrs[IPVS_DEST_ATTR_MAX + 1];
 
 	if (genlmsg_parse(nlh, 0, attrs, IPVS_CMD_ATTR_MAX, ipvs_cmd_policy) != 0)
 		return -1;
@@ -741,7 +1556,7 @@ static int ipvs_dests_parse_cb(struct nl_msg *msg, void *arg)
 	if (nla_parse_nested(dest_attrs, IPVS_DEST_ATTR_MAX, attrs[IPVS_CMD_ATTR_DEST], ipvs_dest_policy))
 		return -1;
 
-	memset(&(d->entrytable[i]), 0, sizeof(d->entrytable[i]));
+	memset(e, 0, sizeof(*e));
 
 	if (!(dest_attrs[IPVS_DEST_ATTR_ADDR] &&
 	      dest_attrs[IPVS_DEST_ATTR_PORT] &&
@@ -754,91 +1569,118 @@ static int ipvs_dests_parse_cb(struct nl_msg *msg, void *arg)
 	      dest_attrs[IPVS_DEST_ATTR_PERSIST_CONNS]))
 		return -1;
 
-	memcpy(&(d->entrytable[i].addr),
+	memcpy(&(e->addr),
 	       nla_data(dest_attrs[IPVS_DEST_ATTR_ADDR]),
-	       sizeof(d->entrytable[i].addr));
-	d->entrytable[i].port = nla_get_u16(dest_attrs[IPVS_DEST_ATTR_PORT]);
-	d->entrytable[i].conn_flags = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_FWD_METHOD]);
-	d->entrytable[i].weight = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_WEIGHT]);
-	d->entrytable[i].u_threshold = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_U_THRESH]);
-	d->entrytable[i].l_threshold = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_L_THRESH]);
-	d->entrytable[i].activeconns = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_ACTIVE_CONNS]);
-	d->entrytable[i].inactconns = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_INACT_CONNS]);
-	d->entrytable[i].persistconns = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_PERSIST_CONNS]);
-	d->entrytable[i].af = d->af;
-
-	if (ipvs_parse_stats(&(d->entrytable[i].stats),
+	       sizeof(e->addr));
+	e->port = nla_get_u16(dest_attrs[IPVS_DEST_ATTR_PORT]);
+	e->conn_flags = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_FWD_METHOD]);
+	e->weight = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_WEIGHT]);
+	e->u_threshold = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_U_THRESH]);
+	e->l_threshold = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_L_THRESH]);
+	e->activeconns = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_ACTIVE_CONNS]);
+	e->inactconns = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_INACT_CONNS]);
+	e->persistconns = nla_get_u32(dest_attrs[IPVS_DEST_ATTR_PERSIST_CONNS]);
+
+	if (ipvs_parse_stats(&(e->stats),
 			     dest_attrs[IPVS_DEST_ATTR_STATS]) != 0)
 		return -1;
 
-	i++;
-
-	d->num_dests = i;
-	d = realloc(d, sizeof(*d) + sizeof(ipvs_dest_entry_t) * (d->num_dests + 1));
-	*dp = d;
 	return 0;
 }
+
+static int ipvs_dests_parse_cb(struct nl_msg *msg, void *arg)
+{
+	struct ipvs_arena *a = (struct ipvs_arena *)arg;
+	struct ip_vs_get_dests *d;
+	ipvs_dest_entry_t *e;
+
+	if (!(e = ipvs_arena_reserve(a, sizeof(*e))))
+		return -1;
+	if (ipvs_parse_dest(msg, e) != 0)
+		return -1;
+
+	d = (struct ip_vs_get_dests *)(a->buf + a->cur);
+	e->af = d->af;
+	d->num_dests++;
+	a->len += sizeof(*e);
+	return NL_OK;
+}
+
+/* build the GET_DEST dump request for a service */
+static struct nl_msg *
+ipvs_nl_dests_message(ipvs_ctx_t *ctx, ipvs_service_entry_t *svc)
+{
+	struct nl_msg *msg;
+	struct nlattr *nl_service;
+
+	msg = ipvs_nl_message(ctx, IPVS_CMD_GET_DEST, NLM_F_DUMP);
+	if (!msg)
+		return NULL;
+
+	nl_service = nla_nest_start(msg, IPVS_CMD_ATTR_SERVICE);
+	if (!nl_service)
+		goto nla_put_failure;
+
+	NLA_PUT_U16(msg, IPVS_SVC_ATTR_AF, svc->af);
+
+	if (svc->fwmark) {
+		NLA_PUT_U32(msg, IPVS_SVC_ATTR_FWMARK, svc->fwmark);
+	} else {
+		NLA_PUT_U16(msg, IPVS_SVC_ATTR_PROTOCOL, svc->protocol);
+		NLA_PUT(msg, IPVS_SVC_ATTR_ADDR, sizeof(svc->addr),
+			&svc->addr);
+		NLA_PUT_U16(msg, IPVS_SVC_ATTR_PORT, svc->port);
+	}
+
+	nla_nest_end(msg, nl_service);
+	return msg;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return NULL;
+}
 #endif
 
-struct ip_vs_get_dests *ipvs_get_dests(ipvs_service_entry_t *svc)
+struct ip_vs_get_dests *
+ipvs_ctx_get_dests(ipvs_ctx_t *ctx, ipvs_service_entry_t *svc)
 {
 	struct ip_vs_get_dests *d;
 	struct ip_vs_get_dests_kern *dk;
 	socklen_t len;
 	int i;
 
-	len = sizeof(*d) + sizeof(ipvs_dest_entry_t) * svc->num_dests;
-	if (!(d = malloc(len)))
-		return NULL;
-
-	ipvs_func = ipvs_get_dests;
+	ctx->func = ipvs_ctx_get_dests;
 
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->try_nl) {
 		struct nl_msg *msg;
-		struct nlattr *nl_service;
-		if (svc->num_dests == 0)
-			d = realloc(d,sizeof(*d) + sizeof(ipvs_dest_entry_t));
-		d->fwmark = svc->fwmark;
-		d->protocol = svc->protocol;
-		d->addr = svc->addr;
-		d->port = svc->port;
-		d->num_dests = svc->num_dests;
-		d->af = svc->af;
-
-		msg = ipvs_nl_message(IPVS_CMD_GET_DEST, NLM_F_DUMP);
-		if (!msg)
-			goto ipvs_nl_dest_failure;
-
-		nl_service = nla_nest_start(msg, IPVS_CMD_ATTR_SERVICE);
-		if (!nl_service)
-			goto nla_put_failure;
+		struct ipvs_arena a;
 
-		NLA_PUT_U16(msg, IPVS_SVC_ATTR_AF, svc->af);
+		if (ipvs_arena_init(&a, IPVS_DESTS_HDRLEN +
+				    sizeof(ipvs_dest_entry_t) * svc->num_dests))
+			return NULL;
+		if (!ipvs_arena_start_dests(&a, svc))
+			goto ipvs_nl_dest_failure;
 
-		if (svc->fwmark) {
-			NLA_PUT_U32(msg, IPVS_SVC_ATTR_FWMARK, svc->fwmark);
-		} else {
-			NLA_PUT_U16(msg, IPVS_SVC_ATTR_PROTOCOL, svc->protocol);
-			NLA_PUT(msg, IPVS_SVC_ATTR_ADDR, sizeof(svc->addr),
-				&svc->addr);
-			NLA_PUT_U16(msg, IPVS_SVC_ATTR_PORT, svc->port);
-		}
+		msg = ipvs_nl_dests_message(ctx, svc);
+		if (!msg)
+			goto ipvs_nl_dest_failure;
 
-		nla_nest_end(msg, nl_service);
-		if (ipvs_nl_send_message(msg, ipvs_dests_parse_cb, &d))
+		if (ipvs_nl_send_message(ctx, msg, ipvs_dests_parse_cb, &a))
 			goto ipvs_nl_dest_failure;
 
-		return d;
+		return (struct ip_vs_get_dests *)a.buf;
 
-nla_put_failure:
-		nlmsg_free(msg);
 ipvs_nl_dest_failure:
-		free(d);
+		free(a.buf);
 		return NULL;
 	}
 #endif
 
+	len = sizeof(*d) + sizeof(ipvs_dest_entry_t) * svc->num_dests;
+	if (!(d = malloc(len)))
+		return NULL;
+
 	if (svc->af != AF_INET) {
 	  errno = EAFNOSUPPORT;
 	  free(d);
@@ -855,7 +1697,7 @@ ipvs_nl_dest_failure:
 	dk->port = svc->port;
 	dk->num_dests = svc->num_dests;
 
-	if (getsockopt(sockfd, IPPROTO_IP,
+	if (getsockopt(ctx->sockfd, IPPROTO_IP,
 		       IP_VS_SO_GET_DESTS, dk, &len) < 0) {
 		free(d);
 		free(dk);
@@ -877,14 +1719,13 @@ ipvs_nl_dest_failure:
 
 int ipvs_cmp_dests(ipvs_dest_entry_t *d1, ipvs_dest_entry_t *d2)
 {
-	int r = 0, i;
+	int r;
 
-	if (d1->af == AF_INET6)
-		for (i = 0; !r && (i < 4); i++)
-			r = ntohl(d1->addr.in6.s6_addr32[i]) -
-			    ntohl(d2->addr.in6.s6_addr32[i]);
-	else
-		r = ntohl(d1->addr.ip) - ntohl(d2->addr.ip);
+	r = d1->af - d2->af;
+	if (r != 0)
+		return r;
+
+	r = ipvs_cmp_addr(d1->af, &d1->addr, &d2->addr);
 	if (r != 0)
 		return r;
 
@@ -894,13 +1735,271 @@ int ipvs_cmp_dests(ipvs_dest_entry_t *d1, ipvs_dest_entry_t *d2)
 
 void ipvs_sort_dests(struct ip_vs_get_dests *d, ipvs_dest_cmp_t f)
 {
+	if (f == ipvs_cmp_dests && d->num_dests >= IPVS_SORT_MIN &&
+	    !ipvs_radix_sort(d->entrytable, d->num_dests,
+			     sizeof(ipvs_dest_entry_t),
+			     IPVS_DEST_KEYLEN, ipvs_dest_key))
+		return;
 	qsort(d->entrytable, d->num_dests,
 	      sizeof(ipvs_dest_entry_t), (qsort_cmp_t)f);
 }
 
 
+static int ipvs_snapshot_dests(ipvs_ctx_t *ctx, struct ipvs_arena *a,
+			       ipvs_service_entry_t *svc)
+{
+	struct ip_vs_get_dests *d;
+	ipvs_dest_entry_t *e;
+
+	if (!ipvs_arena_start_dests(a, svc))
+		return -1;
+
+#ifdef LIBIPVS_USE_NL
+	if (ctx->try_nl) {
+		struct nl_msg *msg = ipvs_nl_dests_message(ctx, svc);
+
+		if (!msg)
+			return -1;
+		if (ipvs_nl_send_message(ctx, msg, ipvs_dests_parse_cb, a)) {
+			/* the service went away since we dumped the services */
+			if (errno == ESRCH)
+				return 0;
+			return -1;
+		}
+		return 0;
+	}
+#endif
+
+	if (!(d = ipvs_ctx_get_dests(ctx, svc)))
+		return errno == ESRCH ? 0 : -1;
+	if (!(e = ipvs_arena_reserve(a, sizeof(*e) * d->num_dests))) {
+		free(d);
+		return -1;
+	}
+	memcpy(e, d->entrytable, sizeof(*e) * d->num_dests);
+	a->len += sizeof(*e) * d->num_dests;
+	((struct ip_vs_get_dests *)(a->buf + a->cur))->num_dests = d->num_dests;
+	free(d);
+	return 0;
+}
+
+ipvs_snapshot_t *
+ipvs_ctx_get_snapshot_filter(ipvs_ctx_t *ctx, ipvs_service_filter_t filter,
+			     void *arg)
+{
+	struct ip_vs_get_services *get;
+	struct ipvs_arena a;
+	ipvs_snapshot_t *s;
+	size_t size;
+	char *p;
+	int i, n;
+
+	if (!(get = ipvs_ctx_get_services(ctx)))
+		return NULL;
+
+	ctx->func = ipvs_ctx_get_snapshot;
+
+	/* drop what the filter rejects before any destination is dumped */
+	if (filter) {
+		for (i = n = 0; i < get->num_services; i++)
+			if (filter(&get->entrytable[i], arg))
+				get->entrytable[n++] = get->entrytable[i];
+		get->num_services = n;
+	}
+
+	if (!(s = malloc(sizeof(*s) + sizeof(s->entrytable[0]) *
+			 get->num_services))) {
+		free(get);
+		return NULL;
+	}
+	s->num_services = get->num_services;
+	s->num_dests = 0;
+
+	/* num_dests is only known when the services came via sockopt */
+	size = 0;
+	for (i = 0; i < get->num_services; i++)
+		size += IPVS_DESTS_HDRLEN + sizeof(ipvs_dest_entry_t) *
+			get->entrytable[i].num_dests;
+	if (ipvs_arena_init(&a, size)) {
+		free(get);
+		free(s);
+		return NULL;
+	}
+
+	for (i = 0; i < get->num_services; i++) {
+		s->entrytable[i].svc = get->entrytable[i];
+		if (ipvs_snapshot_dests(ctx, &a, &get->entrytable[i]))
+			goto fail;
+	}
+	free(get);
+
+	/* the arena no longer moves, link each service to its block */
+	p = a.buf;
+	for (i = 0; i < s->num_services; i++) {
+		struct ip_vs_get_dests *d = (struct ip_vs_get_dests *)p;
+
+		s->entrytable[i].dests = d;
+		s->entrytable[i].svc.num_dests = d->num_dests;
+		s->num_dests += d->num_dests;
+		p += IPVS_DESTS_HDRLEN + sizeof(ipvs_dest_entry_t) * d->num_dests;
+	}
+	s->__dests = a.buf;
+	return s;
+
+fail:
+	free(get);
+	free(a.buf);
+	free(s);
+	return NULL;
+}
+
+
+ipvs_snapshot_t *ipvs_ctx_get_snapshot(ipvs_ctx_t *ctx)
+{
+	return ipvs_ctx_get_snapshot_filter(ctx, NULL, NULL);
+}
+
+
+/*
+ * Walking the table: each service is handed to the caller together with
+ * its destinations, fetched into one arena that is reused for the next
+ * service, so memory does not grow with the size of the table.
+ */
+struct ipvs_walk {
+	ipvs_ctx_t		*ctx;	/* where the destinations are dumped */
+	struct ipvs_arena	a;
+	ipvs_service_filter_t	filter;
+	ipvs_walk_cb_t		func;
+	void			*arg;
+	int			err;
+};
+
+static int ipvs_walk_service(struct ipvs_walk *w, ipvs_service_entry_t *svc)
+{
+	struct ip_vs_get_dests *d;
+
+	if (w->filter && !w->filter(svc, w->arg))
+		return 0;
+
+	w->a.len = 0;
+	if (ipvs_snapshot_dests(w->ctx, &w->a, svc))
+		return -1;
+	d = (struct ip_vs_get_dests *)w->a.buf;
+	svc->num_dests = d->num_dests;
+	return w->func(svc, d, w->arg);
+}
+
+#ifdef LIBIPVS_USE_NL
+static int ipvs_walk_parse_cb(struct nl_msg *msg, void *arg)
+{
+	struct ipvs_walk *w = (struct ipvs_walk *)arg;
+	ipvs_service_entry_t svc;
+
+	if (ipvs_parse_service(msg, &svc) != 0) {
+		w->err = EINVAL;
+		return -1;
+	}
+	if (ipvs_walk_service(w, &svc)) {
+		w->err = errno;
+		return -1;
+	}
+	return NL_OK;
+}
+#endif
+
+int ipvs_ctx_walk_services(ipvs_ctx_t *ctx, ipvs_service_filter_t filter,
+			   ipvs_walk_cb_t func, void *arg)
+{
+	struct ip_vs_get_services *get;
+	struct ipvs_walk w;
+	int i, err, ret = 0;
+
+	memset(&w, 0, sizeof(w));
+	w.filter = filter;
+	w.func = func;
+	w.arg = arg;
+	if (ipvs_arena_init(&w.a, IPVS_DESTS_HDRLEN +
+			    sizeof(ipvs_dest_entry_t) * 64))
+		return -1;
+
+#ifdef LIBIPVS_USE_NL
+	/*
+	 * The destinations go through the second session of ctx while
+	 * the services are still coming in.  A userspace transport
+	 * answers one request at a time and gets the services dumped
+	 * first instead.
+	 */
+	if (ctx->try_nl && !ctx->transport) {
+		struct nl_msg *msg;
+
+		ctx->func = ipvs_ctx_walk_services;
+		if (ipvs_nl_connect(ctx) || ipvs_nl_connect_dump(ctx)) {
+			err = errno;
+			free(w.a.buf);
+			errno = err;
+			return -1;
+		}
+		w.ctx = ctx->dump;
+		msg = ipvs_nl_message(ctx, IPVS_CMD_GET_SERVICE, NLM_F_DUMP);
+		if (!msg || ipvs_nl_send_message(ctx, msg, ipvs_walk_parse_cb,
+						 &w)) {
+			err = w.err ? w.err : errno;
+			ret = -1;
+		}
+
+		free(w.a.buf);
+		if (ret)
+			errno = err;
+		return ret;
+	}
+#endif
+
+	if (!(get = ipvs_ctx_get_services(ctx))) {
+		free(w.a.buf);
+		return -1;
+	}
+
+	ctx->func = ipvs_ctx_walk_services;
+	w.ctx = ctx;
+	for (i = 0; i < get->num_services; i++)
+		if (ipvs_walk_service(&w, &get->entrytable[i])) {
+			ret = -1;
+			break;
+		}
+
+	err = errno;
+	free(get);
+	free(w.a.buf);
+	errno = err;
+	return ret;
+}
+
+
+void ipvs_sort_snapshot(ipvs_snapshot_t *s, ipvs_service_cmp_t f)
+{
+	/* the service entry comes first, so the comparator applies as is */
+	if (f == ipvs_cmp_services && s->num_services >= IPVS_SORT_MIN &&
+	    !ipvs_radix_sort(s->entrytable, s->num_services,
+			     sizeof(s->entrytable[0]),
+			     IPVS_SERVICE_KEYLEN, ipvs_service_key))
+		return;
+	qsort(s->entrytable, s->num_services,
+	      sizeof(s->entrytable[0]), (qsort_cmp_t)f);
+}
+
+
+void ipvs_free_snapshot(ipvs_snapshot_t *s)
+{
+	if (!s)
+		return;
+	free(s->__dests);
+	free(s);
+}
+
+
 ipvs_service_entry_t *
-ipvs_get_service(__u32 fwmark, __u16 af, __u16 protocol, union nf_inet_addr addr, __u16 port)
+ipvs_ctx_get_service(ipvs_ctx_t *ctx, __u32 fwmark, __u16 af, __u16 protocol,
+		     union nf_inet_addr addr, __u16 port)
 {
 	ipvs_service_entry_t *svc;
 	socklen_t len;
@@ -909,7 +2008,7 @@ ipvs_get_service(__u32 fwmark, __u16 af, __u16 protocol, union nf_inet_addr addr
 	if (!(svc = malloc(len)))
 		return NULL;
 
-	ipvs_func = ipvs_get_service;
+	ctx->func = ipvs_ctx_get_service;
 
 	svc->fwmark = fwmark;
 	svc->af = af;
@@ -917,9 +2016,10 @@ ipvs_get_service(__u32 fwmark, __u16 af, __u16 protocol, union nf_inet_addr addr
 	svc->addr = addr;
 	svc->port = port;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->try_nl) {
 		struct ip_vs_get_services *get;
 		struct nl_msg *msg;
+		struct ipvs_arena a;
 		ipvs_service_t tsvc;
 		tsvc.fwmark = fwmark;
 		tsvc.af = af;
@@ -927,26 +2027,29 @@ ipvs_get_service(__u32 fwmark, __u16 af, __u16 protocol, union nf_inet_addr addr
 		tsvc.addr = addr;
 		tsvc.port = port;
 
-		if (!(get = malloc(sizeof(*get) + sizeof(ipvs_service_entry_t))))
+		if (ipvs_arena_init(&a, IPVS_SERVICES_HDRLEN +
+				    sizeof(ipvs_service_entry_t)))
 			goto ipvs_get_service_err2;
-
+		get = (struct ip_vs_get_services *)a.buf;
 		get->num_services = 0;
+		a.len = IPVS_SERVICES_HDRLEN;
 
-		msg = ipvs_nl_message(IPVS_CMD_GET_SERVICE, 0);
+		msg = ipvs_nl_message(ctx, IPVS_CMD_GET_SERVICE, 0);
 		if (!msg) goto ipvs_get_service_err;
 		if (ipvs_nl_fill_service_attr(msg, &tsvc))
 			goto nla_put_failure;
-		if (ipvs_nl_send_message(msg, ipvs_services_parse_cb, &get))
+		if (ipvs_nl_send_message(ctx, msg, ipvs_services_parse_cb, &a))
 			goto ipvs_get_service_err;
 
+		get = (struct ip_vs_get_services *)a.buf;
 		memcpy(svc, &(get->entrytable[0]), sizeof(*svc));
-		free(get);
+		free(a.buf);
 		return svc;
 
 nla_put_failure:
 		nlmsg_free(msg);
 ipvs_get_service_err:
-		free(get);
+		free(a.buf);
 ipvs_get_service_err2:
 		free(svc);
 		return NULL;
@@ -955,7 +2058,7 @@ ipvs_get_service_err2:
 
 	CHECK_COMPAT_SVC(svc, NULL);
 	CHECK_PE(svc, NULL);
-	if (getsockopt(sockfd, IPPROTO_IP, IP_VS_SO_GET_SERVICE,
+	if (getsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_GET_SERVICE,
 		       (char *)svc, &len)) {
 		free(svc);
 		return NULL;
@@ -987,7 +2090,7 @@ static int ipvs_timeout_parse_cb(struct nl_msg *msg, void *arg)
 }
 #endif
 
-ipvs_timeout_t *ipvs_get_timeout(void)
+ipvs_timeout_t *ipvs_ctx_get_timeout(ipvs_ctx_t *ctx)
 {
 	ipvs_timeout_t *u;
 	socklen_t len;
@@ -996,20 +2099,20 @@ ipvs_timeout_t *ipvs_get_timeout(void)
 	if (!(u = malloc(len)))
 		return NULL;
 
-	ipvs_func = ipvs_get_timeout;
+	ctx->func = ipvs_ctx_get_timeout;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->try_nl) {
 		struct nl_msg *msg;
 		memset(u, 0, sizeof(*u));
-		msg = ipvs_nl_message(IPVS_CMD_GET_TIMEOUT, 0);
-		if (msg && (ipvs_nl_send_message(msg, ipvs_timeout_parse_cb, u) == 0))
+		msg = ipvs_nl_message(ctx, IPVS_CMD_GET_TIMEOUT, 0);
+		if (msg && (ipvs_nl_send_message(ctx, msg, ipvs_timeout_parse_cb, u) == 0))
 			return u;
 
 		free(u);
 		return NULL;
 	}
 #endif
-	if (getsockopt(sockfd, IPPROTO_IP, IP_VS_SO_GET_TIMEOUT,
+	if (getsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_GET_TIMEOUT,
 		       (char *)u, &len)) {
 		free(u);
 		return NULL;
@@ -1052,7 +2155,7 @@ static int ipvs_daemon_parse_cb(struct nl_msg *msg, void *arg)
 }
 #endif
 
-ipvs_daemon_t *ipvs_get_daemon(void)
+ipvs_daemon_t *ipvs_ctx_get_daemon(ipvs_ctx_t *ctx)
 {
 	ipvs_daemon_t *u;
 	socklen_t len;
@@ -1063,39 +2166,462 @@ ipvs_daemon_t *ipvs_get_daemon(void)
 	if (!(u = malloc(len)))
 		return NULL;
 
-	ipvs_func = ipvs_get_daemon;
+	ctx->func = ipvs_ctx_get_daemon;
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->try_nl) {
 		struct nl_msg *msg;
 		memset(u, 0, len);
-		msg = ipvs_nl_message(IPVS_CMD_GET_DAEMON, NLM_F_DUMP);
-		if (msg && (ipvs_nl_send_message(msg, ipvs_daemon_parse_cb, u) == 0))
+		msg = ipvs_nl_message(ctx, IPVS_CMD_GET_DAEMON, NLM_F_DUMP);
+		if (msg && (ipvs_nl_send_message(ctx, msg, ipvs_daemon_parse_cb, u) == 0))
 			return u;
 
 		free(u);
 		return NULL;
 	}
 #endif
-	if (getsockopt(sockfd, IPPROTO_IP, IP_VS_SO_GET_DAEMON, (char *)u, &len)) {
+	if (getsockopt(ctx->sockfd, IPPROTO_IP, IP_VS_SO_GET_DAEMON, (char *)u, &len)) {
 		free(u);
 		return NULL;
 	}
 	return u;
 }
 
+/*
+ * Non-blocking interface.  Requests are queued and sent on a netlink
+ * session of their own, and nothing blocks: the caller polls the
+ * session fd and calls ipvs_async_dispatch() when it is readable, which
+ * parses whatever has arrived and runs the callbacks.  The kernel runs
+ * one dump per socket at a time, so a dump holds back the requests
+ * queued after it until it is complete; requests therefore complete in
+ * the order they were submitted.  Updates are sent up to
+ * IPVS_BATCH_WINDOW at a time so that their ACKs fit in the receive
+ * buffer.
+ */
+#ifdef LIBIPVS_USE_NL
+struct ipvs_async_req {
+	struct ipvs_async_req	*next;
+	struct nl_msg		*msg;		/* until sent */
+	unsigned int		seq;
+	int			cmd;
+	int			error;
+	__u16			af;		/* of the dumped destinations */
+	ipvs_async_service_cb_t	service_cb;
+	ipvs_async_dest_cb_t	dest_cb;
+	ipvs_async_done_cb_t	done;
+	void			*arg;
+};
+
+struct ipvs_async_list {
+	struct ipvs_async_req	*head;
+	struct ipvs_async_req	*tail;
+};
+
+struct ipvs_async {
+	struct ipvs_ctx		ctx;
+	struct ipvs_async_list	queued;
+	struct ipvs_async_list	sent;
+	unsigned int		num_sent;
+	int			dumping;
+	int			error;		/* session is unusable */
+};
+
+static void ipvs_async_append(struct ipvs_async_list *l,
+			      struct ipvs_async_req *r)
+{
+	r->next = NULL;
+	if (l->tail)
+		l->tail->next = r;
+	else
+		l->head = r;
+	l->tail = r;
+}
 
-void ipvs_close(void)
+static struct ipvs_async_req *ipvs_async_find(ipvs_async_t *a,
+					      unsigned int seq)
+{
+	struct ipvs_async_req *r;
+
+	for (r = a->sent.head; r; r = r->next)
+		if (r->seq == seq)
+			return r;
+	return NULL;
+}
+
+static void ipvs_async_complete(ipvs_async_t *a, struct ipvs_async_req *r,
+				int err)
+{
+	struct ipvs_async_req **pp;
+
+	for (pp = &a->sent.head; *pp != r; pp = &(*pp)->next)
+		;
+	*pp = r->next;
+	if (a->sent.tail == r) {
+		a->sent.tail = NULL;
+		for (pp = &a->sent.head; *pp; pp = &(*pp)->next)
+			a->sent.tail = *pp;
+	}
+	a->num_sent--;
+	if (r->cmd == IPVS_CMD_GET_SERVICE || r->cmd == IPVS_CMD_GET_DEST)
+		a->dumping = 0;
+
+	if (r->done)
+		r->done(err ? err : r->error, r->arg);
+	free(r);
+}
+
+/* complete everything still outstanding with err */
+static void ipvs_async_fail(ipvs_async_t *a, int err)
+{
+	struct ipvs_async_req *r;
+
+	a->error = err;
+	while (a->sent.head)
+		ipvs_async_complete(a, a->sent.head, err);
+	while ((r = a->queued.head)) {
+		a->queued.head = r->next;
+		nlmsg_free(r->msg);
+		if (r->done)
+			r->done(err, r->arg);
+		free(r);
+	}
+	a->queued.tail = NULL;
+}
+
+/* send queued requests as far as the dump and ACK limits allow */
+static void ipvs_async_kick(ipvs_async_t *a)
+{
+	struct ipvs_async_req *r;
+
+	while ((r = a->queued.head) && !a->dumping &&
+	       a->num_sent < IPVS_BATCH_WINDOW) {
+		if (nl_send_auto_complete(a->ctx.sock, r->msg) < 0) {
+			ipvs_async_fail(a, errno ? errno : EIO);
+			return;
+		}
+		r->seq = nlmsg_hdr(r->msg)->nlmsg_seq;
+		nlmsg_free(r->msg);
+		r->msg = NULL;
+
+		if (!(a->queued.head = r->next))
+			a->queued.tail = NULL;
+		ipvs_async_append(&a->sent, r);
+		a->num_sent++;
+		if (r->cmd == IPVS_CMD_GET_SERVICE || r->cmd == IPVS_CMD_GET_DEST)
+			a->dumping = 1;
+	}
+}
+
+/*
+ * Queue the request described by req, taking over msg.  Once queued,
+ * failures are reported through the done callback only.
+ */
+static int ipvs_async_submit(ipvs_async_t *a, struct nl_msg *msg,
+			     struct ipvs_async_req *req)
+{
+	struct ipvs_async_req *r;
+
+	if (!msg)
+		return -1;
+	if (a->error) {
+		nlmsg_free(msg);
+		errno = a->error;
+		return -1;
+	}
+	if (!(r = malloc(sizeof(*r)))) {
+		nlmsg_free(msg);
+		return -1;
+	}
+	*r = *req;
+	r->msg = msg;
+	ipvs_async_append(&a->queued, r);
+	ipvs_async_kick(a);
+	return 0;
+}
+
+static int ipvs_async_valid_cb(struct nl_msg *msg, void *arg)
+{
+	ipvs_async_t *a = (ipvs_async_t *)arg;
+	struct ipvs_async_req *r;
+
+	r = ipvs_async_find(a, nlmsg_hdr(msg)->nlmsg_seq);
+	if (!r || r->error)
+		return NL_SKIP;
+
+	if (r->cmd == IPVS_CMD_GET_SERVICE) {
+		ipvs_service_entry_t se;
+
+		if (ipvs_parse_service(msg, &se) != 0)
+			r->error = EINVAL;
+		else if (r->service_cb)
+			r->service_cb(&se, r->arg);
+	} else if (r->cmd == IPVS_CMD_GET_DEST) {
+		ipvs_dest_entry_t de;
+
+		if (ipvs_parse_dest(msg, &de) != 0)
+			r->error = EINVAL;
+		else if (r->dest_cb) {
+			de.af = r->af;
+			r->dest_cb(&de, r->arg);
+		}
+	}
+	return NL_OK;
+}
+
+static int ipvs_async_finish_cb(struct nl_msg *msg, void *arg)
+{
+	ipvs_async_t *a = (ipvs_async_t *)arg;
+	struct ipvs_async_req *r;
+
+	if ((r = ipvs_async_find(a, nlmsg_hdr(msg)->nlmsg_seq)))
+		ipvs_async_complete(a, r, 0);
+	/* keep going, the rest of the buffer may belong to other requests */
+	return NL_OK;
+}
+
+static int ipvs_async_error_cb(struct sockaddr_nl *nla,
+			       struct nlmsgerr *nlerr, void *arg)
+{
+	ipvs_async_t *a = (ipvs_async_t *)arg;
+	struct ipvs_async_req *r;
+
+	if ((r = ipvs_async_find(a, nlerr->msg.nlmsg_seq)))
+		ipvs_async_complete(a, r, -nlerr->error);
+	return NL_SKIP;
+}
+
+ipvs_async_t *ipvs_async_create(void)
+{
+	ipvs_async_t *a;
+	struct nl_handle *sock;
+
+	if (!(a = calloc(1, sizeof(*a))))
+		return NULL;
+	a->ctx.sockfd = -1;
+	a->ctx.info = &a->ctx.__info;
+	a->ctx.try_nl = 1;
+
+	if (ipvs_nl_connect(&a->ctx) < 0) {
+		free(a);
+		errno = EPROTONOSUPPORT;
+		return NULL;
+	}
+	sock = a->ctx.sock;
+
+	if (nl_socket_set_nonblocking(sock) < 0 ||
+	    nl_socket_modify_cb(sock, NL_CB_VALID, NL_CB_CUSTOM,
+				ipvs_async_valid_cb, a) ||
+	    nl_socket_modify_cb(sock, NL_CB_SEQ_CHECK, NL_CB_CUSTOM,
+				ipvs_nl_noop_cb, NULL) ||
+	    nl_socket_modify_cb(sock, NL_CB_FINISH, NL_CB_CUSTOM,
+				ipvs_async_finish_cb, a) ||
+	    nl_socket_modify_cb(sock, NL_CB_ACK, NL_CB_CUSTOM,
+				ipvs_async_finish_cb, a) ||
+	    nl_cb_err(nl_socket_get_cb(sock), NL_CB_CUSTOM,
+		      ipvs_async_error_cb, a)) {
+		ipvs_nl_disconnect(&a->ctx);
+		free(a);
+		errno = EINVAL;
+		return NULL;
+	}
+	return a;
+}
+
+int ipvs_async_fd(ipvs_async_t *a)
+{
+	return nl_socket_get_fd(a->ctx.sock);
+}
+
+unsigned int ipvs_async_pending(ipvs_async_t *a)
+{
+	struct ipvs_async_req *r;
+	unsigned int n = a->num_sent;
+
+	for (r = a->queued.head; r; r = r->next)
+		n++;
+	return n;
+}
+
+int ipvs_async_get_services(ipvs_async_t *a, ipvs_async_service_cb_t cb,
+			    ipvs_async_done_cb_t done, void *arg)
+{
+	struct ipvs_async_req r = { .cmd = IPVS_CMD_GET_SERVICE,
+				    .service_cb = cb, .done = done,
+				    .arg = arg };
+
+	return ipvs_async_submit(a, ipvs_nl_message(&a->ctx, r.cmd,
+						    NLM_F_DUMP), &r);
+}
+
+int ipvs_async_get_dests(ipvs_async_t *a, ipvs_service_entry_t *svc,
+			 ipvs_async_dest_cb_t cb, ipvs_async_done_cb_t done,
+			 void *arg)
+{
+	struct ipvs_async_req r = { .cmd = IPVS_CMD_GET_DEST, .af = svc->af,
+				    .dest_cb = cb, .done = done, .arg = arg };
+
+	return ipvs_async_submit(a, ipvs_nl_dests_message(&a->ctx, svc), &r);
+}
+
+int ipvs_async_update(ipvs_async_t *a, int cmd, ipvs_service_t *svc,
+		      ipvs_dest_t *dest, ipvs_async_done_cb_t done, void *arg)
+{
+	struct ipvs_async_req r = { .cmd = cmd, .done = done, .arg = arg };
+
+	if (ipvs_batch_check(cmd, dest))
+		return -1;
+	return ipvs_async_submit(a, ipvs_nl_update_message(&a->ctx, cmd, svc,
+							   dest, 0), &r);
+}
+
+int ipvs_async_dispatch(ipvs_async_t *a)
+{
+	int fd = nl_socket_get_fd(a->ctx.sock);
+	char c;
+	int err;
+
+	while (!a->error) {
+		/* only read what is there, nl_recvmsgs() would wait for more */
+		if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno != EINTR)
+				ipvs_async_fail(a, errno);
+			continue;
+		}
+		if ((err = -nl_recvmsgs_default(a->ctx.sock)) > 0)
+			ipvs_async_fail(a, err);
+		else
+			ipvs_async_kick(a);
+	}
+	errno = a->error;
+	return -1;
+}
+
+void ipvs_async_destroy(ipvs_async_t *a)
+{
+	if (!a)
+		return;
+	if (!a->error)
+		ipvs_async_fail(a, ECANCELED);
+	ipvs_nl_disconnect(&a->ctx);
+	free(a);
+}
+#else
+ipvs_async_t *ipvs_async_create(void)
+{
+	errno = EPROTONOSUPPORT;
+	return NULL;
+}
+
+int ipvs_async_fd(ipvs_async_t *a)
+{
+	return -1;
+}
+
+unsigned int ipvs_async_pending(ipvs_async_t *a)
+{
+	return 0;
+}
+
+int ipvs_async_get_services(ipvs_async_t *a, ipvs_async_service_cb_t cb,
+			    ipvs_async_done_cb_t done, void *arg)
+{
+	errno = EPROTONOSUPPORT;
+	return -1;
+}
+
+int ipvs_async_get_dests(ipvs_async_t *a, ipvs_service_entry_t *svc,
+			 ipvs_async_dest_cb_t cb, ipvs_async_done_cb_t done,
+			 void *arg)
+{
+	errno = EPROTONOSUPPORT;
+	return -1;
+}
+
+int ipvs_async_update(ipvs_async_t *a, int cmd, ipvs_service_t *svc,
+		      ipvs_dest_t *dest, ipvs_async_done_cb_t done, void *arg)
+{
+	errno = EPROTONOSUPPORT;
+	return -1;
+}
+
+int ipvs_async_dispatch(ipvs_async_t *a)
+{
+	errno = EPROTONOSUPPORT;
+	return -1;
+}
+
+void ipvs_async_destroy(ipvs_async_t *a)
+{
+}
+#endif
+
+
+static void ipvs_ctx_close(ipvs_ctx_t *ctx)
 {
 #ifdef LIBIPVS_USE_NL
-	if (try_nl) {
+	if (ctx->dump) {
+		ipvs_nl_disconnect(ctx->dump);
+		free(ctx->dump);
+		ctx->dump = NULL;
+	}
+	if (ctx->try_nl) {
+		ipvs_nl_disconnect(ctx);
 		return;
 	}
 #endif
-	close(sockfd);
+	close(ctx->sockfd);
+	ctx->sockfd = -1;
 }
 
 
-const char *ipvs_strerror(int err)
+ipvs_ctx_t *ipvs_ctx_create_transport(const struct ipvs_transport *t)
+{
+	ipvs_ctx_t *ctx;
+	int err;
+
+#ifndef LIBIPVS_USE_NL
+	if (t) {
+		errno = EPROTONOSUPPORT;
+		return NULL;
+	}
+#endif
+	if (!(ctx = calloc(1, sizeof(*ctx))))
+		return NULL;
+	ctx->sockfd = -1;
+	ctx->info = &ctx->__info;
+#ifdef LIBIPVS_USE_NL
+	ctx->try_nl = 1;
+	ctx->transport = t;
+#endif
+
+	if (ipvs_ctx_open(ctx)) {
+		err = errno;
+		ipvs_ctx_close(ctx);
+		free(ctx);
+		errno = err;
+		return NULL;
+	}
+	return ctx;
+}
+
+
+ipvs_ctx_t *ipvs_ctx_create(void)
+{
+	return ipvs_ctx_create_transport(NULL);
+}
+
+
+void ipvs_ctx_destroy(ipvs_ctx_t *ctx)
+{
+	if (!ctx)
+		return;
+	ipvs_ctx_close(ctx);
+	free(ctx);
+}
+
+
+static const char *ipvs_func_strerror(void *func, int err)
 {
 	unsigned int i;
 	struct table_struct {
@@ -1103,23 +2629,25 @@ const char *ipvs_strerror(int err)
 		int err;
 		const char *message;
 	} table [] = {
-		{ ipvs_add_service, EEXIST, "Service already exists" },
-		{ ipvs_add_service, ENOENT, "Scheduler or persistence engine not found" },
-		{ ipvs_update_service, ESRCH, "No such service" },
-		{ ipvs_update_service, ENOENT, "Scheduler or persistence engine not found" },
-		{ ipvs_del_service, ESRCH, "No such service" },
-		{ ipvs_zero_service, ESRCH, "No such service" },
-		{ ipvs_add_dest, ESRCH, "Service not defined" },
-		{ ipvs_add_dest, EEXIST, "Destination already exists" },
-		{ ipvs_update_dest, ESRCH, "Service not defined" },
-		{ ipvs_update_dest, ENOENT, "No such destination" },
-		{ ipvs_del_dest, ESRCH, "Service not defined" },
-		{ ipvs_del_dest, ENOENT, "No such destination" },
-		{ ipvs_start_daemon, EEXIST, "Daemon has already run" },
-		{ ipvs_stop_daemon, ESRCH, "No daemon is running" },
-		{ ipvs_get_services, ESRCH, "No such service" },
-		{ ipvs_get_dests, ESRCH, "No such service" },
-		{ ipvs_get_service, ESRCH, "No such service" },
+		{ ipvs_ctx_add_service, EEXIST, "Service already exists" },
+		{ ipvs_ctx_add_service, ENOENT, "Scheduler or persistence engine not found" },
+		{ ipvs_ctx_update_service, ESRCH, "No such service" },
+		{ ipvs_ctx_update_service, ENOENT, "Scheduler or persistence engine not found" },
+		{ ipvs_ctx_del_service, ESRCH, "No such service" },
+		{ ipvs_ctx_zero_service, ESRCH, "No such service" },
+		{ ipvs_ctx_add_dest, ESRCH, "Service not defined" },
+		{ ipvs_ctx_add_dest, EEXIST, "Destination already exists" },
+		{ ipvs_ctx_update_dest, ESRCH, "Service not defined" },
+		{ ipvs_ctx_update_dest, ENOENT, "No such destination" },
+		{ ipvs_ctx_del_dest, ESRCH, "Service not defined" },
+		{ ipvs_ctx_del_dest, ENOENT, "No such destination" },
+		{ ipvs_ctx_start_daemon, EEXIST, "Daemon has already run" },
+		{ ipvs_ctx_stop_daemon, ESRCH, "No daemon is running" },
+		{ ipvs_ctx_get_services, ESRCH, "No such service" },
+		{ ipvs_ctx_get_dests, ESRCH, "No such service" },
+		{ ipvs_ctx_get_service, ESRCH, "No such service" },
+		{ ipvs_ctx_get_snapshot, ESRCH, "No such service" },
+		{ ipvs_ctx_walk_services, ESRCH, "No such service" },
 		{ 0, EPERM, "Permission denied (you must be root)" },
 		{ 0, EINVAL, "Invalid operation.  Possibly wrong module version, address not unicast, ..." },
 		{ 0, ENOPROTOOPT, "Protocol not available" },
@@ -1130,10 +2658,183 @@ const char *ipvs_strerror(int err)
 	};
 
 	for (i = 0; i < sizeof(table)/sizeof(struct table_struct); i++) {
-		if ((!table[i].func || table[i].func == ipvs_func)
+		if ((!table[i].func || table[i].func == func)
 		    && table[i].err == err)
 			return table[i].message;
 	}
 
 	return strerror(err);
 }
+
+
+const char *ipvs_ctx_strerror(ipvs_ctx_t *ctx, int err)
+{
+	return ipvs_func_strerror(ctx->func, err);
+}
+
+
+/* the call whose error messages apply to a request of type cmd */
+static void *ipvs_cmd_func(int cmd)
+{
+	static void * const funcs[] = {
+		[IPVS_CMD_NEW_SERVICE]	= ipvs_ctx_add_service,
+		[IPVS_CMD_SET_SERVICE]	= ipvs_ctx_update_service,
+		[IPVS_CMD_DEL_SERVICE]	= ipvs_ctx_del_service,
+		[IPVS_CMD_GET_SERVICE]	= ipvs_ctx_get_services,
+		[IPVS_CMD_NEW_DEST]	= ipvs_ctx_add_dest,
+		[IPVS_CMD_SET_DEST]	= ipvs_ctx_update_dest,
+		[IPVS_CMD_DEL_DEST]	= ipvs_ctx_del_dest,
+		[IPVS_CMD_GET_DEST]	= ipvs_ctx_get_dests,
+	};
+
+	if (cmd < 0 || cmd >= sizeof(funcs)/sizeof(funcs[0]))
+		return NULL;
+	return funcs[cmd];
+}
+
+
+const char *ipvs_batch_strerror(ipvs_batch_t *b, unsigned int i)
+{
+	return ipvs_func_strerror(ipvs_cmd_func(b->ops[i].cmd), b->errors[i]);
+}
+
+
+const char *ipvs_async_strerror(int cmd, int err)
+{
+	return ipvs_func_strerror(ipvs_cmd_func(cmd), err);
+}
+
+
+/*
+ * The original interface: the same calls on one process-wide context,
+ * set up by ipvs_init() and shared with the global ipvs_info.
+ */
+int ipvs_init(void)
+{
+	return ipvs_ctx_open(&default_ctx);
+}
+
+int ipvs_getinfo(void)
+{
+	return ipvs_ctx_getinfo(&default_ctx);
+}
+
+unsigned int ipvs_version(void)
+{
+	return ipvs_ctx_version(&default_ctx);
+}
+
+int ipvs_flush(void)
+{
+	return ipvs_ctx_flush(&default_ctx);
+}
+
+int ipvs_add_service(ipvs_service_t *svc)
+{
+	return ipvs_ctx_add_service(&default_ctx, svc);
+}
+
+int ipvs_update_service(ipvs_service_t *svc)
+{
+	return ipvs_ctx_update_service(&default_ctx, svc);
+}
+
+int ipvs_del_service(ipvs_service_t *svc)
+{
+	return ipvs_ctx_del_service(&default_ctx, svc);
+}
+
+int ipvs_zero_service(ipvs_service_t *svc)
+{
+	return ipvs_ctx_zero_service(&default_ctx, svc);
+}
+
+int ipvs_add_dest(ipvs_service_t *svc, ipvs_dest_t *dest)
+{
+	return ipvs_ctx_add_dest(&default_ctx, svc, dest);
+}
+
+int ipvs_update_dest(ipvs_service_t *svc, ipvs_dest_t *dest)
+{
+	return ipvs_ctx_update_dest(&default_ctx, svc, dest);
+}
+
+int ipvs_del_dest(ipvs_service_t *svc, ipvs_dest_t *dest)
+{
+	return ipvs_ctx_del_dest(&default_ctx, svc, dest);
+}
+
+int ipvs_set_timeout(ipvs_timeout_t *to)
+{
+	return ipvs_ctx_set_timeout(&default_ctx, to);
+}
+
+int ipvs_start_daemon(ipvs_daemon_t *dm)
+{
+	return ipvs_ctx_start_daemon(&default_ctx, dm);
+}
+
+int ipvs_stop_daemon(ipvs_daemon_t *dm)
+{
+	return ipvs_ctx_stop_daemon(&default_ctx, dm);
+}
+
+ipvs_batch_t *ipvs_batch_begin(void)
+{
+	return ipvs_ctx_batch_begin(&default_ctx);
+}
+
+struct ip_vs_get_services *ipvs_get_services(void)
+{
+	return ipvs_ctx_get_services(&default_ctx);
+}
+
+struct ip_vs_get_dests *ipvs_get_dests(ipvs_service_entry_t *svc)
+{
+	return ipvs_ctx_get_dests(&default_ctx, svc);
+}
+
+ipvs_snapshot_t *ipvs_get_snapshot(void)
+{
+	return ipvs_ctx_get_snapshot(&default_ctx);
+}
+
+ipvs_snapshot_t *
+ipvs_get_snapshot_filter(ipvs_service_filter_t filter, void *arg)
+{
+	return ipvs_ctx_get_snapshot_filter(&default_ctx, filter, arg);
+}
+
+int ipvs_walk_services(ipvs_service_filter_t filter, ipvs_walk_cb_t func,
+		       void *arg)
+{
+	return ipvs_ctx_walk_services(&default_ctx, filter, func, arg);
+}
+
+ipvs_service_entry_t *
+ipvs_get_service(__u32 fwmark, __u16 af, __u16 protocol,
+		 union nf_inet_addr addr, __u16 port)
+{
+	return ipvs_ctx_get_service(&default_ctx, fwmark, af, protocol,
+				    addr, port);
+}
+
+ipvs_timeout_t *ipvs_get_timeout(void)
+{
+	return ipvs_ctx_get_timeout(&default_ctx);
+}
+
+ipvs_daemon_t *ipvs_get_daemon(void)
+{
+	return ipvs_ctx_get_daemon(&default_ctx);
+}
+
+void ipvs_close(void)
+{
+	ipvs_ctx_close(&default_ctx);
+}
+
+const char *ipvs_strerror(int err)
+{
+	return ipvs_ctx_strerror(&default_ctx, err);
+}
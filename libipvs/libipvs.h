@@ -40,6 +40,29 @@ typedef struct ip_vs_timeout_user	ipvs_timeout_t;
 typedef struct ip_vs_daemon_user	ipvs_daemon_t;
 typedef struct ip_vs_service_entry	ipvs_service_entry_t;
 typedef struct ip_vs_dest_entry		ipvs_dest_entry_t;
+typedef struct ipvs_batch		ipvs_batch_t;
+typedef struct ipvs_snapshot		ipvs_snapshot_t;
+typedef struct ipvs_ctx			ipvs_ctx_t;
+typedef struct ipvs_async		ipvs_async_t;
+
+/* a virtual service together with all of its destinations */
+struct ipvs_snapshot_entry {
+	ipvs_service_entry_t	svc;
+	struct ip_vs_get_dests	*dests;
+};
+
+/* The result of ipvs_get_snapshot() */
+struct ipvs_snapshot {
+	/* number of virtual services and of destinations in all of them */
+	unsigned int		num_services;
+	unsigned int		num_dests;
+
+	/* block holding every dests array - internal use only */
+	void			*__dests;
+
+	/* service table */
+	struct ipvs_snapshot_entry entrytable[0];
+};
 
 
 /* ipvs info variable */
@@ -88,6 +111,26 @@ extern int ipvs_start_daemon(ipvs_daemon_t *dm);
 extern int ipvs_stop_daemon(ipvs_daemon_t *dm);
 
 
+/* start a batch of service/destination updates */
+extern ipvs_batch_t *ipvs_batch_begin(void);
+
+/* queue IPVS_CMD_{NEW,SET,DEL}_{SERVICE,DEST}, dest is unused for services */
+extern int ipvs_batch_queue(ipvs_batch_t *b, int cmd, ipvs_service_t *svc,
+			    ipvs_dest_t *dest);
+
+/* send the queued updates, returns the number of failed ones or -1 */
+extern int ipvs_batch_commit(ipvs_batch_t *b);
+
+/* errno of each queued update after commit, in queueing order */
+extern const int *ipvs_batch_results(ipvs_batch_t *b);
+
+/* error message for the i-th queued update */
+extern const char *ipvs_batch_strerror(ipvs_batch_t *b, unsigned int i);
+
+/* release the batch */
+extern void ipvs_batch_free(ipvs_batch_t *b);
+
+
 /* get all the ipvs services */
 extern struct ip_vs_get_services *ipvs_get_services(void);
 
@@ -110,6 +153,36 @@ extern int ipvs_cmp_dests(ipvs_dest_entry_t *d1,
 extern void ipvs_sort_dests(struct ip_vs_get_dests *d,
 			    ipvs_dest_cmp_t f);
 
+/* get all the ipvs services with their destinations in one go */
+extern ipvs_snapshot_t *ipvs_get_snapshot(void);
+
+/* decide whether a service is kept, before its destinations are dumped */
+typedef int (*ipvs_service_filter_t)(ipvs_service_entry_t *svc, void *arg);
+
+/* a snapshot of only the services filter keeps */
+extern ipvs_snapshot_t *
+ipvs_get_snapshot_filter(ipvs_service_filter_t filter, void *arg);
+
+/* sort the services of a snapshot, the destinations are left alone */
+extern void ipvs_sort_snapshot(ipvs_snapshot_t *s, ipvs_service_cmp_t f);
+
+/* release a snapshot and all of its destination arrays */
+extern void ipvs_free_snapshot(ipvs_snapshot_t *s);
+
+/*
+ * call func for each service with its destinations as the services are
+ * dumped, unsorted; d is only valid during the call.  A non-zero return
+ * from func stops the walk, which then fails with the errno func left.
+ * Services that filter, if not NULL, rejects are skipped without
+ * dumping their destinations.  arg is passed to both.  Over netlink the
+ * destinations are dumped on a second socket, opened by the first walk
+ * on a context and kept open until the context is closed.
+ */
+typedef int (*ipvs_walk_cb_t)(ipvs_service_entry_t *svc,
+			      struct ip_vs_get_dests *d, void *arg);
+extern int ipvs_walk_services(ipvs_service_filter_t filter,
+			      ipvs_walk_cb_t func, void *arg);
+
 /* get an ipvs service entry */
 extern ipvs_service_entry_t *
 ipvs_get_service(__u32 fwmark, __u16 af, __u16 protocol, union nf_inet_addr addr, __u16 port);
@@ -125,4 +198,123 @@ extern void ipvs_close(void);
 
 extern const char *ipvs_strerror(int err);
 
+
+/*
+ * Reentrant interface.  Each context has its own kernel session and
+ * error state, so threads that each own a context need no locking.
+ * The calls above are these calls on a default context.  libnl-1 hands
+ * out netlink port ids from a process-wide table; libipvs serializes
+ * opening and closing sessions on it internally, whenever a context is
+ * created, reconnects or is destroyed.
+ */
+
+/* open a new context and get ipvs info, NULL on failure */
+extern ipvs_ctx_t *ipvs_ctx_create(void);
+
+/* close the context and free it */
+extern void ipvs_ctx_destroy(ipvs_ctx_t *ctx);
+
+/*
+ * Something other than the kernel answering the IPVS generic netlink
+ * family, e.g. a userspace stand-in for tests and benchmarks.  send gets
+ * one or more complete requests, recv returns one datagram of replies of
+ * at most IPVS_TRANSPORT_MSGSIZE bytes; both return -1 with errno set on
+ * failure.  Replies must follow the kernel: a dump ends with NLMSG_DONE,
+ * any other request with an NLMSG_ERROR carrying 0 or -errno.
+ */
+#define IPVS_TRANSPORT_MSGSIZE	65536
+
+struct ipvs_transport {
+	int	family;			/* generic netlink family id to use */
+	int	(*send)(void *priv, const void *buf, size_t len);
+	int	(*recv)(void *priv, void *buf, size_t len);
+	void	*priv;
+};
+
+/* ipvs_ctx_create() talking to t instead of the kernel, netlink only */
+extern ipvs_ctx_t *ipvs_ctx_create_transport(const struct ipvs_transport *t);
+
+extern int ipvs_ctx_getinfo(ipvs_ctx_t *ctx);
+extern unsigned int ipvs_ctx_version(ipvs_ctx_t *ctx);
+extern int ipvs_ctx_flush(ipvs_ctx_t *ctx);
+extern int ipvs_ctx_add_service(ipvs_ctx_t *ctx, ipvs_service_t *svc);
+extern int ipvs_ctx_update_service(ipvs_ctx_t *ctx, ipvs_service_t *svc);
+extern int ipvs_ctx_del_service(ipvs_ctx_t *ctx, ipvs_service_t *svc);
+extern int ipvs_ctx_zero_service(ipvs_ctx_t *ctx, ipvs_service_t *svc);
+extern int ipvs_ctx_add_dest(ipvs_ctx_t *ctx, ipvs_service_t *svc,
+			     ipvs_dest_t *dest);
+extern int ipvs_ctx_update_dest(ipvs_ctx_t *ctx, ipvs_service_t *svc,
+				ipvs_dest_t *dest);
+extern int ipvs_ctx_del_dest(ipvs_ctx_t *ctx, ipvs_service_t *svc,
+			     ipvs_dest_t *dest);
+extern int ipvs_ctx_set_timeout(ipvs_ctx_t *ctx, ipvs_timeout_t *to);
+extern int ipvs_ctx_start_daemon(ipvs_ctx_t *ctx, ipvs_daemon_t *dm);
+extern int ipvs_ctx_stop_daemon(ipvs_ctx_t *ctx, ipvs_daemon_t *dm);
+
+/* the batch is committed through ctx */
+extern ipvs_batch_t *ipvs_ctx_batch_begin(ipvs_ctx_t *ctx);
+
+extern struct ip_vs_get_services *ipvs_ctx_get_services(ipvs_ctx_t *ctx);
+extern struct ip_vs_get_dests *
+ipvs_ctx_get_dests(ipvs_ctx_t *ctx, ipvs_service_entry_t *svc);
+extern ipvs_snapshot_t *ipvs_ctx_get_snapshot(ipvs_ctx_t *ctx);
+extern ipvs_snapshot_t *
+ipvs_ctx_get_snapshot_filter(ipvs_ctx_t *ctx, ipvs_service_filter_t filter,
+			     void *arg);
+extern int ipvs_ctx_walk_services(ipvs_ctx_t *ctx, ipvs_service_filter_t filter,
+				  ipvs_walk_cb_t func, void *arg);
+extern ipvs_service_entry_t *
+ipvs_ctx_get_service(ipvs_ctx_t *ctx, __u32 fwmark, __u16 af, __u16 protocol,
+		     union nf_inet_addr addr, __u16 port);
+extern ipvs_timeout_t *ipvs_ctx_get_timeout(ipvs_ctx_t *ctx);
+extern ipvs_daemon_t *ipvs_ctx_get_daemon(ipvs_ctx_t *ctx);
+
+/* error message for err as returned by the last call on ctx */
+extern const char *ipvs_ctx_strerror(ipvs_ctx_t *ctx, int err);
+
+
+/*
+ * Non-blocking interface, netlink only.  Poll ipvs_async_fd() for input
+ * and call ipvs_async_dispatch() when it is readable; entries and
+ * completions are delivered through the callbacks from there, in the
+ * order the requests were submitted.  done gets 0 or an errno value.
+ * Submitting returns -1 only if the request could not be queued.
+ * Callbacks may submit further requests but must not destroy the session.
+ */
+typedef void (*ipvs_async_service_cb_t)(ipvs_service_entry_t *se, void *arg);
+typedef void (*ipvs_async_dest_cb_t)(ipvs_dest_entry_t *de, void *arg);
+typedef void (*ipvs_async_done_cb_t)(int err, void *arg);
+
+/* open a non-blocking session, NULL if netlink is not available */
+extern ipvs_async_t *ipvs_async_create(void);
+
+/* the file descriptor to poll for input */
+extern int ipvs_async_fd(ipvs_async_t *a);
+
+/* number of requests not completed yet */
+extern unsigned int ipvs_async_pending(ipvs_async_t *a);
+
+/* dump the services, cb is called for each of them */
+extern int ipvs_async_get_services(ipvs_async_t *a, ipvs_async_service_cb_t cb,
+				   ipvs_async_done_cb_t done, void *arg);
+
+/* dump the destinations of svc, cb is called for each of them */
+extern int ipvs_async_get_dests(ipvs_async_t *a, ipvs_service_entry_t *svc,
+				ipvs_async_dest_cb_t cb,
+				ipvs_async_done_cb_t done, void *arg);
+
+/* IPVS_CMD_{NEW,SET,DEL}_{SERVICE,DEST}, as for ipvs_batch_queue() */
+extern int ipvs_async_update(ipvs_async_t *a, int cmd, ipvs_service_t *svc,
+			     ipvs_dest_t *dest, ipvs_async_done_cb_t done,
+			     void *arg);
+
+/* handle the replies that have arrived, -1 if the session failed */
+extern int ipvs_async_dispatch(ipvs_async_t *a);
+
+/* close the session, outstanding requests complete with ECANCELED */
+extern void ipvs_async_destroy(ipvs_async_t *a);
+
+/* error message for err as passed to done for a request of type cmd */
+extern const char *ipvs_async_strerror(int cmd, int err);
+
 #endif /* _LIBIPVS_H */
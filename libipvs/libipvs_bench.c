@@ -0,0 +1,291 @@
+/*
+ * libipvs_bench:	Time building destination dump results per entry
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * libipvs.c is included so that its static arena and parse callbacks
+ * can be timed on their own, without a kernel.  The result is built
+ * once growing it by one entry at a time, as libipvs used to, and once
+ * in the arena, both presized and not.  With netlink the entries are
+ * also parsed out of a GET_DEST dump put together beforehand, one
+ * message at a time through nlmsg_convert() as libnl hands them over.
+ *
+ * Usage: libipvs_bench [entries [runs]], 100000 entries by default.
+ */
+
+#include <time.h>
+
+#include "libipvs.c"
+
+#define BENCH_FAMILY	0x20
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_dest(ipvs_dest_entry_t *e, unsigned int i)
+{
+	memset(e, 0, sizeof(*e));
+	e->af = AF_INET;
+	e->addr.ip = htonl(0xac100001 + i);
+	e->port = htons(8080);
+	e->weight = 1 + i % 100;
+	e->activeconns = i % 1000;
+	e->stats.conns = i;
+}
+
+/* the number of entries a run got, 0 on failure */
+typedef unsigned int (*bench_fn_t)(unsigned int n);
+
+static unsigned int append_realloc(unsigned int n)
+{
+	struct ip_vs_get_dests *d = calloc(1, IPVS_DESTS_HDRLEN), *nd;
+	unsigned int i;
+
+	for (i = 0; d && i < n; i++) {
+		if (!(nd = realloc(d, IPVS_DESTS_HDRLEN +
+				   sizeof(ipvs_dest_entry_t) * (i + 1)))) {
+			free(d);
+			return 0;
+		}
+		d = nd;
+		fill_dest(&d->entrytable[i], i);
+		d->num_dests++;
+	}
+	n = d ? d->num_dests : 0;
+	free(d);
+	return n;
+}
+
+static unsigned int append_arena(unsigned int n, size_t presize)
+{
+	struct ip_vs_get_dests *d;
+	ipvs_dest_entry_t *e;
+	ipvs_service_entry_t svc;
+	struct ipvs_arena a;
+	unsigned int i;
+
+	memset(&svc, 0, sizeof(svc));
+	if (ipvs_arena_init(&a, IPVS_DESTS_HDRLEN + presize) ||
+	    !ipvs_arena_start_dests(&a, &svc)) {
+		free(a.buf);
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(e = ipvs_arena_reserve(&a, sizeof(*e)))) {
+			free(a.buf);
+			return 0;
+		}
+		fill_dest(e, i);
+		d = (struct ip_vs_get_dests *)(a.buf + a.cur);
+		d->num_dests++;
+		a.len += sizeof(*e);
+	}
+	n = ((struct ip_vs_get_dests *)(a.buf + a.cur))->num_dests;
+	free(a.buf);
+	return n;
+}
+
+static unsigned int append_arena_grown(unsigned int n)
+{
+	return append_arena(n, 0);
+}
+
+static unsigned int append_arena_presized(unsigned int n)
+{
+	return append_arena(n, sizeof(ipvs_dest_entry_t) * n);
+}
+
+#ifdef LIBIPVS_USE_NL
+/* the dump as the kernel would send it, one message per destination */
+static char *dump;
+static size_t dump_len;
+
+static int build_dump(unsigned int n)
+{
+	struct nl_msg *msg;
+	struct nlattr *nest, *stats;
+	ipvs_dest_entry_t e;
+	size_t size = 0, len;
+	unsigned int i;
+	char *buf;
+
+	for (i = 0; i < n; i++) {
+		fill_dest(&e, i);
+		if (!(msg = nlmsg_alloc()))
+			return -1;
+		if (!genlmsg_put(msg, 0, 0, BENCH_FAMILY, 0, NLM_F_MULTI,
+				 IPVS_CMD_NEW_DEST, IPVS_GENL_VERSION) ||
+		    !(nest = nla_nest_start(msg, IPVS_CMD_ATTR_DEST)))
+			goto nla_put_failure;
+		NLA_PUT(msg, IPVS_DEST_ATTR_ADDR, sizeof(e.addr), &e.addr);
+		NLA_PUT_U16(msg, IPVS_DEST_ATTR_PORT, e.port);
+		NLA_PUT_U32(msg, IPVS_DEST_ATTR_FWD_METHOD, IP_VS_CONN_F_MASQ);
+		NLA_PUT_U32(msg, IPVS_DEST_ATTR_WEIGHT, e.weight);
+		NLA_PUT_U32(msg, IPVS_DEST_ATTR_U_THRESH, 0);
+		NLA_PUT_U32(msg, IPVS_DEST_ATTR_L_THRESH, 0);
+		NLA_PUT_U32(msg, IPVS_DEST_ATTR_ACTIVE_CONNS, e.activeconns);
+		NLA_PUT_U32(msg, IPVS_DEST_ATTR_INACT_CONNS, 0);
+		NLA_PUT_U32(msg, IPVS_DEST_ATTR_PERSIST_CONNS, 0);
+		if (!(stats = nla_nest_start(msg, IPVS_DEST_ATTR_STATS)))
+			goto nla_put_failure;
+		NLA_PUT_U32(msg, IPVS_STATS_ATTR_CONNS, e.stats.conns);
+		NLA_PUT_U32(msg, IPVS_STATS_ATTR_INPKTS, 0);
+		NLA_PUT_U32(msg, IPVS_STATS_ATTR_OUTPKTS, 0);
+		NLA_PUT_U64(msg, IPVS_STATS_ATTR_INBYTES, 0);
+		NLA_PUT_U64(msg, IPVS_STATS_ATTR_OUTBYTES, 0);
+		NLA_PUT_U32(msg, IPVS_STATS_ATTR_CPS, 0);
+		NLA_PUT_U32(msg, IPVS_STATS_ATTR_INPPS, 0);
+		NLA_PUT_U32(msg, IPVS_STATS_ATTR_OUTPPS, 0);
+		NLA_PUT_U32(msg, IPVS_STATS_ATTR_INBPS, 0);
+		NLA_PUT_U32(msg, IPVS_STATS_ATTR_OUTBPS, 0);
+		nla_nest_end(msg, stats);
+		nla_nest_end(msg, nest);
+
+		len = NLMSG_ALIGN(nlmsg_hdr(msg)->nlmsg_len);
+		if (dump_len + len > size) {
+			size = size ? size * 2 : 65536;
+			if (!(buf = realloc(dump, size)))
+				goto nla_put_failure;
+			dump = buf;
+		}
+		memcpy(dump + dump_len, nlmsg_hdr(msg), len);
+		dump_len += len;
+		nlmsg_free(msg);
+	}
+	return 0;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -1;
+}
+
+/* hand each message of the dump to func, the way libnl does */
+static int parse_dump(nl_recvmsg_msg_cb_t func, void *arg)
+{
+	struct nlmsghdr *hdr = (struct nlmsghdr *)dump;
+	int len = dump_len;
+	struct nl_msg *msg;
+	int err;
+
+	for (; nlmsg_ok(hdr, len); hdr = nlmsg_next(hdr, &len)) {
+		if (!(msg = nlmsg_convert(hdr)))
+			return -1;
+		err = func(msg, arg);
+		nlmsg_free(msg);
+		if (err < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* ipvs_dests_parse_cb() as it was before the arena */
+static int realloc_dests_parse_cb(struct nl_msg *msg, void *arg)
+{
+	struct ip_vs_get_dests **dp = (struct ip_vs_get_dests **)arg;
+	struct ip_vs_get_dests *d;
+
+	d = realloc(*dp, IPVS_DESTS_HDRLEN +
+		    sizeof(ipvs_dest_entry_t) * ((*dp)->num_dests + 1));
+	if (!d)
+		return -1;
+	*dp = d;
+	if (ipvs_parse_dest(msg, &d->entrytable[d->num_dests]) != 0)
+		return -1;
+	d->num_dests++;
+	return NL_OK;
+}
+
+static unsigned int parse_realloc(unsigned int n)
+{
+	struct ip_vs_get_dests *d = calloc(1, IPVS_DESTS_HDRLEN);
+
+	if (!d || parse_dump(realloc_dests_parse_cb, &d)) {
+		free(d);
+		return 0;
+	}
+	n = d->num_dests;
+	free(d);
+	return n;
+}
+
+static unsigned int parse_arena(unsigned int n, size_t presize)
+{
+	ipvs_service_entry_t svc;
+	struct ipvs_arena a;
+
+	memset(&svc, 0, sizeof(svc));
+	if (ipvs_arena_init(&a, IPVS_DESTS_HDRLEN + presize) ||
+	    !ipvs_arena_start_dests(&a, &svc) ||
+	    parse_dump(ipvs_dests_parse_cb, &a)) {
+		free(a.buf);
+		return 0;
+	}
+	n = ((struct ip_vs_get_dests *)a.buf)->num_dests;
+	free(a.buf);
+	return n;
+}
+
+static unsigned int parse_arena_grown(unsigned int n)
+{
+	return parse_arena(n, 0);
+}
+
+static unsigned int parse_arena_presized(unsigned int n)
+{
+	return parse_arena(n, sizeof(ipvs_dest_entry_t) * n);
+}
+#endif
+
+static int bench(const char *name, bench_fn_t fn, unsigned int n, int runs)
+{
+	double t;
+	int i;
+
+	t = now();
+	for (i = 0; i < runs; i++) {
+		if (fn(n) != n) {
+			fprintf(stderr, "%s: %s\n", name, strerror(errno));
+			return -1;
+		}
+	}
+	t = now() - t;
+	printf("%-24s %8u dests  %7.1f ns/entry\n", name, n,
+	       t * 1e9 / runs / n);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n = argc > 1 ? atoi(argv[1]) : 100000;
+	int runs = argc > 2 ? atoi(argv[2]) : 10;
+
+	if (!n || runs <= 0) {
+		fprintf(stderr, "Usage: %s [entries [runs]]\n", argv[0]);
+		return 2;
+	}
+
+	if (bench("append realloc(+1)", append_realloc, n, runs) ||
+	    bench("append arena", append_arena_grown, n, runs) ||
+	    bench("append arena presized", append_arena_presized, n, runs))
+		return 1;
+#ifdef LIBIPVS_USE_NL
+	if (build_dump(n)) {
+		perror("build_dump");
+		return 1;
+	}
+	if (bench("parse realloc(+1)", parse_realloc, n, runs) ||
+	    bench("parse arena", parse_arena_grown, n, runs) ||
+	    bench("parse arena presized", parse_arena_presized, n, runs))
+		return 1;
+	free(dump);
+#endif
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ *      Output buffer and allocation-free formatters, used to write
+ *      large listings without going through printf for every field.
+ *
+ *      Released under the terms of the GNU GPL
+ *
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "output_buffer.h"
+
+
+/**********************************************************************
+ * output_buffer_init
+ * Set up an output buffer writing to a stream
+ * pre: ob: buffer to set up
+ *      stream: stream the buffer is written to
+ *      size: size of the buffer,
+ *            DEFAULT_OUTPUT_BUFFER_SIZE is used if size is 0
+ * return: 0 on success
+ *         -1 on error
+ **********************************************************************/
+
+int
+output_buffer_init(output_buffer_t * ob, FILE * stream, size_t size)
+{
+  ob->stream = stream;
+  ob->len = 0;
+  ob->size = size ? size : DEFAULT_OUTPUT_BUFFER_SIZE;
+  if ((ob->buf = (char *) malloc(ob->size)) == NULL) {
+    ob->size = 0;
+    return (-1);
+  }
+  return (0);
+}
+
+
+/**********************************************************************
+ * output_buffer_reserve
+ * Get room for writing at the end of the buffer
+ * pre: ob: buffer
+ *      len: number of bytes that will be written at most,
+ *           no more than the size of the buffer
+ * post: the buffer is flushed first if len bytes would not fit,
+ *       its contents are dropped if the stream has failed
+ * return: where to write, pass the end of what was written
+ *         to output_buffer_commit()
+ **********************************************************************/
+
+char *
+output_buffer_reserve(output_buffer_t * ob, size_t len)
+{
+  if (ob->len + len > ob->size) {
+    if (!ferror(ob->stream))
+      fwrite(ob->buf, 1, ob->len, ob->stream);
+    ob->len = 0;
+  }
+  return (ob->buf + ob->len);
+}
+
+
+/**********************************************************************
+ * output_buffer_commit
+ * Add what was written after output_buffer_reserve() to the buffer
+ * pre: ob: buffer
+ *      end: end of the written data
+ **********************************************************************/
+
+void
+output_buffer_commit(output_buffer_t * ob, char *end)
+{
+  ob->len = end - ob->buf;
+}
+
+
+/**********************************************************************
+ * output_buffer_flush
+ * Write the buffer to its stream
+ * pre: ob: buffer
+ * post: the buffer is empty and the stream is flushed, nothing is
+ *       written once the stream has failed
+ **********************************************************************/
+
+void
+output_buffer_flush(output_buffer_t * ob)
+{
+  if (ob->len && !ferror(ob->stream))
+    fwrite(ob->buf, 1, ob->len, ob->stream);
+  ob->len = 0;
+  fflush(ob->stream);
+}
+
+
+/**********************************************************************
+ * output_buffer_set_stream
+ * Send the buffer to another stream
+ * pre: ob: buffer
+ *      stream: stream the buffer is written to from now on
+ * post: what was buffered is written to the old stream first
+ **********************************************************************/
+
+void
+output_buffer_set_stream(output_buffer_t * ob, FILE * stream)
+{
+  if (ob->len)
+    output_buffer_flush(ob);
+  ob->stream = stream;
+}
+
+
+/**********************************************************************
+ * output_buffer_destroy
+ * Flush the buffer and free it
+ * pre: ob: buffer
+ **********************************************************************/
+
+void
+output_buffer_destroy(output_buffer_t * ob)
+{
+  if (ob->buf == NULL)
+    return;
+  output_buffer_flush(ob);
+  free(ob->buf);
+  ob->buf = NULL;
+  ob->size = 0;
+}
+
+
+/**********************************************************************
+ * Formatters
+ **********************************************************************/
+
+char *
+format_str(char *p, const char *s)
+{
+  while (*s)
+    *p++ = *s++;
+  return (p);
+}
+
+
+char *
+format_strn(char *p, const char *s, size_t max)
+{
+  while (*s && max--)
+    *p++ = *s++;
+  return (p);
+}
+
+
+/* digits of v at the end of a 20 byte buffer, returns the first one */
+static char *
+format_digits(char *end, unsigned long long v)
+{
+  do {
+    *--end = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  return (end);
+}
+
+
+char *
+format_uint(char *p, unsigned long long v)
+{
+  char tmp[20], *s;
+
+  s = format_digits(tmp + sizeof(tmp), v);
+  memcpy(p, s, tmp + sizeof(tmp) - s);
+  return (p + (tmp + sizeof(tmp) - s));
+}
+
+
+char *
+format_int(char *p, long long v)
+{
+  if (v < 0) {
+    *p++ = '-';
+    return (format_uint(p, -(unsigned long long) v));
+  }
+  return (format_uint(p, v));
+}
+
+
+char *
+format_uint_right(char *p, unsigned long long v, int width)
+{
+  char tmp[20], *s;
+  int len;
+
+  s = format_digits(tmp + sizeof(tmp), v);
+  len = tmp + sizeof(tmp) - s;
+  while (width-- > len)
+    *p++ = ' ';
+  memcpy(p, s, len);
+  return (p + len);
+}
+
+
+char *
+format_pad(char *p, const char *start, size_t width)
+{
+  while ((size_t) (p - start) < width)
+    *p++ = ' ';
+  return (p);
+}
+
+
+char *
+format_addr(char *p, int af, const void *addr)
+{
+  char buf[INET6_ADDRSTRLEN];
+  const unsigned char *a = addr;
+  int i;
+
+  if (af == AF_INET) {
+    for (i = 0; i < 4; i++) {
+      if (i)
+	*p++ = '.';
+      p = format_uint(p, a[i]);
+    }
+    return (p);
+  }
+
+  /* the rules for shortening IPv6 addresses are best left to libc */
+  if (inet_ntop(af, addr, buf, sizeof(buf)) == NULL)
+    return (p);
+  return (format_str(p, buf));
+}
+
+
+char *
+format_json_str(char *p, const char *s, size_t max)
+{
+  static const char hex[] = "0123456789abcdef";
+  unsigned char c;
+
+  *p++ = '"';
+  while ((c = *s++) && max--) {
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = c;
+    } else if (c < 0x20) {
+      p = format_str(p, "\\u00");
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 0xf];
+    } else
+      *p++ = c;
+  }
+  *p++ = '"';
+  return (p);
+}
@@ -0,0 +1,140 @@
+/*
+ *      Output buffer and allocation-free formatters, used to write
+ *      large listings without going through printf for every field.
+ *
+ *      Released under the terms of the GNU GPL
+ *
+ */
+
+#ifndef OUTPUT_BUFFER_FLIM
+#define OUTPUT_BUFFER_FLIM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Default size of the output buffer, it is written out whenever
+ * a reservation would not fit
+ */
+#define DEFAULT_OUTPUT_BUFFER_SIZE (size_t)65536
+
+/*
+ * Room reserved for one line of a listing. Host and service names
+ * are cut to fit with format_strn()
+ */
+#define OUTPUT_BUFFER_LINE (size_t)2048
+
+
+typedef struct {
+  FILE *stream;
+  char *buf;
+  size_t len;
+  size_t size;
+} output_buffer_t;
+
+
+/**********************************************************************
+ * output_buffer_init
+ * Set up an output buffer writing to a stream
+ * pre: ob: buffer to set up
+ *      stream: stream the buffer is written to
+ *      size: size of the buffer,
+ *            DEFAULT_OUTPUT_BUFFER_SIZE is used if size is 0
+ * return: 0 on success
+ *         -1 on error
+ **********************************************************************/
+
+extern int output_buffer_init(output_buffer_t * ob, FILE * stream,
+			      size_t size);
+
+
+/**********************************************************************
+ * output_buffer_reserve
+ * Get room for writing at the end of the buffer
+ * pre: ob: buffer
+ *      len: number of bytes that will be written at most,
+ *           no more than the size of the buffer
+ * post: the buffer is flushed first if len bytes would not fit,
+ *       its contents are dropped if the stream has failed
+ * return: where to write, pass the end of what was written
+ *         to output_buffer_commit()
+ **********************************************************************/
+
+extern char *output_buffer_reserve(output_buffer_t * ob, size_t len);
+
+
+/**********************************************************************
+ * output_buffer_commit
+ * Add what was written after output_buffer_reserve() to the buffer
+ * pre: ob: buffer
+ *      end: end of the written data
+ **********************************************************************/
+
+extern void output_buffer_commit(output_buffer_t * ob, char *end);
+
+
+/**********************************************************************
+ * output_buffer_flush
+ * Write the buffer to its stream
+ * pre: ob: buffer
+ * post: the buffer is empty and the stream is flushed, nothing is
+ *       written once the stream has failed
+ **********************************************************************/
+
+extern void output_buffer_flush(output_buffer_t * ob);
+
+
+/**********************************************************************
+ * output_buffer_set_stream
+ * Send the buffer to another stream
+ * pre: ob: buffer
+ *      stream: stream the buffer is written to from now on
+ * post: what was buffered is written to the old stream first
+ **********************************************************************/
+
+extern void output_buffer_set_stream(output_buffer_t * ob, FILE * stream);
+
+
+/**********************************************************************
+ * output_buffer_destroy
+ * Flush the buffer and free it
+ * pre: ob: buffer
+ **********************************************************************/
+
+extern void output_buffer_destroy(output_buffer_t * ob);
+
+
+/*
+ * Formatters. Each writes at p and returns the end of what it wrote,
+ * nothing is NUL terminated.
+ */
+
+/* a string */
+extern char *format_str(char *p, const char *s);
+
+/* a string cut to at most max characters */
+extern char *format_strn(char *p, const char *s, size_t max);
+
+/* an unsigned decimal number */
+extern char *format_uint(char *p, unsigned long long v);
+
+/* a signed decimal number */
+extern char *format_int(char *p, long long v);
+
+/* an unsigned number right aligned in width columns, as %*llu */
+extern char *format_uint_right(char *p, unsigned long long v, int width);
+
+/* pad with blanks until what was written from start fills width,
+   as %-*s */
+extern char *format_pad(char *p, const char *start, size_t width);
+
+/* an IPv4 or IPv6 address in numeric form, as inet_ntop() */
+extern char *format_addr(char *p, int af, const void *addr);
+
+/* a quoted JSON string of at most max characters of s,
+   writes up to 6 * max + 2 bytes */
+extern char *format_json_str(char *p, const char *s, size_t max);
+
+#endif